@@ -0,0 +1,369 @@
+/*
+ * ashmem-bench.c
+ *
+ * Measure the cost of ashmem pin, unpin and pin status calls.
+ *
+ * In storm mode each of -t threads owns an ashmem region and keeps
+ * unpinning and re-pinning random page ranges of it. The run is done twice,
+ * first alone and then with another thread forcing the ashmem shrinker
+ * through ASHMEM_PURGE_ALL_CACHES as fast as it can, and the pin/unpin
+ * latency is reported for both. With a lock shared between regions and the
+ * shrinker, the second run shows pins waiting behind the shrinker.
+ *
+ * In ranges mode a single region has every other page unpinned, leaving
+ * -r separate unpinned ranges, and the average cost of unpinning, pinning
+ * and querying single pages at random places in it is reported. That cost
+ * should grow with the log of the number of ranges, not linearly.
+ *
+ * Forcing the shrinker needs CAP_SYS_ADMIN.
+ *
+ * Usage: ashmem-bench [-m storm|ranges] [-t threads] [-s seconds] [-r ranges]
+ *
+ * Compile with
+ *	gcc -O2 -idirafter /usr/src/linux/include/linux ashmem-bench.c \
+ *		-o ashmem-bench -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <linux/types.h>
+
+struct file;	/* for the kernel-only prototypes in ashmem.h */
+#include "ashmem.h"
+
+#define ASHMEM_DEVICE	"/dev/ashmem"
+#define STORM_PAGES	256	/* pages per storm region */
+#define MAX_US		10000	/* latency histogram range */
+
+static const char *mode = "storm";
+static int nthreads = 4;
+static int seconds = 5;
+static int nranges = 10000;
+
+static long page_size;
+static volatile int stop;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Create and map a region of 'pages' pages, all pinned and touched */
+static int region_create(const char *name, long pages)
+{
+	char buf[ASHMEM_NAME_LEN];	/* the driver copies all of it */
+	char *map;
+	long i;
+	int fd;
+
+	fd = open(ASHMEM_DEVICE, O_RDWR);
+	if (fd < 0) {
+		perror(ASHMEM_DEVICE);
+		exit(1);
+	}
+	memset(buf, 0, sizeof(buf));
+	strncpy(buf, name, sizeof(buf) - 1);
+	if (ioctl(fd, ASHMEM_SET_NAME, buf) < 0 ||
+	    ioctl(fd, ASHMEM_SET_SIZE, (size_t) pages * page_size) < 0) {
+		perror("ASHMEM_SET_SIZE");
+		exit(1);
+	}
+
+	/* Pinning needs the region to be mapped */
+	map = mmap(NULL, pages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	for (i = 0; i < pages; i++)
+		map[i * page_size] = 1;
+
+	return fd;
+}
+
+static int pin_call(int fd, int cmd, long page, long pages)
+{
+	struct ashmem_pin pin;
+	int ret;
+
+	pin.offset = page * page_size;
+	pin.len = pages * page_size;
+	ret = ioctl(fd, cmd, &pin);
+	if (ret < 0) {
+		perror(cmd == ASHMEM_PIN ? "ASHMEM_PIN" : cmd == ASHMEM_UNPIN ?
+		       "ASHMEM_UNPIN" : "ASHMEM_GET_PIN_STATUS");
+		exit(1);
+	}
+	return ret;
+}
+
+/* --- storm ------------------------------------------------------------- */
+
+struct stormer {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	unsigned long ops;
+	unsigned long purged;
+	unsigned long hist[MAX_US + 1];	/* per-microsecond latency counts */
+};
+
+static void record(struct stormer *st, double start)
+{
+	long us = (now() - start) * 1e6;
+
+	st->hist[us < MAX_US ? us : MAX_US]++;
+	st->ops++;
+}
+
+static void *storm_fn(void *arg)
+{
+	struct stormer *st = arg;
+	long page, pages;
+	double t;
+
+	while (!stop) {
+		page = rand_r(&st->seed) % STORM_PAGES;
+		pages = 1 + rand_r(&st->seed) % (STORM_PAGES - page < 16 ?
+						 STORM_PAGES - page : 16);
+
+		t = now();
+		pin_call(st->fd, ASHMEM_UNPIN, page, pages);
+		record(st, t);
+
+		t = now();
+		if (pin_call(st->fd, ASHMEM_PIN, page, pages) ==
+		    ASHMEM_WAS_PURGED)
+			st->purged++;
+		record(st, t);
+	}
+
+	return NULL;
+}
+
+static unsigned long purges;
+
+static void *shrink_fn(void *arg)
+{
+	int fd = *(int *) arg;
+
+	while (!stop) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+			perror("ASHMEM_PURGE_ALL_CACHES");
+			exit(1);
+		}
+		purges++;
+	}
+
+	return NULL;
+}
+
+/* Latency below which 'permille' of the 'count' calls in 'hist' fell */
+static long percentile(unsigned long *hist, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	long us;
+
+	for (us = 0; us < MAX_US; us++) {
+		seen += hist[us];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return us;
+}
+
+static void storm_run(struct stormer *st, int shrink)
+{
+	static unsigned long hist[MAX_US + 1];
+	unsigned long ops = 0, purged = 0;
+	pthread_t shrinker;
+	long max;
+	int i, us;
+
+	stop = 0;
+	purges = 0;
+	for (i = 0; i < nthreads; i++) {
+		st[i].ops = st[i].purged = 0;
+		memset(st[i].hist, 0, sizeof(st[i].hist));
+		if (pthread_create(&st[i].thread, NULL, storm_fn, &st[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (shrink && pthread_create(&shrinker, NULL, shrink_fn, &st[0].fd)) {
+		perror("pthread_create");
+		exit(1);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	if (shrink)
+		pthread_join(shrinker, NULL);
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(st[i].thread, NULL);
+		ops += st[i].ops;
+		purged += st[i].purged;
+		for (us = 0; us <= MAX_US; us++)
+			hist[us] += st[i].hist[us];
+	}
+	for (us = MAX_US; us > 0 && !hist[us]; us--)
+		;
+	max = us;
+
+	printf("%s:\n", shrink ? "with shrinker" : "alone");
+	printf("  %lu pin/unpin calls, %.0f calls/s\n", ops,
+	       (double) ops / seconds);
+	printf("  latency us: p50 %ld  p99 %ld  p99.9 %ld  max %ld%s\n",
+	       percentile(hist, ops, 500), percentile(hist, ops, 990),
+	       percentile(hist, ops, 999), max, max == MAX_US ? "+" : "");
+	if (shrink)
+		printf("  %lu shrinker passes, %lu pins found pages purged\n",
+		       purges, purged);
+}
+
+static void run_storm(void)
+{
+	struct stormer *st;
+	char name[32];
+	int i;
+
+	st = calloc(nthreads, sizeof(*st));
+	if (!st) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		snprintf(name, sizeof(name), "ashmem-bench-%d", i);
+		st[i].fd = region_create(name, STORM_PAGES);
+		st[i].seed = i + 1;
+	}
+
+	printf("%d threads, %d page regions, %d s per run\n",
+	       nthreads, STORM_PAGES, seconds);
+	storm_run(st, 0);
+	storm_run(st, 1);
+}
+
+/* --- ranges ------------------------------------------------------------ */
+
+static void run_ranges(void)
+{
+	unsigned int seed = 1;
+	long pages = 2L * nranges + 1;
+	double t, unpin, pin, status;
+	long page;
+	int i, n;
+	int fd;
+
+	fd = region_create("ashmem-bench-ranges", pages);
+
+	/* Unpin every odd page: nranges separate ranges */
+	t = now();
+	for (page = 1; page < pages; page += 2)
+		pin_call(fd, ASHMEM_UNPIN, page, 1);
+	t = now() - t;
+	printf("%d ranges created in %.3f s, %.2f us per unpin\n",
+	       nranges, t, t * 1e6 / nranges);
+
+	/* Re-pin and unpin random odd pages, keeping the range count */
+	n = nranges < 10000 ? nranges : 10000;
+	pin = unpin = 0;
+	for (i = 0; i < n; i++) {
+		page = 1 + 2 * (rand_r(&seed) % nranges);
+
+		t = now();
+		pin_call(fd, ASHMEM_PIN, page, 1);
+		pin += now() - t;
+
+		t = now();
+		pin_call(fd, ASHMEM_UNPIN, page, 1);
+		unpin += now() - t;
+	}
+
+	/* Query pinned even pages, which must not match any range */
+	status = 0;
+	for (i = 0; i < n; i++) {
+		page = 2 * (rand_r(&seed) % (nranges + 1));
+
+		t = now();
+		if (pin_call(fd, ASHMEM_GET_PIN_STATUS, page, 1) !=
+		    ASHMEM_IS_PINNED) {
+			fprintf(stderr, "page %ld reported unpinned\n", page);
+			exit(1);
+		}
+		status += now() - t;
+	}
+
+	printf("with %d ranges: pin %.2f us, unpin %.2f us, "
+	       "pin status %.2f us\n", nranges, pin * 1e6 / n,
+	       unpin * 1e6 / n, status * 1e6 / n);
+
+	close(fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m storm|ranges] [-t threads] [-s seconds] [-r ranges]\n"
+		"  -m  pin/unpin storm against the shrinker, or many ranges\n"
+		"      (default %s)\n"
+		"  -t  storm threads (default %d)\n"
+		"  -s  seconds per storm run (default %d)\n"
+		"  -r  unpinned ranges in ranges mode (default %d)\n",
+		prog, mode, nthreads, seconds, nranges);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:t:s:r:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mode = optarg;
+			if (strcmp(mode, "storm") && strcmp(mode, "ranges"))
+				usage(argv[0]);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'r':
+			nranges = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nthreads < 1 || seconds < 1 || nranges < 1)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (!strcmp(mode, "storm"))
+		run_storm();
+	else
+		run_ranges();
+
+	return 0;
+}
@@ -0,0 +1,876 @@
+/*
+ * binder-bench.c
+ *
+ * Measure binder transaction throughput, with and without
+ * BC_TRANSACTION_MULTI batching, and synchronous call round-trip time.
+ *
+ * A child process stands in for servicemanager: it becomes the context
+ * manager and counts the one-way transactions it receives, freeing each
+ * buffer as it goes. The parent sends transactions to handle 0 in one of
+ * three ways:
+ *
+ *	single	one BC_TRANSACTION per BINDER_WRITE_READ
+ *	packed	-b BC_TRANSACTION commands in each BINDER_WRITE_READ
+ *	multi	one BC_TRANSACTION_MULTI of -b transactions per call
+ *
+ * and reports how fast they were accepted by the driver and how fast they
+ * reached the server. Sends that fail because the server's buffer space is
+ * full are retried and counted.
+ *
+ * In sync mode the parent instead makes one synchronous call at a time,
+ * which the server answers with an empty reply, and reports the round-trip
+ * time in microseconds.
+ *
+ * With -p, each of that many client processes instead makes sync calls to
+ * its own server process, which registered with the context manager at
+ * startup. The pairs share no binder objects, so their combined calls/s
+ * should grow with the number of CPUs until something in the driver
+ * serializes them.
+ *
+ * With -l mix, payload sizes are drawn from a mix resembling real parcels:
+ * mostly a few hundred bytes, with a tail up to 16 KiB. That exercises
+ * several buffer size classes and shows the allocator's effect on the
+ * round-trip percentiles.
+ *
+ * Nothing else may hold the context manager role, so run it on a test
+ * system without servicemanager, as root.
+ *
+ * Usage: binder-bench [-m single|packed|multi|sync] [-b batch] [-n count]
+ *		      [-l length|mix] [-p pairs]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/android binder-bench.c \
+ *		-o binder-bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEVICE	"/dev/binder"
+#define MAP_SIZE	(1024 * 1024 - 8192)	/* same as libbinder */
+
+/* Transaction codes understood by the server */
+#define CODE_DATA	1	/* one-way payload, counted */
+#define CODE_COUNT	2	/* replies with the number of CODE_DATA seen */
+#define CODE_PING	3	/* replies with no data */
+#define CODE_REGISTER	4	/* a pair server registers its object */
+#define CODE_LOOKUP	5	/* replies with a pair server's object */
+
+#define MAX_PAIRS	32
+
+enum { MODE_SINGLE, MODE_PACKED, MODE_MULTI, MODE_SYNC };
+
+static const char *mode_names[] = { "single", "packed", "multi", "sync" };
+
+static int mode = MODE_MULTI;
+static int batch = 16;
+static unsigned long total = 100000;
+static int length = 64;		/* 0 for the parcel size mix */
+static int pairs;
+
+/* Parcel size mix for -l mix: percentage, smallest and largest size */
+static const struct {
+	int pct;
+	int min, max;
+} size_mix[] = {
+	{ 60,	16,	256 },
+	{ 25,	256,	1024 },
+	{ 12,	1024,	4096 },
+	{ 3,	4096,	16384 },
+};
+
+#define MAX_LENGTH	16384
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Payload size for the next transaction */
+static int next_length(void)
+{
+	static unsigned int seed = 1;
+	int r, i;
+
+	if (length)
+		return length;
+
+	r = rand_r(&seed) % 100;
+	for (i = 0; r >= size_mix[i].pct; i++)
+		r -= size_mix[i].pct;
+	return size_mix[i].min +
+	       rand_r(&seed) % (size_mix[i].max - size_mix[i].min + 1);
+}
+
+static const char *length_name(void)
+{
+	static char buf[32];
+
+	if (!length)
+		return "parcel size mix";
+	snprintf(buf, sizeof(buf), "%d byte", length);
+	return buf;
+}
+
+static int binder_open(int flags)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open(BINDER_DEVICE, O_RDWR | flags);
+	if (fd < 0)
+		die(BINDER_DEVICE);
+
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+
+	return fd;
+}
+
+/*
+ * Write wlen bytes of commands, then read whatever returns are ready into
+ * rbuf. Returns the number of bytes read, or -1 with errno set (EAGAIN on
+ * a non-blocking descriptor with nothing to read).
+ */
+static long binder_io(int fd, void *wbuf, size_t wlen, void *rbuf, size_t rlen)
+{
+	struct binder_write_read bwr;
+
+	bwr.write_size = wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rlen;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)rbuf;
+
+	while (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return bwr.read_consumed;
+}
+
+static void put_u32(char **p, uint32_t v)
+{
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static void put_ptr(char **p, const void *v)
+{
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+static void put_txn(char **p, uint32_t handle, uint32_t code, uint32_t flags,
+		    const void *data, size_t len)
+{
+	struct binder_transaction_data txn;
+
+	memset(&txn, 0, sizeof(txn));
+	txn.target.handle = handle;
+	txn.code = code;
+	txn.flags = flags;
+	txn.data_size = len;
+	txn.data.ptr.buffer = data;
+	memcpy(*p, &txn, sizeof(txn));
+	*p += sizeof(txn);
+}
+
+/*
+ * Data of CODE_REGISTER calls and CODE_LOOKUP replies: a binder object
+ * and the pair it belongs to.
+ */
+struct obj_msg {
+	struct flat_binder_object obj;
+	uint32_t index;
+};
+
+/* The object is at the start of every obj_msg */
+static const size_t obj_offsets[1];
+
+static void put_obj_txn(char **p, uint32_t code, const struct obj_msg *msg)
+{
+	struct binder_transaction_data txn;
+
+	memset(&txn, 0, sizeof(txn));
+	txn.target.handle = 0;
+	txn.code = code;
+	txn.data_size = sizeof(*msg);
+	txn.offsets_size = sizeof(obj_offsets);
+	txn.data.ptr.buffer = msg;
+	txn.data.ptr.offsets = obj_offsets;
+	memcpy(*p, &txn, sizeof(txn));
+	*p += sizeof(txn);
+}
+
+/* Size of the payload that follows a return command, or -1 if unknown */
+static int return_size(uint32_t cmd)
+{
+	switch (cmd) {
+	case BR_NOOP:
+	case BR_TRANSACTION_COMPLETE:
+	case BR_FAILED_REPLY:
+	case BR_DEAD_REPLY:
+	case BR_SPAWN_LOOPER:
+		return 0;
+	case BR_ERROR:
+		return sizeof(int);
+	case BR_TRANSACTION:
+	case BR_REPLY:
+		return sizeof(struct binder_transaction_data);
+	case BR_INCREFS:
+	case BR_ACQUIRE:
+	case BR_RELEASE:
+	case BR_DECREFS:
+		return sizeof(struct binder_ptr_cookie);
+	case BR_DEAD_BINDER:
+	case BR_CLEAR_DEATH_NOTIFICATION_DONE:
+		return sizeof(void *);
+	default:
+		return -1;
+	}
+}
+
+/* --- server ------------------------------------------------------------ */
+
+static uint32_t received;			/* CODE_DATA seen */
+static uint32_t pair_handles[MAX_PAIRS];	/* context manager only */
+
+static void server_transaction(char **wp, struct binder_transaction_data *txn)
+{
+	/* The driver copies a reply before the next read, so one will do */
+	static uint32_t reply_count;
+	static struct obj_msg reply_msg;
+	struct obj_msg msg;
+	uint32_t index;
+
+	if (txn->code == CODE_REGISTER && txn->data_size >= sizeof(msg) &&
+	    txn->offsets_size >= sizeof(size_t)) {
+		memcpy(&msg, txn->data.ptr.buffer, sizeof(msg));
+		if (msg.index < MAX_PAIRS) {
+			/* Our own reference, the buffer's goes with it */
+			pair_handles[msg.index] = msg.obj.handle;
+			put_u32(wp, BC_ACQUIRE);
+			put_u32(wp, msg.obj.handle);
+		}
+	}
+
+	put_u32(wp, BC_FREE_BUFFER);
+	put_ptr(wp, txn->data.ptr.buffer);
+
+	if (txn->code == CODE_DATA)
+		received++;
+	if (txn->flags & TF_ONE_WAY)
+		return;
+
+	put_u32(wp, BC_REPLY);
+	switch (txn->code) {
+	case CODE_COUNT:
+		reply_count = received;
+		put_txn(wp, 0, 0, 0, &reply_count, sizeof(reply_count));
+		break;
+	case CODE_LOOKUP:
+		index = MAX_PAIRS;
+		if (txn->data_size >= sizeof(index))
+			memcpy(&index, txn->data.ptr.buffer, sizeof(index));
+		if (index >= MAX_PAIRS) {
+			put_txn(wp, 0, 0, 0, NULL, 0);
+			break;
+		}
+		memset(&reply_msg, 0, sizeof(reply_msg));
+		reply_msg.obj.type = BINDER_TYPE_HANDLE;
+		reply_msg.obj.handle = pair_handles[index];
+		reply_msg.index = index;
+		put_obj_txn(wp, 0, &reply_msg);
+		break;
+	default:
+		put_txn(wp, 0, 0, 0, NULL, 0);
+		break;
+	}
+}
+
+/*
+ * Serve transactions until killed. Frees and replies are written with
+ * the next read.
+ */
+static void server_loop(int fd, int ready_fd)
+{
+	static char rbuf[32 * 1024];
+	static char wbuf[64 * 1024];
+	struct binder_transaction_data txn;
+	struct binder_ptr_cookie ref;
+	char *wp = wbuf;
+	char *p, *end;
+	uint32_t cmd;
+	long len;
+	int size;
+
+	put_u32(&wp, BC_ENTER_LOOPER);
+	if (binder_io(fd, wbuf, wp - wbuf, NULL, 0) < 0)
+		die("BC_ENTER_LOOPER");
+	wp = wbuf;
+
+	if (write(ready_fd, "", 1) != 1)
+		die("write");
+	close(ready_fd);
+
+	for (;;) {
+		len = binder_io(fd, wbuf, wp - wbuf, rbuf, sizeof(rbuf));
+		if (len < 0)
+			die("server BINDER_WRITE_READ");
+		wp = wbuf;
+
+		for (p = rbuf, end = rbuf + len; p < end; p += size) {
+			memcpy(&cmd, p, sizeof(cmd));
+			p += sizeof(cmd);
+			size = return_size(cmd);
+			if (size < 0) {
+				fprintf(stderr, "server: unknown return 0x%x\n",
+					cmd);
+				exit(1);
+			}
+
+			switch (cmd) {
+			case BR_TRANSACTION:
+				memcpy(&txn, p, sizeof(txn));
+				server_transaction(&wp, &txn);
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				/* The context manager took our object */
+				memcpy(&ref, p, sizeof(ref));
+				put_u32(&wp, cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+				put_ptr(&wp, ref.ptr);
+				put_ptr(&wp, ref.cookie);
+				break;
+			}
+		}
+	}
+}
+
+static void run_server(int ready_fd)
+{
+	int fd;
+
+	fd = binder_open(0);
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+
+	server_loop(fd, ready_fd);
+}
+
+/* --- client ------------------------------------------------------------ */
+
+#define CMD_SIZE	(sizeof(uint32_t) + sizeof(struct binder_transaction_data))
+
+struct client {
+	int fd;
+	char out[(BINDER_TRANSACTION_MULTI_MAX + 2) * CMD_SIZE];
+	char *wp;			/* end of the commands in out */
+	unsigned long completed;	/* BR_TRANSACTION_COMPLETE seen */
+	unsigned long failed;		/* BR_FAILED_REPLY seen */
+	int got_reply;
+	uint32_t reply;
+	uint32_t target;		/* handle sync calls are sent to */
+};
+
+static void client_init(struct client *c, int flags)
+{
+	memset(c, 0, sizeof(*c));
+	c->fd = binder_open(flags);
+	c->wp = c->out;
+}
+
+/*
+ * Handle the returns in rbuf. Replies carry one u32 or, from CODE_LOOKUP,
+ * a pair server's object; freeing their buffers is queued for the next
+ * call.
+ */
+static void client_parse(struct client *c, char *rbuf, long len)
+{
+	struct binder_transaction_data txn;
+	struct obj_msg msg;
+	char *p, *end;
+	uint32_t cmd;
+	int size;
+
+	for (p = rbuf, end = rbuf + len; p < end; p += size) {
+		memcpy(&cmd, p, sizeof(cmd));
+		p += sizeof(cmd);
+		size = return_size(cmd);
+		if (size < 0) {
+			fprintf(stderr, "client: unknown return 0x%x\n", cmd);
+			exit(1);
+		}
+
+		switch (cmd) {
+		case BR_TRANSACTION_COMPLETE:
+			c->completed++;
+			break;
+		case BR_FAILED_REPLY:
+			c->failed++;
+			break;
+		case BR_DEAD_REPLY:
+			fprintf(stderr, "client: server died\n");
+			exit(1);
+		case BR_REPLY:
+			memcpy(&txn, p, sizeof(txn));
+			if (txn.offsets_size >= sizeof(size_t) &&
+			    txn.data_size >= sizeof(msg)) {
+				memcpy(&msg, txn.data.ptr.buffer, sizeof(msg));
+				/* Keep the handle once the reply is freed */
+				c->target = msg.obj.handle;
+				put_u32(&c->wp, BC_ACQUIRE);
+				put_u32(&c->wp, c->target);
+			} else if (txn.data_size >= sizeof(c->reply)) {
+				memcpy(&c->reply, txn.data.ptr.buffer,
+				       sizeof(c->reply));
+			}
+			c->got_reply = 1;
+			put_u32(&c->wp, BC_FREE_BUFFER);
+			put_ptr(&c->wp, txn.data.ptr.buffer);
+			break;
+		}
+	}
+}
+
+/*
+ * Send the queued commands and read returns. With 'wait_reply', return
+ * as soon as a BR_REPLY or a failure has arrived; otherwise keep reading
+ * until nothing is left, which needs a non-blocking descriptor.
+ */
+static void client_io(struct client *c, int wait_reply)
+{
+	static char rbuf[16 * 1024];
+	unsigned long failed = c->failed;
+	struct pollfd pfd;
+	long len;
+
+	c->got_reply = 0;
+	for (;;) {
+		len = binder_io(c->fd, c->out, c->wp - c->out,
+				rbuf, sizeof(rbuf));
+		if (len < 0 && errno != EAGAIN)
+			die("client BINDER_WRITE_READ");
+
+		c->wp = c->out;
+		if (len > 0)
+			client_parse(c, rbuf, len);
+
+		if (wait_reply && (c->got_reply || c->failed != failed))
+			break;
+		if (len > 0 || c->wp != c->out)
+			continue;
+		if (!wait_reply)
+			break;
+
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+	}
+}
+
+/* Ask the server how many CODE_DATA transactions it has seen */
+static uint32_t client_count(struct client *c)
+{
+	put_u32(&c->wp, BC_TRANSACTION);
+	put_txn(&c->wp, 0, CODE_COUNT, 0, NULL, 0);
+	client_io(c, 1);
+
+	return c->reply;
+}
+
+static void run_oneway(void)
+{
+	struct client c;
+	char *payload;
+	unsigned long accepted = 0;
+	unsigned long before;
+	double start, sent, done;
+	int n;
+	int i;
+
+	client_init(&c, O_NONBLOCK);
+
+	payload = calloc(1, length ? length : MAX_LENGTH);
+	if (!payload)
+		die("calloc");
+
+	start = now();
+	while (accepted < total) {
+		n = (mode == MODE_SINGLE) ? 1 : batch;
+		if (n > total - accepted)
+			n = total - accepted;
+
+		if (mode == MODE_MULTI) {
+			put_u32(&c.wp, BC_TRANSACTION_MULTI);
+			put_u32(&c.wp, n);
+			for (i = 0; i < n; i++)
+				put_txn(&c.wp, 0, CODE_DATA, TF_ONE_WAY,
+					payload, next_length());
+		} else {
+			for (i = 0; i < n; i++) {
+				put_u32(&c.wp, BC_TRANSACTION);
+				put_txn(&c.wp, 0, CODE_DATA, TF_ONE_WAY,
+					payload, next_length());
+			}
+		}
+
+		before = c.failed;
+		client_io(&c, 0);
+		accepted = c.completed;
+
+		/* The server's buffer space is full, let it catch up */
+		if (c.failed != before)
+			sched_yield();
+	}
+	sent = now();
+
+	while (client_count(&c) < accepted)
+		;
+	done = now();
+
+	printf("mode %s, batch %d, %s payloads\n",
+	       mode_names[mode], mode == MODE_SINGLE ? 1 : batch,
+	       length_name());
+	printf("%lu sent in %.3f s: %.0f transactions/s\n",
+	       accepted, sent - start, accepted / (sent - start));
+	printf("%lu delivered in %.3f s: %.0f transactions/s\n",
+	       accepted, done - start, accepted / (done - start));
+	if (c.failed)
+		printf("%lu sends failed and were retried\n", c.failed);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+struct sync_result {
+	unsigned long calls;
+	double start, end;		/* seconds */
+	double avg, p50, p90, p99, max;	/* round trip, microseconds */
+};
+
+/* Make 'total' sync calls to c->target, one at a time */
+static void sync_calls(struct client *c, struct sync_result *r)
+{
+	char *payload;
+	double *rtt;
+	double t, sum = 0;
+	unsigned long i;
+
+	payload = calloc(1, length ? length : MAX_LENGTH);
+	rtt = malloc(total * sizeof(*rtt));
+	if (!payload || !rtt)
+		die("malloc");
+
+	r->start = now();
+	for (i = 0; i < total; i++) {
+		put_u32(&c->wp, BC_TRANSACTION);
+		put_txn(&c->wp, c->target, CODE_PING, 0, payload,
+			next_length());
+
+		t = now();
+		client_io(c, 1);
+		rtt[i] = (now() - t) * 1e6;
+		sum += rtt[i];
+	}
+	r->end = now();
+
+	qsort(rtt, total, sizeof(*rtt), cmp_double);
+
+	r->calls = total;
+	r->avg = sum / total;
+	r->p50 = rtt[total / 2];
+	r->p90 = rtt[total * 9 / 10];
+	r->p99 = rtt[total * 99 / 100];
+	r->max = rtt[total - 1];
+
+	free(rtt);
+	free(payload);
+}
+
+static void print_rtt(struct sync_result *r)
+{
+	printf("round trip us: avg %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+	       "max %.1f\n", r->avg, r->p50, r->p90, r->p99, r->max);
+}
+
+static void run_sync(void)
+{
+	struct sync_result r;
+	struct client c;
+
+	/* Blocking, so the wait for each reply sleeps in the driver */
+	client_init(&c, 0);
+	sync_calls(&c, &r);
+
+	printf("mode sync, %s payloads\n", length_name());
+	printf("%lu calls in %.3f s: %.0f calls/s\n", r.calls,
+	       r.end - r.start, r.calls / (r.end - r.start));
+	print_rtt(&r);
+}
+
+/* --- pairs ------------------------------------------------------------- */
+
+static void run_pair_server(uint32_t index, int ready_fd)
+{
+	static struct obj_msg msg;	/* its address names our object */
+	struct client c;
+
+	client_init(&c, 0);
+
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.binder = &msg;
+	msg.obj.cookie = &msg;
+	msg.index = index;
+	put_u32(&c.wp, BC_TRANSACTION);
+	put_obj_txn(&c.wp, CODE_REGISTER, &msg);
+	client_io(&c, 1);
+
+	/* Free the reply before serving */
+	if (binder_io(c.fd, c.out, c.wp - c.out, NULL, 0) < 0)
+		die("BC_FREE_BUFFER");
+
+	server_loop(c.fd, ready_fd);
+}
+
+static void run_pair_client(uint32_t index, int ready_fd, int go_fd,
+			    int result_fd)
+{
+	struct sync_result r;
+	struct client c;
+	char ch;
+
+	client_init(&c, 0);
+
+	put_u32(&c.wp, BC_TRANSACTION);
+	put_txn(&c.wp, 0, CODE_LOOKUP, 0, &index, sizeof(index));
+	client_io(&c, 1);
+	if (!c.target) {
+		fprintf(stderr, "pair %u: server not found\n", index);
+		exit(1);
+	}
+
+	/* Wait until every client is ready, then start together */
+	if (write(ready_fd, "", 1) != 1)
+		die("write");
+	if (read(go_fd, &ch, 1) < 0)
+		die("read");
+
+	sync_calls(&c, &r);
+	if (write(result_fd, &r, sizeof(r)) != sizeof(r))
+		die("write");
+}
+
+static void run_pairs(void)
+{
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	struct sync_result r;
+	int ready[2], go[2], results[2];
+	double start = 0, end = 0;
+	unsigned long calls = 0;
+	char ch;
+	int i;
+
+	if (pipe(ready) < 0)
+		die("pipe");
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0)
+			die("fork");
+		if (!servers[i]) {
+			close(ready[0]);
+			run_pair_server(i, ready[1]);
+			exit(0);
+		}
+		if (read(ready[0], &ch, 1) != 1) {
+			fprintf(stderr, "pair server %d failed to start\n", i);
+			exit(1);
+		}
+	}
+	close(ready[0]);
+	close(ready[1]);
+
+	/* Made after the servers exist, so only clients hold them */
+	if (pipe(ready) < 0 || pipe(go) < 0 || pipe(results) < 0)
+		die("pipe");
+	for (i = 0; i < pairs; i++) {
+		clients[i] = fork();
+		if (clients[i] < 0)
+			die("fork");
+		if (!clients[i]) {
+			close(ready[0]);
+			close(go[1]);
+			close(results[0]);
+			run_pair_client(i, ready[1], go[0], results[1]);
+			exit(0);
+		}
+	}
+	close(ready[1]);
+	close(go[0]);
+	close(results[1]);
+
+	for (i = 0; i < pairs; i++) {
+		if (read(ready[0], &ch, 1) != 1) {
+			fprintf(stderr, "a pair client failed to start\n");
+			exit(1);
+		}
+	}
+	close(go[1]);
+
+	printf("%d pairs, sync, %s payloads\n", pairs, length_name());
+	for (i = 0; i < pairs; i++) {
+		if (read(results[0], &r, sizeof(r)) != sizeof(r)) {
+			fprintf(stderr, "a pair client failed\n");
+			exit(1);
+		}
+		if (!i || r.start < start)
+			start = r.start;
+		if (!i || r.end > end)
+			end = r.end;
+		calls += r.calls;
+
+		printf("pair %2d: %.0f calls/s, ", i,
+		       r.calls / (r.end - r.start));
+		print_rtt(&r);
+	}
+	printf("total: %lu calls in %.3f s: %.0f calls/s\n",
+	       calls, end - start, calls / (end - start));
+
+	for (i = 0; i < pairs; i++) {
+		waitpid(clients[i], NULL, 0);
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m single|packed|multi|sync] [-b batch] [-n count] [-l length|mix]\n"
+		"          [-p pairs]\n"
+		"  -m  how transactions are sent (default %s)\n"
+		"  -b  transactions per call for packed and multi, at most %d (default %d)\n"
+		"  -n  transactions to send, per client with -p (default %lu)\n"
+		"  -l  payload bytes per transaction, or mix for a parcel size mix\n"
+		"      (default %d)\n"
+		"  -p  sync calls from this many clients, each to its own server,\n"
+		"      at most %d\n",
+		prog, mode_names[mode], BINDER_TRANSACTION_MULTI_MAX, batch,
+		total, length, MAX_PAIRS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int ready[2];
+	pid_t server;
+	char c;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:b:n:l:p:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (mode = 0; mode <= MODE_SYNC; mode++)
+				if (!strcmp(optarg, mode_names[mode]))
+					break;
+			if (mode > MODE_SYNC)
+				usage(argv[0]);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (!strcmp(optarg, "mix"))
+				length = 0;
+			else
+				length = atoi(optarg);
+			if (length < 0 || (!length && strcmp(optarg, "mix")))
+				usage(argv[0]);
+			break;
+		case 'p':
+			pairs = atoi(optarg);
+			if (pairs < 1 || pairs > MAX_PAIRS)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (batch < 1 || batch > BINDER_TRANSACTION_MULTI_MAX ||
+	    total < 1 || length > MAX_LENGTH)
+		usage(argv[0]);
+
+	if (pipe(ready) < 0)
+		die("pipe");
+
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(ready[0]);
+		run_server(ready[1]);
+		exit(0);
+	}
+
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+
+	if (pairs)
+		run_pairs();
+	else if (mode == MODE_SYNC)
+		run_sync();
+	else
+		run_oneway();
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * lmk-workload.c
+ *
+ * Drive the lowmemorykiller with many processes and time its shrinker.
+ *
+ * The test forks -n idle processes, each holding -m MB of touched anonymous
+ * memory and each given an oom_adj from the usual Android levels, so the
+ * killer has a large process list to choose from. It then allocates
+ * memory itself, 1 MB at a time, until -p MB are held or every child has
+ * been killed, and reports the time taken by each 1 MB step and how many
+ * children were killed at each oom_adj.
+ *
+ * With -t, lowmem_shrink() is also traced through the function graph
+ * tracer for the run, and the distribution of its run times is reported.
+ * That needs CONFIG_FUNCTION_GRAPH_TRACER and debugfs mounted on
+ * /sys/kernel/debug.
+ *
+ * The shrinker only runs from global reclaim, so a memory cgroup limit is
+ * not enough: run it in a VM booted with little memory, with the killer's
+ * minfree levels set (/sys/module/lowmemorykiller/parameters/minfree).
+ * Needs root, to protect itself with a negative oom_adj.
+ *
+ * Usage: lmk-workload [-n processes] [-m megabytes] [-p megabytes] [-t]
+ *
+ * Compile with
+ *	gcc -O2 lmk-workload.c -o lmk-workload
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define TRACING		"/sys/kernel/debug/tracing/"
+#define MB		(1024 * 1024)
+#define MAX_US		100000	/* histogram range */
+
+/* oom_adj levels the Android framework hands out */
+static const int adj_levels[] = { 0, 1, 2, 4, 6, 7, 8, 15 };
+#define NR_LEVELS	(sizeof(adj_levels) / sizeof(adj_levels[0]))
+
+static int nprocs = 500;
+static int child_mb = 4;
+static int pressure_mb = 4096;
+static int trace;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void write_file(const char *path, const char *val)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != (ssize_t) strlen(val)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void set_oom_adj(int adj)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%d", adj);
+	write_file("/proc/self/oom_adj", buf);
+}
+
+static char *alloc_touched(size_t size)
+{
+	char *p;
+	size_t i;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	for (i = 0; i < size; i += 4096)
+		p[i] = 1;
+	return p;
+}
+
+static void run_child(int adj, int ready_fd)
+{
+	set_oom_adj(adj);
+	if (!alloc_touched((size_t) child_mb * MB))
+		exit(1);
+	if (write(ready_fd, "", 1) != 1)
+		exit(1);
+	for (;;)
+		pause();
+}
+
+/* Latency below which 'permille' of the 'count' samples in 'hist' fell */
+static long percentile(unsigned long *hist, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	long us;
+
+	for (us = 0; us < MAX_US; us++) {
+		seen += hist[us];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return us;
+}
+
+static void print_hist(const char *what, unsigned long *hist,
+		       unsigned long count)
+{
+	long max;
+
+	for (max = MAX_US; max > 0 && !hist[max]; max--)
+		;
+	printf("%s: %lu samples, us p50 %ld  p90 %ld  p99 %ld  max %ld%s\n",
+	       what, count, percentile(hist, count, 500),
+	       percentile(hist, count, 900), percentile(hist, count, 990),
+	       max, max == MAX_US ? "+" : "");
+}
+
+static void trace_start(void)
+{
+	write_file(TRACING "tracing_on", "0");
+	write_file(TRACING "current_tracer", "nop");
+	write_file(TRACING "set_ftrace_filter", "lowmem_shrink");
+	write_file(TRACING "current_tracer", "function_graph");
+	write_file(TRACING "tracing_on", "1");
+}
+
+/* Collect the lowmem_shrink() run times from the function graph trace */
+static void trace_stop(void)
+{
+	static unsigned long hist[MAX_US + 1];
+	unsigned long count = 0;
+	char line[512];
+	char *p;
+	double us;
+	FILE *f;
+
+	write_file(TRACING "tracing_on", "0");
+
+	f = fopen(TRACING "trace", "r");
+	if (!f) {
+		perror(TRACING "trace");
+		exit(1);
+	}
+	/* e.g. " 1) + 12.345 us   |  lowmem_shrink();" */
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || !strstr(line, "lowmem_shrink"))
+			continue;
+		p = strchr(line, ')');
+		if (!p)
+			continue;
+		p += strspn(p + 1, " +!#*@$") + 1;
+		us = strtod(p, &p);
+		if (strncmp(p, " us", 3))
+			continue;
+		hist[us < MAX_US ? (long) us : MAX_US]++;
+		count++;
+	}
+	fclose(f);
+
+	write_file(TRACING "current_tracer", "nop");
+	write_file(TRACING "set_ftrace_filter", "");
+
+	if (count)
+		print_hist("lowmem_shrink", hist, count);
+	else
+		printf("lowmem_shrink: not called\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n processes] [-m megabytes] [-p megabytes] [-t]\n"
+		"  -n  idle processes to start (default %d)\n"
+		"  -m  memory each of them holds (default %d)\n"
+		"  -p  memory to allocate afterwards, at most (default %d)\n"
+		"  -t  trace lowmem_shrink() run times\n",
+		prog, nprocs, child_mb, pressure_mb);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned long hist[MAX_US + 1];
+	unsigned long killed[NR_LEVELS] = { 0 };
+	unsigned long nkilled = 0;
+	pid_t *pids;
+	int ready[2];
+	int status;
+	double t;
+	char ch;
+	pid_t pid;
+	int opt;
+	int i, j;
+
+	while ((opt = getopt(argc, argv, "n:m:p:t")) != -1) {
+		switch (opt) {
+		case 'n':
+			nprocs = atoi(optarg);
+			break;
+		case 'm':
+			child_mb = atoi(optarg);
+			break;
+		case 'p':
+			pressure_mb = atoi(optarg);
+			break;
+		case 't':
+			trace = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nprocs < 1 || child_mb < 1 || pressure_mb < 1)
+		usage(argv[0]);
+
+	/* The killer leaves negative oom_adj alone; children set their own */
+	set_oom_adj(-16);
+
+	pids = calloc(nprocs, sizeof(*pids));
+	if (!pids || pipe(ready) < 0) {
+		perror("setup");
+		return 1;
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pids[i]) {
+			close(ready[0]);
+			run_child(adj_levels[i % NR_LEVELS], ready[1]);
+		}
+	}
+	close(ready[1]);
+	for (i = 0; i < nprocs; i++) {
+		if (read(ready[0], &ch, 1) != 1) {
+			fprintf(stderr, "only %d of %d processes started\n",
+				i, nprocs);
+			return 1;
+		}
+	}
+	printf("%d processes holding %d MB each\n", nprocs, child_mb);
+
+	if (trace)
+		trace_start();
+
+	for (i = 0; i < pressure_mb && nkilled < (unsigned long) nprocs; i++) {
+		t = now();
+		if (!alloc_touched(MB)) {
+			perror("mmap");
+			break;
+		}
+		t = (now() - t) * 1e6;
+		hist[t < MAX_US ? (long) t : MAX_US]++;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (j = 0; j < nprocs && pids[j] != pid; j++)
+				;
+			if (j < nprocs && WIFSIGNALED(status))
+				killed[j % NR_LEVELS]++;
+			nkilled++;
+		}
+	}
+
+	if (trace)
+		trace_stop();
+
+	printf("allocated %d MB, %lu processes killed\n", i, nkilled);
+	print_hist("1 MB allocation", hist, i);
+	for (j = NR_LEVELS - 1; j >= 0; j--)
+		printf("  oom_adj %2d: %lu killed\n", adj_levels[j], killed[j]);
+
+	for (i = 0; i < nprocs; i++)
+		kill(pids[i], SIGKILL);
+	while (wait(NULL) > 0)
+		;
+	return 0;
+}
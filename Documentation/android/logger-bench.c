@@ -0,0 +1,365 @@
+/*
+ * logger-bench.c
+ *
+ * Measure how fast many threads can write to an Android log device.
+ *
+ * Each writer thread sends entries the way liblog does: one writev() of a
+ * priority byte, a tag and a message, on a log descriptor shared by the
+ * whole process. After the given time the total is reported in entries/s
+ * and MB/s. Compare runs with 1, 2, 4, ... writers to see how writers
+ * scale; with -r a reader drains the log at the same time, to show whether
+ * writers still wait on readers.
+ *
+ * The reader either read()s one entry per call, as logcat does, or maps the
+ * log and consumes entries in place, only calling into the driver to hand
+ * back its position and poll once it has caught up. Both report entries/s
+ * read and system calls per entry read.
+ *
+ * Usage: logger-bench [-d device] [-t threads] [-s seconds] [-l length]
+ *		       [-r read|mmap]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/android logger-bench.c \
+ *		-o logger-bench -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define TAG		"logger-bench"
+#define PRIO_INFO	4		/* ANDROID_LOG_INFO */
+
+static const char *device = "/dev/log/main";
+static int nthreads = 4;
+static int seconds = 5;
+static int msglen = 64;
+static const char *reader_mode;		/* "read", "mmap" or none */
+
+static int log_fd;
+static volatile int stop;
+
+struct writer {
+	pthread_t thread;
+	unsigned long entries;
+	unsigned long errors;
+};
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = PRIO_INFO;
+	struct iovec vec[3];
+	char *msg;
+
+	msg = malloc(msglen);
+	if (!msg) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(msg, 'x', msglen - 1);
+	msg[msglen - 1] = '\0';
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = TAG;
+	vec[1].iov_len = sizeof(TAG);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = msglen;
+
+	while (!stop) {
+		if (writev(log_fd, vec, 3) < 0)
+			w->errors++;
+		else
+			w->entries++;
+	}
+
+	free(msg);
+	return NULL;
+}
+
+static unsigned long entries_read;
+static unsigned long reader_syscalls;
+
+/* Wait up to 100ms for the log to have something for this reader */
+static void reader_wait(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	poll(&pfd, 1, 100);
+	reader_syscalls++;
+}
+
+static void *reader_fn(void *arg)
+{
+	char buf[LOGGER_ENTRY_MAX_LEN + 1];
+	ssize_t ret;
+	int fd;
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	while (!stop) {
+		ret = read(fd, buf, LOGGER_ENTRY_MAX_LEN);
+		reader_syscalls++;
+		if (ret > 0)
+			entries_read++;
+		else if (ret < 0 && errno == EAGAIN)
+			reader_wait(fd);
+		else if (ret < 0 && errno != EINTR) {
+			perror("read");
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/* A consistent copy of the header, see struct logger_mmap_header */
+static void read_header(volatile struct logger_mmap_header *hdr,
+			struct logger_mmap_header *snap)
+{
+	__u32 seq;
+
+	do {
+		seq = hdr->seq;
+		__sync_synchronize();
+		snap->size = hdr->size;
+		snap->w_off = hdr->w_off;
+		snap->c_off = hdr->c_off;
+		snap->head = hdr->head;
+		snap->gen = hdr->gen;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != hdr->seq);
+}
+
+/* Absolute position of ring offset 'off', which is at most w_off bytes behind */
+static unsigned long long abs_pos(struct logger_mmap_header *snap, __u32 off)
+{
+	unsigned long long gen = snap->gen;
+
+	if (off > snap->w_off)
+		gen--;
+	return gen * snap->size + off;
+}
+
+static void ring_copy(void *dst, const char *ring, __u32 size,
+		      unsigned long long pos, size_t len)
+{
+	__u32 off = pos % size;
+	size_t n = len < size - off ? len : size - off;
+
+	memcpy(dst, ring + off, n);
+	memcpy((char *) dst + n, ring, len - n);
+}
+
+static void *reader_mmap_fn(void *arg)
+{
+	char buf[LOGGER_ENTRY_MAX_LEN];
+	struct logger_entry *entry = (struct logger_entry *) buf;
+	struct logger_mmap_header snap;
+	volatile struct logger_mmap_header *hdr;
+	unsigned long long pos, end;
+	long page_size = sysconf(_SC_PAGESIZE);
+	const char *ring;
+	size_t len;
+	int size;
+	int fd;
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	if (size < 0) {
+		perror("LOGGER_GET_LOG_BUF_SIZE");
+		exit(1);
+	}
+	hdr = mmap(NULL, page_size + size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	ring = (const char *) hdr + page_size;
+
+	read_header(hdr, &snap);
+	pos = abs_pos(&snap, snap.head);
+
+	while (!stop) {
+		read_header(hdr, &snap);
+		end = abs_pos(&snap, snap.c_off);
+
+		/* Lapped: start again from the oldest entry */
+		if (pos < abs_pos(&snap, snap.head))
+			pos = abs_pos(&snap, snap.head);
+
+		if (pos == end) {
+			if (ioctl(fd, LOGGER_SET_READ_OFF, (unsigned long)
+				  (pos % snap.size)) < 0 && errno != EINVAL) {
+				perror("LOGGER_SET_READ_OFF");
+				break;
+			}
+			reader_syscalls++;
+			reader_wait(fd);
+			continue;
+		}
+
+		while (pos < end) {
+			ring_copy(entry, ring, snap.size, pos, sizeof(*entry));
+			len = sizeof(*entry) + entry->len;
+			if (len > LOGGER_ENTRY_MAX_LEN) {
+				/* Overwritten under us, resynchronize */
+				pos = abs_pos(&snap, snap.head);
+				break;
+			}
+			ring_copy(buf, ring, snap.size, pos, len);
+
+			/* Still valid once copied? */
+			read_header(hdr, &snap);
+			if (abs_pos(&snap, snap.w_off) > pos + snap.size)
+				break;
+
+			entries_read++;
+			pos += len;
+		}
+	}
+
+	munmap((void *) hdr, page_size + size);
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-t threads] [-s seconds] [-l length]\n"
+		"          [-r read|mmap]\n"
+		"  -d  log device (default %s)\n"
+		"  -t  writer threads (default %d)\n"
+		"  -s  run time in seconds (default %d)\n"
+		"  -l  message length in bytes (default %d)\n"
+		"  -r  drain the log from a reader thread while writing, one\n"
+		"      read() per entry or in place through mmap()\n",
+		prog, device, nthreads, seconds, msglen);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct writer *writers;
+	pthread_t reader;
+	struct timeval start, end;
+	unsigned long entries = 0, errors = 0;
+	int max_msglen = LOGGER_ENTRY_MAX_PAYLOAD - 1 - sizeof(TAG);
+	double elapsed;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:t:s:l:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			msglen = atoi(optarg);
+			break;
+		case 'r':
+			reader_mode = optarg;
+			if (strcmp(optarg, "read") && strcmp(optarg, "mmap"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nthreads < 1 || seconds < 1 || msglen < 1 || msglen > max_msglen)
+		usage(argv[0]);
+
+	log_fd = open(device, O_WRONLY);
+	if (log_fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	writers = calloc(nthreads, sizeof(*writers));
+	if (!writers) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (reader_mode &&
+	    pthread_create(&reader, NULL, strcmp(reader_mode, "mmap") ?
+			   reader_fn : reader_mmap_fn, NULL)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		entries += writers[i].entries;
+		errors += writers[i].errors;
+	}
+	gettimeofday(&end, NULL);
+
+	if (reader_mode)
+		pthread_join(reader, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("%d writers, %d byte messages, %.2f s\n",
+	       nthreads, msglen, elapsed);
+	printf("%lu entries, %.0f entries/s, %.2f MB/s written\n",
+	       entries, entries / elapsed,
+	       entries * (1.0 + sizeof(TAG) + msglen) / elapsed / (1 << 20));
+	if (errors)
+		printf("%lu failed writes\n", errors);
+	if (reader_mode)
+		printf("%s reader: %lu entries, %.0f entries/s, "
+		       "%.3f syscalls per entry\n", reader_mode, entries_read,
+		       entries_read / elapsed,
+		       entries_read ? (double) reader_syscalls / entries_read : 0);
+
+	close(log_fd);
+	free(writers);
+	return 0;
+}
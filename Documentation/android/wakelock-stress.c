@@ -0,0 +1,269 @@
+/*
+ * wakelock-stress.c
+ *
+ * Stress the wakelock core with thousands of timed wakelocks.
+ *
+ * Writer threads create -n user wakelocks through /sys/power/wake_lock,
+ * each with a random timeout, then re-arm all of them -r times with new
+ * timeouts so timed locks are constantly moved within the expiry order.
+ * The average cost of a lock write and of reading /proc/wakelocks and
+ * /proc/wakelock_uids with that many locks is reported.
+ *
+ * Afterwards the test waits for the longest timeout and checks that every
+ * lock has expired and that the expiries were charged to the caller's uid
+ * in /proc/wakelock_uids. It exits with status 1 if either check fails.
+ *
+ * Needs CONFIG_WAKELOCK_STAT and write access to /sys/power/wake_lock.
+ * The locks are left behind, expired, under the names wl-stress-<n>.
+ *
+ * Usage: wakelock-stress [-n locks] [-t threads] [-r rounds] [-m max_ms]
+ *
+ * Compile with
+ *	gcc -O2 wakelock-stress.c -o wakelock-stress -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define WAKE_LOCK	"/sys/power/wake_lock"
+#define STATS		"/proc/wakelocks"
+#define UID_STATS	"/proc/wakelock_uids"
+#define PREFIX		"wl-stress-"
+#define MIN_MS		10
+
+static int nlocks = 4000;
+static int nthreads = 4;
+static int rounds = 10;
+static int max_ms = 2000;
+
+static int lock_fd;
+
+struct writer {
+	pthread_t thread;
+	int first, last;
+	unsigned int seed;
+	unsigned long writes;
+	unsigned long errors;
+	double usecs;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned long long timeout;
+	char buf[64];
+	double start;
+	int len;
+	int r, i;
+
+	for (r = 0; r <= rounds; r++) {
+		start = now();
+		for (i = w->first; i < w->last; i++) {
+			timeout = MIN_MS + rand_r(&w->seed) % (max_ms - MIN_MS);
+			len = snprintf(buf, sizeof(buf), PREFIX "%d %llu", i,
+				       timeout * 1000000);
+			if (write(lock_fd, buf, len) != len)
+				w->errors++;
+			else
+				w->writes++;
+		}
+		w->usecs += (now() - start) * 1e6;
+	}
+
+	return NULL;
+}
+
+/* Read a whole proc file, returning the time taken in microseconds */
+static double read_file(const char *path, char **contents)
+{
+	static char *buf;
+	static size_t size;
+	size_t len = 0;
+	double start;
+	ssize_t ret;
+	int fd;
+
+	start = now();
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	for (;;) {
+		if (len + 4096 > size) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+			if (!buf) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 0) {
+			perror(path);
+			exit(1);
+		}
+		if (!ret)
+			break;
+		len += ret;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	if (contents)
+		*contents = buf;
+	return (now() - start) * 1e6;
+}
+
+/* Expire count charged to our uid in /proc/wakelock_uids */
+static long uid_expire_count(void)
+{
+	unsigned int uid;
+	long count, expire_count;
+	char *buf, *line;
+
+	read_file(UID_STATS, &buf);
+	for (line = buf; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (sscanf(line, "%u %ld %ld", &uid, &count,
+			   &expire_count) == 3 && uid == getuid())
+			return expire_count;
+	}
+	return 0;
+}
+
+/* Number of our locks that /proc/wakelocks still shows as active */
+static int count_active(void)
+{
+	long long active_since;
+	char *buf, *line;
+	int active = 0;
+
+	read_file(STATS, &buf);
+	for (line = buf; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, "\"" PREFIX, sizeof(PREFIX)))
+			continue;
+		if (sscanf(line, "%*s %*d %*d %*d %lld", &active_since) == 1 &&
+		    active_since)
+			active++;
+	}
+	return active;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n locks] [-t threads] [-r rounds] [-m max_ms]\n"
+		"  -n  wakelocks to create (default %d)\n"
+		"  -t  writer threads (default %d)\n"
+		"  -r  times to re-arm every lock (default %d)\n"
+		"  -m  longest timeout in ms (default %d)\n",
+		prog, nlocks, nthreads, rounds, max_ms);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct writer *writers;
+	unsigned long writes = 0, errors = 0;
+	double usecs = 0, stats_us, uids_us;
+	long expired_before, expired;
+	int active;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:t:r:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nlocks = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'm':
+			max_ms = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nlocks < 1 || nthreads < 1 || nthreads > nlocks || rounds < 0 ||
+	    max_ms <= MIN_MS)
+		usage(argv[0]);
+
+	lock_fd = open(WAKE_LOCK, O_WRONLY);
+	if (lock_fd < 0) {
+		perror(WAKE_LOCK);
+		return 1;
+	}
+
+	writers = calloc(nthreads, sizeof(*writers));
+	if (!writers) {
+		perror("calloc");
+		return 1;
+	}
+
+	expired_before = uid_expire_count();
+
+	for (i = 0; i < nthreads; i++) {
+		writers[i].first = (long)nlocks * i / nthreads;
+		writers[i].last = (long)nlocks * (i + 1) / nthreads;
+		writers[i].seed = getpid() + i;
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		writes += writers[i].writes;
+		errors += writers[i].errors;
+		usecs += writers[i].usecs;
+	}
+
+	stats_us = read_file(STATS, NULL);
+	uids_us = read_file(UID_STATS, NULL);
+
+	printf("%d locks, %d threads, %d re-arm rounds, timeouts %d-%d ms\n",
+	       nlocks, nthreads, rounds, MIN_MS, max_ms);
+	printf("%lu lock writes, %.2f us each\n", writes,
+	       writes ? usecs / writes : 0);
+	if (errors)
+		printf("%lu failed writes\n", errors);
+	printf("reading %s took %.0f us, %s %.0f us\n",
+	       STATS, stats_us, UID_STATS, uids_us);
+
+	/* Give every lock time to expire, with some slack for the timer */
+	sleep(max_ms / 1000 + 1);
+
+	active = count_active();
+	expired = uid_expire_count() - expired_before;
+	printf("%d locks still active, %ld expiries charged to uid %u\n",
+	       active, expired, getuid());
+
+	close(lock_fd);
+	free(writers);
+	return (active || expired < nlocks) ? 1 : 0;
+}
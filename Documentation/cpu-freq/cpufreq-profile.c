@@ -0,0 +1,272 @@
+/*
+ * cpufreq-profile.c
+ *
+ * Run the cpufreq profiler (CONFIG_CPU_FREQ_PROFILE) over a command or a
+ * fixed time and summarize what it recorded.
+ *
+ * The profiler is cleared and enabled, the command is run (or -d seconds
+ * pass), and the profiler is disabled again. Then the transition latency
+ * histograms are printed as the kernel formats them, the oscillation
+ * counts with the share of transitions that reversed direction within
+ * the window, and the -t tasks that ran longest, each with its cpu time,
+ * the average frequency it ran at and the share of its time spent at
+ * each frequency.
+ *
+ * It works with any cpufreq driver; in a virtual machine load the fake
+ * driver (CONFIG_CPU_FREQ_FAKE) first:
+ *
+ *	modprobe cpufreq_fake transition_us=200
+ *	cpufreq-profile -w 50 -- make -j4
+ *
+ * Needs root and debugfs mounted on /sys/kernel/debug.
+ *
+ * Usage: cpufreq-profile [-w window_ms] [-t tasks] [-d seconds] [command]
+ *
+ * Compile with
+ *	gcc -O2 cpufreq-profile.c -o cpufreq-profile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#define PROFILE		"/sys/kernel/debug/cpufreq_profile"
+#define MAX_FREQS	32
+#define MAX_TASKS	1024
+#define COMM_LEN	16
+
+static const char *window;
+static int ntop = 20;
+static int seconds = 10;
+
+struct task {
+	int pid;
+	char comm[COMM_LEN + 1];
+	unsigned long long ms[MAX_FREQS];
+	unsigned long long total;
+};
+
+static unsigned long freqs[MAX_FREQS];
+static int nfreqs;
+static struct task tasks[MAX_TASKS];
+static int ntasks;
+
+static void write_file(const char *path, const char *val)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != (ssize_t) strlen(val)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static FILE *open_file(const char *path)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	return f;
+}
+
+static void run(char *argv[])
+{
+	pid_t pid;
+	int status;
+
+	if (!argv[0]) {
+		sleep(seconds);
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid) {
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "%s failed, profiling it anyway\n", argv[0]);
+}
+
+static void show_latency(void)
+{
+	char line[256];
+	FILE *f;
+
+	f = open_file(PROFILE "/latency");
+	printf("transition latency\n");
+	while (fgets(line, sizeof(line), f))
+		printf("  %s", line);
+	fclose(f);
+}
+
+/* e.g. "window 100 ms" then "cpu0: transitions 120 oscillations 31" */
+static void show_oscillation(void)
+{
+	unsigned int trans, osc, ms;
+	char line[256];
+	FILE *f;
+	int cpu;
+
+	f = open_file(PROFILE "/oscillation");
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "window %u ms", &ms) == 1)
+			printf("oscillation, window %u ms\n", ms);
+		else if (sscanf(line, "cpu%d: transitions %u oscillations %u",
+				&cpu, &trans, &osc) == 3)
+			printf("  cpu%-3d %8u transitions %8u reversals "
+			       "(%.1f%%)\n", cpu, trans, osc,
+			       trans ? 100.0 * osc / trans : 0.0);
+	}
+	fclose(f);
+}
+
+/*
+ * A header of "pid comm" and the frequencies, then per task the pid, the
+ * comm padded to COMM_LEN and the milliseconds at each frequency.
+ */
+static void read_tasks(void)
+{
+	char line[1024], *p, *end;
+	struct task *t;
+	int i, n;
+	FILE *f;
+
+	f = open_file(PROFILE "/tasks");
+	if (!fgets(line, sizeof(line), f)) {
+		fprintf(stderr, "no task times recorded\n");
+		exit(1);
+	}
+	p = strstr(line, "comm");
+	for (p = p ? p + 4 : line; nfreqs < MAX_FREQS; nfreqs++) {
+		freqs[nfreqs] = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		p = end;
+	}
+
+	while (ntasks < MAX_TASKS && fgets(line, sizeof(line), f)) {
+		t = &tasks[ntasks];
+		if (sscanf(line, "%d%n", &t->pid, &n) != 1 ||
+		    (int) strlen(line) < n + 1 + COMM_LEN)
+			continue;
+		memcpy(t->comm, line + n + 1, COMM_LEN);
+		for (i = COMM_LEN; i > 0 && t->comm[i - 1] == ' '; i--)
+			;
+		t->comm[i] = '\0';
+
+		p = line + n + 1 + COMM_LEN;
+		t->total = 0;
+		for (i = 0; i < nfreqs; i++) {
+			t->ms[i] = strtoull(p, &p, 10);
+			t->total += t->ms[i];
+		}
+		ntasks++;
+	}
+	fclose(f);
+}
+
+static int cmp_task(const void *a, const void *b)
+{
+	const struct task *x = a, *y = b;
+
+	return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static void show_tasks(void)
+{
+	double avg;
+	int i, j;
+
+	read_tasks();
+	qsort(tasks, ntasks, sizeof(*tasks), cmp_task);
+
+	printf("tasks by cpu time, %% of each task's time per frequency\n");
+	printf("%6s %-16s %9s %9s", "pid", "comm", "ms", "avg kHz");
+	for (j = 0; j < nfreqs; j++)
+		printf(" %7lu", freqs[j]);
+	printf("\n");
+
+	for (i = 0; i < ntasks && i < ntop; i++) {
+		struct task *t = &tasks[i];
+
+		if (!t->total)
+			break;
+		avg = 0;
+		for (j = 0; j < nfreqs; j++)
+			avg += (double) freqs[j] * t->ms[j] / t->total;
+
+		printf("%6d %-16s %9llu %9.0f", t->pid, t->comm, t->total,
+		       avg);
+		for (j = 0; j < nfreqs; j++)
+			printf(" %7.1f", 100.0 * t->ms[j] / t->total);
+		printf("\n");
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-w window_ms] [-t tasks] [-d seconds] [command]\n"
+		"  -w  oscillation window, in ms (default as set in debugfs)\n"
+		"  -t  tasks to list (default %d)\n"
+		"  -d  seconds to profile when no command is given "
+		"(default %d)\n",
+		prog, ntop, seconds);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+w:t:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			window = optarg;
+			break;
+		case 't':
+			ntop = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (ntop < 1 || seconds < 1)
+		usage(argv[0]);
+
+	if (window)
+		write_file(PROFILE "/osc_window_ms", window);
+
+	/* Enabling clears the previous results */
+	write_file(PROFILE "/enable", "0");
+	write_file(PROFILE "/enable", "1");
+	run(argv + optind);
+	write_file(PROFILE "/enable", "0");
+
+	show_latency();
+	show_oscillation();
+	show_tasks();
+
+	return 0;
+}
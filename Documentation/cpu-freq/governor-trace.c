@@ -0,0 +1,363 @@
+/*
+ * governor-trace.c
+ *
+ * Measure from an ftrace trace how fast a cpufreq governor reacts to load
+ * and how many timer wakeups the system takes while idle.
+ *
+ * The test enables the power_frequency, timer_expire_entry and
+ * hrtimer_expire_entry events and first leaves the system idle for -i
+ * seconds; every timer expiring in that time counts as a wakeup, and the
+ * wakeups per second are reported per cpu along with the timer functions
+ * that caused most of them. Then -n times it idles for -g ms and runs a
+ * process spinning on cpu -c for -l ms. Each load step is marked in the
+ * trace through trace_marker, and the time from the mark to the first
+ * power_frequency event and to the event reaching scaling_max_freq is
+ * reported as min/p50/p90/max.
+ *
+ * power_frequency has no cpu field and is logged on the cpu that changed
+ * the frequency, so leave the other cpus idle at their lowest frequency
+ * while the test runs. acpi-cpufreq emits the event, and so does the fake
+ * cpufreq driver (CONFIG_CPU_FREQ_FAKE), which gives a virtual machine
+ * frequencies to scale:
+ *
+ *	modprobe cpufreq_fake transition_us=200
+ *	echo smartassV2 > /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor
+ *	governor-trace -c 0 -n 20
+ *
+ * Compare the wakeups of the same run under ondemand. If the trace buffer
+ * overflows, raise /sys/kernel/debug/tracing/buffer_size_kb or shorten -i.
+ * Needs root and debugfs mounted on /sys/kernel/debug.
+ *
+ * Usage: governor-trace [-c cpu] [-n steps] [-l load_ms] [-g gap_ms]
+ *			 [-i idle_s]
+ *
+ * Compile with
+ *	gcc -O2 governor-trace.c -o governor-trace
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#define TRACING		"/sys/kernel/debug/tracing"
+#define MAX_CPUS	64
+#define MAX_FUNCS	256
+#define TOP_FUNCS	8
+#define MARK		"governor-trace"
+
+static const char *events[] = {
+	"power/power_frequency",
+	"timer/timer_expire_entry",
+	"timer/hrtimer_expire_entry",
+};
+#define NR_EVENTS	(sizeof(events) / sizeof(events[0]))
+
+static int cpu;
+static int nsteps = 10;
+static int load_ms = 200;
+static int gap_ms = 1000;
+static int idle_s = 10;
+
+struct func {
+	char name[64];
+	unsigned long count;
+};
+
+static struct func funcs[MAX_FUNCS];
+static int nfuncs;
+
+static void write_file(const char *path, const char *val)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != (ssize_t) strlen(val)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void set_events(const char *val)
+{
+	char path[256];
+	unsigned int i;
+
+	for (i = 0; i < NR_EVENTS; i++) {
+		snprintf(path, sizeof(path), TRACING "/events/%s/enable",
+			 events[i]);
+		write_file(path, val);
+	}
+}
+
+static void mark(const char *fmt, int n)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), fmt, n);
+	write_file(TRACING "/trace_marker", buf);
+}
+
+static unsigned long max_freq(void)
+{
+	char path[128], buf[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_max_freq", cpu);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		perror(path);
+		exit(1);
+	}
+	buf[len] = '\0';
+	return strtoul(buf, NULL, 10);
+}
+
+/* Spin on 'cpu' for load_ms, marking the start of the load in the trace */
+static void load_step(int step)
+{
+	cpu_set_t set;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			exit(1);
+		}
+		mark(MARK " step %d\n", step);
+		for (;;)
+			;
+	}
+	usleep(load_ms * 1000);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static void count_func(const char *rest)
+{
+	const char *p;
+	char name[64];
+	int i;
+
+	p = strstr(rest, "function=");
+	if (!p || sscanf(p + 9, "%63s", name) != 1)
+		return;
+
+	for (i = 0; i < nfuncs; i++) {
+		if (!strcmp(funcs[i].name, name)) {
+			funcs[i].count++;
+			return;
+		}
+	}
+	if (nfuncs < MAX_FUNCS) {
+		strcpy(funcs[nfuncs].name, name);
+		funcs[nfuncs++].count = 1;
+	}
+}
+
+static int cmp_func(const void *a, const void *b)
+{
+	const struct func *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_delays(const char *what, double *delays, int count)
+{
+	printf("%-16s", what);
+	if (!count) {
+		printf(" never\n");
+		return;
+	}
+	qsort(delays, count, sizeof(*delays), cmp_double);
+	printf(" us min %.0f  p50 %.0f  p90 %.0f  max %.0f  (%d of %d steps)\n",
+	       delays[0] * 1e6, delays[count / 2] * 1e6,
+	       delays[count * 9 / 10] * 1e6, delays[count - 1] * 1e6, count,
+	       nsteps);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-c cpu] [-n steps] [-l load_ms] [-g gap_ms]\n"
+		"\t\t[-i idle_s]\n"
+		"  -c  cpu to load (default %d)\n"
+		"  -n  load steps to time (default %d)\n"
+		"  -l  length of each load step, in ms (default %d)\n"
+		"  -g  idle time before each step, in ms (default %d)\n"
+		"  -i  seconds of idle to count wakeups over (default %d)\n",
+		prog, cpu, nsteps, load_ms, gap_ms, idle_s);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long wakeups[MAX_CPUS] = { 0 };
+	unsigned long idle_changes = 0, total = 0;
+	double start = -1, idle_end = -1, step_ts = -1;
+	double *first, *to_max;
+	int nfirst = 0, nmax = 0;
+	int step = -1, got_first = 0, got_max = 0;
+	unsigned long target, state;
+	char line[512], *p, *rest;
+	double ts;
+	FILE *f;
+	int opt;
+	int c, i;
+
+	while ((opt = getopt(argc, argv, "c:n:l:g:i:")) != -1) {
+		switch (opt) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'n':
+			nsteps = atoi(optarg);
+			break;
+		case 'l':
+			load_ms = atoi(optarg);
+			break;
+		case 'g':
+			gap_ms = atoi(optarg);
+			break;
+		case 'i':
+			idle_s = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (cpu < 0 || cpu >= MAX_CPUS || nsteps < 1 || load_ms < 1 ||
+	    gap_ms < 0 || idle_s < 1)
+		usage(argv[0]);
+
+	first = calloc(nsteps, sizeof(*first));
+	to_max = calloc(nsteps, sizeof(*to_max));
+	if (!first || !to_max) {
+		perror("calloc");
+		return 1;
+	}
+	target = max_freq();
+
+	/* Record the run */
+	write_file(TRACING "/tracing_on", "0");
+	write_file(TRACING "/trace", "");
+	set_events("1");
+	write_file(TRACING "/tracing_on", "1");
+
+	mark(MARK " start %d\n", 0);
+	sleep(idle_s);
+	mark(MARK " idle %d\n", idle_s);
+	for (i = 0; i < nsteps; i++) {
+		usleep(gap_ms * 1000);
+		load_step(i);
+	}
+
+	write_file(TRACING "/tracing_on", "0");
+	set_events("0");
+
+	/* e.g. "  <idle>-0     [000]   123.456789: power_frequency: ..." */
+	f = fopen(TRACING "/trace", "r");
+	if (!f) {
+		perror(TRACING "/trace");
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		p = strchr(line, '[');
+		if (!p || sscanf(p, "[%d] %lf:", &c, &ts) != 2)
+			continue;
+		rest = strchr(p, ':');
+		if (!rest)
+			continue;
+
+		if (strstr(rest, MARK " start")) {
+			start = ts;
+		} else if (strstr(rest, MARK " idle")) {
+			idle_end = ts;
+		} else if (strstr(rest, MARK " step")) {
+			sscanf(strstr(rest, MARK " step"), MARK " step %d",
+			       &step);
+			step_ts = ts;
+			got_first = got_max = 0;
+		} else if (strstr(rest, " timer_expire_entry:") ||
+			   strstr(rest, " hrtimer_expire_entry:")) {
+			if (start < 0 || idle_end >= 0)
+				continue;
+			if (c >= 0 && c < MAX_CPUS)
+				wakeups[c]++;
+			total++;
+			count_func(rest);
+		} else if ((p = strstr(rest, " power_frequency:"))) {
+			if (start >= 0 && idle_end < 0)
+				idle_changes++;
+			/* Only changes while the step's load runs count */
+			if (step < 0 || ts - step_ts > load_ms / 1000.0 ||
+			    !(p = strstr(p, "state=")) ||
+			    sscanf(p, "state=%lu", &state) != 1)
+				continue;
+			if (!got_first) {
+				first[nfirst++] = ts - step_ts;
+				got_first = 1;
+			}
+			if (!got_max && state >= target) {
+				to_max[nmax++] = ts - step_ts;
+				got_max = 1;
+			}
+		}
+	}
+	fclose(f);
+
+	if (start < 0 || idle_end < 0 || step != nsteps - 1) {
+		fprintf(stderr, "trace buffer overflowed, marks are missing\n");
+		return 1;
+	}
+
+	printf("idle %d s: %.1f timer wakeups/s, %lu frequency changes\n",
+	       idle_s, total / (idle_end - start), idle_changes);
+	for (c = 0; c < MAX_CPUS; c++)
+		if (wakeups[c])
+			printf("  cpu%-3d %10.1f/s\n", c,
+			       wakeups[c] / (idle_end - start));
+	qsort(funcs, nfuncs, sizeof(*funcs), cmp_func);
+	for (i = 0; i < nfuncs && i < TOP_FUNCS; i++)
+		printf("  %-40s %10.1f/s\n", funcs[i].name,
+		       funcs[i].count / (idle_end - start));
+
+	printf("%d load steps of %d ms on cpu%d, max %lu kHz\n", nsteps,
+	       load_ms, cpu, target);
+	print_delays("first change", first, nfirst);
+	print_delays("to max", to_max, nmax);
+
+	return nmax == nsteps ? 0 : 1;
+}
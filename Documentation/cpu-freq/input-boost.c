@@ -0,0 +1,236 @@
+/*
+ * input-boost.c
+ *
+ * Measure how long after an input event the cpu reaches its boost
+ * frequency.
+ *
+ * The test creates a keypad through uinput, which the smartass2 input
+ * handler connects to like to any key device. Then -n times it waits for
+ * cpu0 to settle below the target frequency, sends a key press and polls
+ * scaling_cur_freq until the target is reached, and reports the delays.
+ * The target is smartass2's boost_freq unless given with -f.
+ *
+ * In a virtual machine load the fake cpufreq driver (CONFIG_CPU_FREQ_FAKE)
+ * to have frequencies at all; its transition_us parameter adds the time a
+ * real clock switch takes. Then:
+ *
+ *	echo smartassV2 > /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor
+ *	input-boost -n 50
+ *
+ * Needs write access to /dev/uinput.
+ *
+ * Usage: input-boost [-n events] [-f kHz] [-g gap_ms]
+ *
+ * Compile with
+ *	gcc -O2 input-boost.c -o input-boost
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define UINPUT		"/dev/uinput"
+#define CUR_FREQ	"/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+#define BOOST_FREQ	"/sys/devices/system/cpu/cpufreq/smartass/boost_freq"
+#define POLL_US		50
+#define TIMEOUT		2.0	/* seconds to wait for a frequency change */
+
+static int nevents = 20;
+static unsigned long target;
+static int gap_ms = 1000;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long read_ulong(const char *path)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		perror(path);
+		exit(1);
+	}
+	buf[len] = '\0';
+	return strtoul(buf, NULL, 10);
+}
+
+static int create_keypad(void)
+{
+	struct uinput_user_dev dev;
+	int fd;
+
+	fd = open(UINPUT, O_WRONLY);
+	if (fd < 0) {
+		perror(UINPUT);
+		exit(1);
+	}
+
+	memset(&dev, 0, sizeof(dev));
+	strncpy(dev.name, "input-boost keypad", UINPUT_MAX_NAME_SIZE - 1);
+	dev.id.bustype = BUS_VIRTUAL;
+
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+	    ioctl(fd, UI_SET_KEYBIT, KEY_ENTER) < 0 ||
+	    write(fd, &dev, sizeof(dev)) != sizeof(dev) ||
+	    ioctl(fd, UI_DEV_CREATE) < 0) {
+		perror("uinput");
+		exit(1);
+	}
+
+	/* Give the input handlers time to connect */
+	sleep(1);
+	return fd;
+}
+
+static void send_key(int fd, int value)
+{
+	struct input_event ev[2];
+
+	memset(ev, 0, sizeof(ev));
+	ev[0].type = EV_KEY;
+	ev[0].code = KEY_ENTER;
+	ev[0].value = value;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+
+	if (write(fd, ev, sizeof(ev)) != sizeof(ev)) {
+		perror("uinput write");
+		exit(1);
+	}
+}
+
+/*
+ * Poll until cpu0 runs at least at 'freq' (above is set) or below it,
+ * returning the seconds waited, or -1 on timeout.
+ */
+static double wait_freq(unsigned long freq, int above)
+{
+	double start = now(), t;
+	unsigned long cur;
+
+	for (;;) {
+		cur = read_ulong(CUR_FREQ);
+		t = now() - start;
+		if (above ? cur >= freq : cur < freq)
+			return t;
+		if (t > TIMEOUT)
+			return -1;
+		usleep(POLL_US);
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n events] [-f kHz] [-g gap_ms]\n"
+		"  -n  input events to time (default %d)\n"
+		"  -f  frequency to wait for (default smartass2 boost_freq)\n"
+		"  -g  idle time before each event, in ms (default %d)\n",
+		prog, nevents, gap_ms);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	double *delays, t;
+	int timeouts = 0, count = 0;
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:f:g:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nevents = atoi(optarg);
+			break;
+		case 'f':
+			target = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gap_ms = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nevents < 1 || gap_ms < 0)
+		usage(argv[0]);
+
+	if (!target)
+		target = read_ulong(BOOST_FREQ);
+	if (!target) {
+		fprintf(stderr, "boosting is off (boost_freq is 0)\n");
+		return 1;
+	}
+
+	delays = calloc(nevents, sizeof(*delays));
+	if (!delays) {
+		perror("calloc");
+		return 1;
+	}
+	fd = create_keypad();
+
+	for (i = 0; i < nevents; i++) {
+		usleep(gap_ms * 1000);
+		if (wait_freq(target, 0) < 0) {
+			fprintf(stderr, "cpu0 stays at or above %lu kHz\n",
+				target);
+			return 1;
+		}
+
+		send_key(fd, 1);
+		t = wait_freq(target, 1);
+		send_key(fd, 0);
+
+		if (t < 0)
+			timeouts++;
+		else
+			delays[count++] = t;
+	}
+
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+
+	printf("%d input events, target %lu kHz\n", nevents, target);
+	if (timeouts)
+		printf("%d events did not reach it within %.0f s\n", timeouts,
+		       TIMEOUT);
+	if (count) {
+		qsort(delays, count, sizeof(*delays), cmp_double);
+		printf("time to target us: min %.0f  p50 %.0f  p90 %.0f  "
+		       "max %.0f\n", delays[0] * 1e6,
+		       delays[count / 2] * 1e6, delays[count * 9 / 10] * 1e6,
+		       delays[count - 1] * 1e6);
+	}
+
+	return timeouts ? 1 : 0;
+}
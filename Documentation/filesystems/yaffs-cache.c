@@ -0,0 +1,225 @@
+/*
+ * yaffs-cache.c
+ *
+ * Exercise the yaffs2 short-op chunk cache: write coalescing, sequential
+ * read-ahead and hits on random reads.
+ *
+ * The test writes a file of -s MB in -w byte records and syncs it, then
+ * reads it back sequentially and finally with -r random 4 kB reads. The
+ * page cache is dropped for the file before each read pass, so every read
+ * reaches yaffs. For each pass the throughput is reported with the
+ * change in the NAND and cache counters of /proc/yaffs.
+ *
+ * Whole chunks are read straight into the page cache, but a sequential
+ * read still reads the chunks after it ahead into the short-op cache, so
+ * the sequential pass shows the read-ahead hits. Compare a small cache
+ * with a large one, e.g.
+ *
+ *	mount -t yaffs2 -o cache-size=10 /dev/mtdblock0 /mnt
+ *	yaffs-cache -d /mnt
+ *	umount /mnt
+ *	mount -t yaffs2 -o cache-size=256 /dev/mtdblock0 /mnt
+ *	yaffs-cache -d /mnt
+ *
+ * The /proc/yaffs counters are summed over all yaffs devices, so keep only
+ * the test filesystem mounted.
+ *
+ * Usage: yaffs-cache [-d dir] [-s MB] [-w bytes] [-r reads]
+ *
+ * Compile with
+ *	gcc -O2 yaffs-cache.c -o yaffs-cache
+ */
+
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#define PROC_YAFFS	"/proc/yaffs"
+#define READ_SIZE	4096
+#define SEQ_READ_SIZE	(64 * 1024)
+
+/* /proc/yaffs counters reported for each pass */
+static const char *counters[] = {
+	"nPageReads", "nPageWrites", "cacheHits", "cacheMisses",
+	"cacheReadAheads", "cacheReadAheadHits", "cacheCoalesced",
+	"cacheSkippedReads",
+};
+#define NR_COUNTERS	(sizeof(counters) / sizeof(counters[0]))
+
+static const char *dir = ".";
+static int size_mb = 16;
+static int record = 512;
+static int nreads = 4096;
+
+static unsigned long before[NR_COUNTERS];
+static double start;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Sum each counter over all the devices in /proc/yaffs */
+static void read_counters(unsigned long *vals)
+{
+	char line[256], name[64];
+	unsigned long val;
+	unsigned int i;
+	FILE *f;
+
+	memset(vals, 0, NR_COUNTERS * sizeof(*vals));
+
+	f = fopen(PROC_YAFFS, "r");
+	if (!f) {
+		perror(PROC_YAFFS);
+		exit(1);
+	}
+	/* e.g. "cacheHits.......... 1234" */
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63[A-Za-z]%*[.] %lu", name, &val) != 2)
+			continue;
+		for (i = 0; i < NR_COUNTERS; i++)
+			if (!strcmp(name, counters[i]))
+				vals[i] += val;
+	}
+	fclose(f);
+}
+
+static void pass_start(void)
+{
+	read_counters(before);
+	start = now();
+}
+
+static void pass_end(const char *what, unsigned long bytes)
+{
+	unsigned long after[NR_COUNTERS];
+	double t = now() - start;
+	unsigned int i;
+
+	read_counters(after);
+	printf("%s: %.1f MB in %.2f s, %.2f MB/s\n", what, bytes / 1048576.0,
+	       t, bytes / 1048576.0 / t);
+	for (i = 0; i < NR_COUNTERS; i++)
+		printf("  %-18s %10lu\n", counters[i], after[i] - before[i]);
+}
+
+/* Make the next reads of 'fd' go to yaffs rather than the page cache */
+static void drop_cache(int fd)
+{
+	int err;
+
+	err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (err) {
+		fprintf(stderr, "posix_fadvise: %s\n", strerror(err));
+		exit(1);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d dir] [-s MB] [-w bytes] [-r reads]\n"
+		"  -d  directory on the yaffs2 filesystem (default %s)\n"
+		"  -s  size of the test file in MB (default %d)\n"
+		"  -w  bytes per write while creating it (default %d)\n"
+		"  -r  random 4 kB reads to do (default %d)\n",
+		prog, dir, size_mb, record, nreads);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = 1;
+	char name[4096];
+	off_t size, off;
+	char *buf;
+	ssize_t n;
+	int opt;
+	int fd;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:s:w:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'w':
+			record = atoi(optarg);
+			break;
+		case 'r':
+			nreads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (size_mb < 1 || record < 1 || record > SEQ_READ_SIZE || nreads < 1)
+		usage(argv[0]);
+
+	buf = malloc(SEQ_READ_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	memset(buf, 0x5a, SEQ_READ_SIZE);
+	size = (off_t) size_mb << 20;
+
+	snprintf(name, sizeof(name), "%s/yaffs-cache.dat", dir);
+	fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+
+	pass_start();
+	for (off = 0; off < size; off += record) {
+		if (write(fd, buf, record) != record) {
+			perror(name);
+			return 1;
+		}
+	}
+	if (fsync(fd) < 0) {
+		perror(name);
+		return 1;
+	}
+	pass_end("write", size);
+
+	drop_cache(fd);
+	pass_start();
+	for (off = 0; off < size; off += n) {
+		n = pread(fd, buf, SEQ_READ_SIZE, off);
+		if (n <= 0) {
+			perror(name);
+			return 1;
+		}
+	}
+	pass_end("sequential read", size);
+
+	drop_cache(fd);
+	pass_start();
+	for (i = 0; i < nreads; i++) {
+		off = (off_t) (rand_r(&seed) % (size / READ_SIZE)) * READ_SIZE;
+		if (pread(fd, buf, READ_SIZE, off) != READ_SIZE) {
+			perror(name);
+			return 1;
+		}
+	}
+	pass_end("random read", (unsigned long) nreads * READ_SIZE);
+
+	close(fd);
+	unlink(name);
+	return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * yaffs-mount.c
+ *
+ * Time yaffs2 mounts that have to scan the NAND instead of reading a
+ * checkpoint.
+ *
+ * With -p the device is first mounted and populated with -p files of
+ * 4 kB to 256 kB spread over 64 directories. Then it is mounted and
+ * unmounted -r times with "no-checkpoint" added to the -o options, so
+ * every mount rebuilds the filesystem from a scan. For each mount the
+ * time taken is reported, along with the scan counters from /proc/yaffs:
+ * blocks scanned through their summary and fully, and, with lazy file
+ * loading, files left for loading on first use. A walk reading one byte
+ * of every file is timed after each mount too, since lazy loading moves
+ * part of the mount cost there.
+ *
+ * Compare e.g. -o summary-off, -o summary-on and
+ * -o summary-on,lazy-file-loading-on on nandsim devices of different
+ * sizes, all with 2 kB pages and 128 kB blocks:
+ *
+ *	256 MB	second_id_byte=0xaa
+ *	512 MB	second_id_byte=0xdc
+ *	1 GB	second_id_byte=0xd3
+ *	2 GB	second_id_byte=0xd5
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xd3 \
+ *		third_id_byte=0x00 fourth_id_byte=0x15 cache_file=/tmp/nand
+ *	yaffs-mount -m /dev/mtdblock0 -d /mnt -p 20000 -o summary-on
+ *
+ * Summaries are only written while mounted with them on, so populate with
+ * the same summary option that is measured. The /proc/yaffs counters are
+ * summed over all yaffs devices, so keep only the test filesystem
+ * mounted. Needs root.
+ *
+ * Usage: yaffs-mount [-m device] [-d dir] [-o options] [-p files] [-r runs]
+ *
+ * Compile with
+ *	gcc -O2 yaffs-mount.c -o yaffs-mount
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define PROC_YAFFS	"/proc/yaffs"
+#define NR_DIRS		64
+#define MAX_FILE	(256 * 1024)
+
+/* /proc/yaffs counters reported for each mount */
+static const char *counters[] = {
+	"nSummaryScans", "nFullScans", "nDeferredFiles", "nDeferredLoads",
+};
+#define NR_COUNTERS	(sizeof(counters) / sizeof(counters[0]))
+
+static const char *device = "/dev/mtdblock0";
+static const char *dir = "/mnt";
+static const char *options = "";
+static int populate;
+static int runs = 5;
+
+static char buf[MAX_FILE];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Sum each counter over all the devices in /proc/yaffs */
+static void read_counters(unsigned long *vals)
+{
+	char line[256], name[64];
+	unsigned long val;
+	unsigned int i;
+	FILE *f;
+
+	memset(vals, 0, NR_COUNTERS * sizeof(*vals));
+
+	f = fopen(PROC_YAFFS, "r");
+	if (!f) {
+		perror(PROC_YAFFS);
+		exit(1);
+	}
+	/* e.g. "nFullScans......... 1234" */
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63[A-Za-z]%*[.] %lu", name, &val) != 2)
+			continue;
+		for (i = 0; i < NR_COUNTERS; i++)
+			if (!strcmp(name, counters[i]))
+				vals[i] += val;
+	}
+	fclose(f);
+}
+
+static double do_mount(const char *opts)
+{
+	double t;
+
+	t = now();
+	if (mount(device, dir, "yaffs2", 0, opts) < 0) {
+		fprintf(stderr, "mount %s on %s -o %s: %m\n", device, dir,
+			opts);
+		exit(1);
+	}
+	return now() - t;
+}
+
+static void do_umount(void)
+{
+	if (umount(dir) < 0) {
+		perror("umount");
+		exit(1);
+	}
+}
+
+static void path_of(char *path, size_t size, int i)
+{
+	snprintf(path, size, "%s/d%02d/f%06d", dir, i % NR_DIRS, i);
+}
+
+static void populate_files(void)
+{
+	unsigned int seed = 1;
+	char path[4096];
+	size_t size;
+	int fd;
+	int i;
+
+	for (i = 0; i < NR_DIRS; i++) {
+		snprintf(path, sizeof(path), "%s/d%02d", dir, i);
+		if (mkdir(path, 0755) < 0) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < populate; i++) {
+		path_of(path, sizeof(path), i);
+		size = 4096 + rand_r(&seed) % (MAX_FILE - 4096);
+		memset(buf, i, size);
+
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, size) != (ssize_t) size) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+	sync();
+}
+
+/* Read one byte of every file, returning how many were found */
+static int walk_files(void)
+{
+	char path[4096];
+	int found = 0;
+	int fd;
+	int i;
+
+	for (i = 0; ; i++) {
+		path_of(path, sizeof(path), i);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			break;
+		if (read(fd, buf, 1) != 1) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+		found++;
+	}
+	return found;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m device] [-d dir] [-o options] [-p files] [-r runs]\n"
+		"  -m  mtd block device with yaffs2 (default %s)\n"
+		"  -d  mount point (default %s)\n"
+		"  -o  yaffs mount options to measure\n"
+		"  -p  populate an empty filesystem with this many files first\n"
+		"  -r  mounts to time (default %d)\n",
+		prog, device, dir, runs);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long vals[NR_COUNTERS];
+	char opts[256];
+	double mount_s, walk_s;
+	unsigned int i;
+	int files;
+	int opt;
+	int r;
+
+	while ((opt = getopt(argc, argv, "m:d:o:p:r:")) != -1) {
+		switch (opt) {
+		case 'm':
+			device = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			options = optarg;
+			break;
+		case 'p':
+			populate = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (populate < 0 || runs < 1)
+		usage(argv[0]);
+
+	snprintf(opts, sizeof(opts), "%s%sno-checkpoint", options,
+		 options[0] ? "," : "");
+
+	if (populate) {
+		do_mount(opts);
+		populate_files();
+		do_umount();
+		printf("populated %s with %d files\n", device, populate);
+	}
+
+	printf("mounting %s -o %s\n", device, opts);
+	for (r = 0; r < runs; r++) {
+		mount_s = do_mount(opts);
+		read_counters(vals);
+
+		printf("  mount %.3f s", mount_s);
+		for (i = 0; i < NR_COUNTERS; i++)
+			printf(", %s %lu", counters[i], vals[i]);
+		printf("\n");
+
+		walk_s = now();
+		files = walk_files();
+		walk_s = now() - walk_s;
+		read_counters(vals);
+		printf("  walk of %d files %.3f s, %s %lu\n", files, walk_s,
+		       counters[NR_COUNTERS - 1], vals[NR_COUNTERS - 1]);
+
+		do_umount();
+	}
+
+	return 0;
+}
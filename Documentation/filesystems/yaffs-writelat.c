@@ -0,0 +1,278 @@
+/*
+ * yaffs-writelat.c
+ *
+ * Measure yaffs2 write latency tails while garbage collection is busy.
+ *
+ * The test fills -f percent of the free space of a mounted yaffs2
+ * filesystem with -n files, then for -s seconds overwrites random
+ * -w byte records in them, each followed by fdatasync() so the write
+ * reaches NAND. Every overwrite leaves a stale chunk behind, so the
+ * filesystem soon has to collect blocks to keep erased space, either in
+ * the writer's context or in the background thread.
+ *
+ * The latency of each write and sync is reported as p50/p90/p99/p99.9 and
+ * max, with the change in the gc counters of /proc/yaffs over the run.
+ * Run it once with -b 0 and once with -b 1 to compare gc done by writers
+ * alone against gc done in the background.
+ *
+ * nandsim makes a suitable device, for example a 256 MB NAND with 2 kB
+ * pages:
+ *
+ *	modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+ *		third_id_byte=0x00 fourth_id_byte=0x15
+ *	mount -t yaffs2 /dev/mtdblock0 /mnt
+ *	yaffs-writelat -d /mnt
+ *
+ * The /proc/yaffs counters are summed over all yaffs devices, so keep only
+ * the test filesystem mounted. Setting -b needs root.
+ *
+ * Usage: yaffs-writelat [-d dir] [-n files] [-f percent] [-w bytes]
+ *			 [-s seconds] [-b 0|1]
+ *
+ * Compile with
+ *	gcc -O2 yaffs-writelat.c -o yaffs-writelat
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+#define PROC_YAFFS	"/proc/yaffs"
+#define BG_ENABLE	"/sys/module/yaffs/parameters/yaffs_bg_enable"
+#define MAX_US		100000	/* latency histogram range */
+
+/* /proc/yaffs counters reported for the run */
+static const char *counters[] = {
+	"nPageWrites", "nBlockErasures", "nGCCopies", "allGCs",
+	"passiveGCs", "oldestDirtyGCs", "nGCBlocks", "nGCSteps",
+	"backgroundGCs",
+};
+#define NR_COUNTERS	(sizeof(counters) / sizeof(counters[0]))
+
+static const char *dir = ".";
+static int nfiles = 16;
+static int fill_pct = 80;
+static int record = 2048;
+static int seconds = 30;
+static const char *bg_enable;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void write_file(const char *path, const char *val)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != (ssize_t) strlen(val)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+/* Sum each counter over all the devices in /proc/yaffs */
+static void read_counters(unsigned long *vals)
+{
+	char line[256], name[64];
+	unsigned long val;
+	unsigned int i;
+	FILE *f;
+
+	memset(vals, 0, NR_COUNTERS * sizeof(*vals));
+
+	f = fopen(PROC_YAFFS, "r");
+	if (!f) {
+		perror(PROC_YAFFS);
+		exit(1);
+	}
+	/* e.g. "nGCCopies.......... 1234" */
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63[A-Za-z]%*[.] %lu", name, &val) != 2)
+			continue;
+		for (i = 0; i < NR_COUNTERS; i++)
+			if (!strcmp(name, counters[i]))
+				vals[i] += val;
+	}
+	fclose(f);
+}
+
+static void file_name(char *name, size_t size, int i)
+{
+	snprintf(name, size, "%s/yaffs-writelat.%d", dir, i);
+}
+
+/* Create the files, returning their size */
+static off_t fill(int *fds, char *buf)
+{
+	struct statvfs st;
+	char name[4096];
+	off_t size, done;
+	int i;
+
+	if (statvfs(dir, &st) < 0) {
+		perror(dir);
+		exit(1);
+	}
+	size = (off_t) st.f_bavail * st.f_bsize / 100 * fill_pct / nfiles;
+	size -= size % record;
+	if (size < record) {
+		fprintf(stderr, "%s: not enough free space\n", dir);
+		exit(1);
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		file_name(name, sizeof(name), i);
+		fds[i] = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fds[i] < 0) {
+			perror(name);
+			exit(1);
+		}
+		for (done = 0; done < size; done += record) {
+			if (write(fds[i], buf, record) != record) {
+				perror(name);
+				exit(1);
+			}
+		}
+		fsync(fds[i]);
+	}
+	return size;
+}
+
+/* Latency below which 'permille' of the 'count' samples in 'hist' fell */
+static long percentile(unsigned long *hist, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	long us;
+
+	for (us = 0; us < MAX_US; us++) {
+		seen += hist[us];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return us;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d dir] [-n files] [-f percent] [-w bytes]\n"
+		"\t\t[-s seconds] [-b 0|1]\n"
+		"  -d  directory on the yaffs2 filesystem (default %s)\n"
+		"  -n  files to spread the data over (default %d)\n"
+		"  -f  percentage of free space to fill (default %d)\n"
+		"  -w  bytes per overwrite (default %d)\n"
+		"  -s  seconds to overwrite for (default %d)\n"
+		"  -b  turn background gc off or on for the run\n",
+		prog, dir, nfiles, fill_pct, record, seconds);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned long hist[MAX_US + 1];
+	unsigned long before[NR_COUNTERS], after[NR_COUNTERS];
+	unsigned long count = 0;
+	unsigned int seed = 1;
+	char name[4096];
+	double start, t;
+	off_t size, off;
+	unsigned int i;
+	char *buf;
+	long max;
+	int *fds;
+	int opt;
+	int f;
+
+	while ((opt = getopt(argc, argv, "d:n:f:w:s:b:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 'f':
+			fill_pct = atoi(optarg);
+			break;
+		case 'w':
+			record = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			bg_enable = optarg;
+			if (strcmp(bg_enable, "0") && strcmp(bg_enable, "1"))
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nfiles < 1 || fill_pct < 1 || fill_pct > 95 || record < 1 ||
+	    seconds < 1)
+		usage(argv[0]);
+
+	fds = calloc(nfiles, sizeof(*fds));
+	buf = malloc(record);
+	if (!fds || !buf) {
+		perror("malloc");
+		return 1;
+	}
+	memset(buf, 0x5a, record);
+
+	if (bg_enable)
+		write_file(BG_ENABLE, bg_enable);
+
+	size = fill(fds, buf);
+	printf("%d files of %lld kB, %d byte overwrites for %d s\n",
+	       nfiles, (long long)size >> 10, record, seconds);
+
+	read_counters(before);
+	start = now();
+	while (now() - start < seconds) {
+		f = rand_r(&seed) % nfiles;
+		off = (off_t) (rand_r(&seed) % (size / record)) * record;
+		buf[0] = count;
+
+		t = now();
+		if (pwrite(fds[f], buf, record, off) != record ||
+		    fdatasync(fds[f]) < 0) {
+			perror("write");
+			return 1;
+		}
+		t = (now() - t) * 1e6;
+
+		hist[t < MAX_US ? (long) t : MAX_US]++;
+		count++;
+	}
+	read_counters(after);
+
+	for (max = MAX_US; max > 0 && !hist[max]; max--)
+		;
+	printf("%lu writes, us p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  "
+	       "max %ld%s\n", count, percentile(hist, count, 500),
+	       percentile(hist, count, 900), percentile(hist, count, 990),
+	       percentile(hist, count, 999), max, max == MAX_US ? "+" : "");
+	for (i = 0; i < NR_COUNTERS; i++)
+		printf("  %-15s %10lu\n", counters[i], after[i] - before[i]);
+
+	for (f = 0; f < nfiles; f++) {
+		close(fds[f]);
+		file_name(name, sizeof(name), f);
+		unlink(name);
+	}
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * rzs-churn.c
+ *
+ * Show how much memory ramzswap compaction gives back after swap churn.
+ *
+ * The test fills anonymous memory with pages of mixed compressibility, so
+ * the compressed objects come in many sizes and share xvmalloc pages. Once
+ * they have been swapped out to the ramzswap device, most of the pages are
+ * dropped again, scattered through the range, which leaves the pool pages
+ * sparsely used. The device statistics are printed after the fill, right
+ * after the frees and once compaction has had time to run.
+ *
+ * The device must already be initialized and in use as the only swap
+ * device (see drivers/staging/ramzswap/ramzswap.txt), and the test must
+ * run with less memory than -m, for example in a memory cgroup or a VM
+ * booted with a small mem=, or nothing will be swapped out.
+ *
+ * Usage: rzs-churn [-d device] [-m megabytes] [-f percent] [-w seconds]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/ramzswap rzs-churn.c \
+ *		-o rzs-churn
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#include "ramzswap_ioctl.h"
+
+static const char *device = "/dev/ramzswap0";
+static unsigned long megabytes = 256;
+static int free_pct = 75;
+static int wait_secs = 5;
+
+static int dev_fd;
+static long page_size;
+
+static void get_stats(struct ramzswap_ioctl_stats_ext *s)
+{
+	if (ioctl(dev_fd, RZSIO_GET_STATS_EXT, s) < 0) {
+		perror("RZSIO_GET_STATS_EXT");
+		exit(1);
+	}
+}
+
+static void show_stats(const char *when, struct ramzswap_ioctl_stats_ext *s)
+{
+	printf("%s:\n", when);
+	printf("  pages_stored     %10u\n", s->stats.pages_stored);
+	printf("  compr_data_size  %10llu kB\n",
+	       (unsigned long long)s->stats.compr_data_size >> 10);
+	printf("  pool_pages       %10llu (%llu kB)\n",
+	       (unsigned long long)s->pool_pages,
+	       (unsigned long long)s->pool_pages * page_size >> 10);
+	printf("  pool_used_bytes  %10llu kB\n",
+	       (unsigned long long)s->pool_used_bytes >> 10);
+	printf("  pool_frag_pct    %10u%%\n", s->pool_frag_pct);
+	printf("  mem_used_total   %10llu kB\n",
+	       (unsigned long long)s->stats.mem_used_total >> 10);
+	printf("  num_compactions  %10llu\n",
+	       (unsigned long long)s->num_compactions);
+	printf("  pages_compacted  %10llu\n",
+	       (unsigned long long)s->pages_compacted);
+}
+
+/*
+ * Fill a page with 'random' bytes followed by zeroes. How much of the page
+ * is random decides how well it compresses; it is varied from page to page
+ * so the compressed objects cover many xvmalloc size classes. The random
+ * part also keeps pages from being zero pages or duplicates of each other.
+ */
+static void fill_page(unsigned char *page, unsigned long index)
+{
+	static uint32_t x = 2463534242u;
+	size_t len;
+	size_t i;
+
+	len = 64 + (index * 2654435761u) % (page_size * 3 / 4);
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		page[i] = x;
+	}
+	memset(page + len, 0, page_size - len);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-m megabytes] [-f percent] [-w seconds]\n"
+		"  -d  ramzswap device in use as swap (default %s)\n"
+		"  -m  memory to fill, more than is available (default %lu)\n"
+		"  -f  percentage of the pages to free again (default %d)\n"
+		"  -w  seconds to wait for compaction (default %d)\n",
+		prog, device, megabytes, free_pct, wait_secs);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ramzswap_ioctl_stats_ext start, filled, freed, done;
+	unsigned long npages, i;
+	unsigned char *mem;
+	size_t size;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:f:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			free_pct = atoi(optarg);
+			break;
+		case 'w':
+			wait_secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!megabytes || free_pct < 1 || free_pct > 99 || wait_secs < 0)
+		usage(argv[0]);
+
+	dev_fd = open(device, O_RDONLY);
+	if (dev_fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	size = megabytes << 20;
+	npages = size / page_size;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	get_stats(&start);
+
+	for (i = 0; i < npages; i++)
+		fill_page(mem + i * page_size, i);
+
+	get_stats(&filled);
+	if (filled.stats.pages_stored <= start.stats.pages_stored) {
+		fprintf(stderr, "nothing was swapped out to %s; run with "
+			"less memory than %lu MB\n", device, megabytes);
+		return 1;
+	}
+
+	/*
+	 * Dropping a swapped out page frees its swap slot, and ramzswap
+	 * frees the compressed object. Stepping by 37 spreads the frees so
+	 * that neighbouring objects, which share pool pages, mostly differ
+	 * in whether they are freed, and pool pages end up sparse rather
+	 * than empty.
+	 */
+	for (i = 0; i < npages; i++) {
+		if ((i * 37) % 100 < (unsigned long)free_pct)
+			madvise(mem + i * page_size, page_size, MADV_DONTNEED);
+	}
+
+	get_stats(&freed);
+	sleep(wait_secs);
+	get_stats(&done);
+
+	printf("%lu MB filled, %d%% freed\n\n", megabytes, free_pct);
+	show_stats("after fill", &filled);
+	show_stats("after frees", &freed);
+	show_stats("after compaction", &done);
+
+	printf("\n%llu pool pages (%llu kB) released by %llu compaction passes\n",
+	       (unsigned long long)(done.pages_compacted -
+				    freed.pages_compacted),
+	       (unsigned long long)(done.pages_compacted -
+				    freed.pages_compacted) * page_size >> 10,
+	       (unsigned long long)(done.num_compactions -
+				    freed.num_compactions));
+
+	munmap(mem, size);
+	close(dev_fd);
+	return 0;
+}
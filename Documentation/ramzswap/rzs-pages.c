@@ -0,0 +1,374 @@
+/*
+ * rzs-pages.c
+ *
+ * Compare the ramzswap compressors on captured page dumps.
+ *
+ * The dump files are read whole and cut into pages, which are written to
+ * the device and read back once for every compressor given with -c. Before
+ * each pass the device is reset and initialized afresh with that
+ * compressor and a disksize just large enough for the pages. The pages go
+ * through the block device with O_DIRECT, so they reach the driver one
+ * page per request exactly as swap writes them.
+ *
+ * For each compressor the compression ratio (ratio), the ratio against
+ * all the memory the device ended up using (mem) and the write and read
+ * throughput are reported. Every page read back is compared with what
+ * was written; the test exits with status 1 on any mismatch.
+ *
+ * Page dumps can be taken from a device with e.g. dd of a swap partition,
+ * or from a process through /proc/<pid>/mem. The ramzswap device must not
+ * be in use, as swap or otherwise: it is reset for every compressor.
+ *
+ * With -g no dumps are needed: a corpus of -g pages is generated instead,
+ * in which -u percent of the pages are copies of a few template pages,
+ * the way heap fill patterns and bitmaps repeat in real swap. Each
+ * compressor is then also run on the same corpus with every copy stamped
+ * with its page number, which keeps the copies' compressibility but stops
+ * them from being deduplicated, and the memory deduplication saved is
+ * reported from the difference.
+ *
+ * Usage: rzs-pages [-d device] [-c compressor,...] [-g pages [-u percent]]
+ *		    [dump...]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/ramzswap rzs-pages.c \
+ *		-o rzs-pages
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#include "ramzswap_ioctl.h"
+
+#define NR_TEMPLATES	16	/* distinct contents of duplicated pages */
+
+static const char *device = "/dev/ramzswap0";
+static char *compressors = "lzo,deflate";
+static unsigned long generate;
+static int dup_pct = 30;
+
+static long page_size;
+static unsigned char *pages;
+static unsigned long npages;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *alloc_pages(unsigned long count)
+{
+	void *p;
+
+	if (posix_memalign(&p, page_size, count * page_size)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	return p;
+}
+
+/* Append the whole pages of 'path' to the page array */
+static void load_dump(const char *path)
+{
+	unsigned char *grown;
+	unsigned long count;
+	struct stat st;
+	ssize_t ret;
+	size_t done;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	count = st.st_size / page_size;
+
+	grown = alloc_pages(npages + count);
+	if (npages)
+		memcpy(grown, pages, npages * page_size);
+	free(pages);
+	pages = grown;
+
+	for (done = 0; done < count * page_size; done += ret) {
+		ret = read(fd, pages + npages * page_size + done,
+			   count * page_size - done);
+		if (ret <= 0) {
+			perror(path);
+			exit(1);
+		}
+	}
+	npages += count;
+	close(fd);
+}
+
+/* Duplicated pages are picked the same way for both corpus variants */
+static int is_copy(unsigned long index)
+{
+	return (index * 37) % 100 < dup_pct;
+}
+
+/*
+ * Fill a page with 'random' bytes followed by a repeated 16-byte pattern.
+ * The random part varies in length with 'seed', so pages compress to many
+ * sizes, and makes pages of different seeds differ.
+ */
+static void fill_page(unsigned char *page, unsigned long seed)
+{
+	static const unsigned char pattern[16] = {
+		0xde, 0xad, 0xbe, 0xef, 0, 0, 0, 0, 0x10, 0, 0, 0, 1, 0, 0, 0
+	};
+	uint32_t x = seed * 2654435761u + 1;
+	size_t len;
+	size_t i;
+
+	len = 64 + (seed * 40503u) % (page_size / 2);
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		page[i] = x;
+	}
+	for (; i < page_size; i++)
+		page[i] = pattern[i % sizeof(pattern)];
+}
+
+/*
+ * Generate the corpus. With 'unique' set, the copies of template pages
+ * have their page number stamped into their last bytes.
+ */
+static void generate_pages(int unique)
+{
+	unsigned char *page;
+	unsigned long i;
+
+	if (!pages)
+		pages = alloc_pages(generate);
+	npages = generate;
+
+	for (i = 0; i < npages; i++) {
+		page = pages + i * page_size;
+		if (!is_copy(i)) {
+			fill_page(page, NR_TEMPLATES + i);
+			continue;
+		}
+		fill_page(page, i % NR_TEMPLATES);
+		if (unique)
+			memcpy(page + page_size - sizeof(i), &i, sizeof(i));
+	}
+}
+
+/*
+ * Reset the device and initialize it again with 'comp', sized for the
+ * pages plus the swap header page in front of them.
+ */
+static void setup_device(const char *comp)
+{
+	char name[RZS_COMP_NAME_LEN];
+	size_t disksize_kb;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (ioctl(fd, RZSIO_RESET) < 0) {
+		perror("RZSIO_RESET");
+		exit(1);
+	}
+
+	memset(name, 0, sizeof(name));
+	strncpy(name, comp, sizeof(name) - 1);
+	if (ioctl(fd, RZSIO_SET_COMPRESSOR, name) < 0) {
+		fprintf(stderr, "RZSIO_SET_COMPRESSOR %s: %m\n", comp);
+		exit(1);
+	}
+
+	disksize_kb = (npages + 1) * page_size >> 10;
+	if (ioctl(fd, RZSIO_SET_DISKSIZE_KB, &disksize_kb) < 0) {
+		perror("RZSIO_SET_DISKSIZE_KB");
+		exit(1);
+	}
+	if (ioctl(fd, RZSIO_INIT) < 0) {
+		perror("RZSIO_INIT");
+		exit(1);
+	}
+
+	/* Reopened below, so the block device picks up the new size */
+	close(fd);
+}
+
+static void run_compressor(const char *comp, const char *variant,
+			   struct ramzswap_ioctl_stats_ext *stats)
+{
+	struct ramzswap_ioctl_stats_ext s;
+	struct ramzswap_ioctl_stats *st = &s.stats;
+	char name[32];
+	unsigned char *buf;
+	unsigned long i, bad = 0;
+	double write_s, read_s;
+	double mb = (double) npages * page_size / (1 << 20);
+	off_t off;
+	int fd;
+
+	setup_device(comp);
+
+	fd = open(device, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	buf = alloc_pages(1);
+
+	/* Page 0 holds the swap header */
+	write_s = now();
+	for (i = 0; i < npages; i++) {
+		off = (i + 1) * page_size;
+		if (pwrite(fd, pages + i * page_size, page_size, off) !=
+		    page_size) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	write_s = now() - write_s;
+
+	if (ioctl(fd, RZSIO_GET_STATS_EXT, &s) < 0) {
+		perror("RZSIO_GET_STATS_EXT");
+		exit(1);
+	}
+
+	read_s = 0;
+	for (i = 0; i < npages; i++) {
+		off = (i + 1) * page_size;
+		read_s -= now();
+		if (pread(fd, buf, page_size, off) != page_size) {
+			perror("pread");
+			exit(1);
+		}
+		read_s += now();
+		if (memcmp(buf, pages + i * page_size, page_size))
+			bad++;
+	}
+
+	snprintf(name, sizeof(name), "%s%s", comp, variant);
+	printf("%-14s %8u %8u %8u %7.2f %7.2f %10llu %10.1f %10.1f\n", name,
+	       st->pages_stored, st->pages_zero, s.pages_dedup,
+	       st->compr_data_size ?
+			(double) st->orig_data_size / st->compr_data_size : 0,
+	       st->mem_used_total ?
+			(double) st->orig_data_size / st->mem_used_total : 0,
+	       (unsigned long long)st->mem_used_total >> 10,
+	       mb / write_s, mb / read_s);
+	if (bad) {
+		fprintf(stderr, "%s: %lu of %lu pages read back wrong\n",
+			name, bad, npages);
+		exit(1);
+	}
+	if (stats)
+		*stats = s;
+
+	free(buf);
+	close(fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-c compressor,...] [-g pages [-u percent]]\n"
+		"\t\t[dump...]\n"
+		"  -d  ramzswap device, not in use (default %s)\n"
+		"  -c  compressors to compare (default %s)\n"
+		"  -g  generate a corpus of this many pages instead of dumps\n"
+		"  -u  percentage of generated pages that are copies\n"
+		"      (default %d)\n",
+		prog, device, compressors, dup_pct);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ramzswap_ioctl_stats_ext dedup, unique;
+	long long saved, total;
+	char *comp, *next;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:c:g:u:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'c':
+			compressors = optarg;
+			break;
+		case 'g':
+			generate = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			dup_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (generate ? optind != argc : optind == argc)
+		usage(argv[0]);
+	if (dup_pct < 0 || dup_pct > 100)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	for (; optind < argc; optind++)
+		load_dump(argv[optind]);
+	if (generate)
+		generate_pages(0);
+	if (!npages) {
+		fprintf(stderr, "no whole pages in the dumps\n");
+		return 1;
+	}
+
+	printf("%lu pages\n", npages);
+	printf("%-14s %8s %8s %8s %7s %7s %10s %10s %10s\n", "compressor",
+	       "stored", "zero", "dedup", "ratio", "mem", "mem kB",
+	       "write MB/s", "read MB/s");
+
+	comp = strdup(compressors);
+	for (; comp; comp = next) {
+		next = strchr(comp, ',');
+		if (next)
+			*next++ = '\0';
+		if (!generate) {
+			run_compressor(comp, "", NULL);
+			continue;
+		}
+
+		generate_pages(0);
+		run_compressor(comp, "", &dedup);
+		generate_pages(1);
+		run_compressor(comp, "/unique", &unique);
+
+		total = unique.stats.mem_used_total;
+		saved = total - (long long)dedup.stats.mem_used_total;
+		printf("  %s: %llu dedup hits, %lld kB saved (%.1f%%)\n",
+		       comp, (unsigned long long)dedup.dedup_hits,
+		       saved / 1024, total ? saved * 100.0 / total : 0);
+	}
+
+	return 0;
+}
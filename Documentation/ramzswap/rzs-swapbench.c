@@ -0,0 +1,256 @@
+/*
+ * rzs-swapbench.c
+ *
+ * Measure swap throughput and fault latency through a ramzswap device.
+ *
+ * The test fills a working set larger than the memory it may use with
+ * pages of mixed compressibility, then has -t threads walk their share of
+ * it -r times, reading and dirtying every page. With the working set well
+ * beyond memory nearly every access faults a page back in from ramzswap
+ * and pushes another one out, so the walk is bound by how fast the device
+ * compresses and decompresses, and by how well that scales across CPUs.
+ *
+ * Reported are the MB/s walked, the MB/s swapped in and out according to
+ * the device, and the distribution of page access times, which with most
+ * accesses faulting is the fault latency.
+ *
+ * The device must already be initialized and in use as the only swap
+ * device (see drivers/staging/ramzswap/ramzswap.txt), and the test must
+ * run with less memory than -m, for example in a memory cgroup or a VM
+ * booted with a small mem=.
+ *
+ * Usage: rzs-swapbench [-d device] [-m megabytes] [-t threads] [-r passes]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/ramzswap rzs-swapbench.c \
+ *		-o rzs-swapbench -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#include "ramzswap_ioctl.h"
+
+#define MAX_US		10000	/* latency histogram range */
+
+static const char *device = "/dev/ramzswap0";
+static unsigned long megabytes = 512;
+static int nthreads = 4;
+static int passes = 3;
+
+static long page_size;
+static unsigned char *mem;
+static unsigned long npages;
+
+struct walker {
+	pthread_t thread;
+	unsigned long first, last;
+	unsigned long hist[MAX_US + 1];	/* per-microsecond access counts */
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void get_stats(int fd, struct ramzswap_ioctl_stats *s)
+{
+	if (ioctl(fd, RZSIO_GET_STATS, s) < 0) {
+		perror("RZSIO_GET_STATS");
+		exit(1);
+	}
+}
+
+/*
+ * Fill a page with 'random' bytes followed by zeroes, the random part
+ * varying in length from page to page, so pages compress to many sizes.
+ */
+static void fill_page(unsigned char *page, unsigned long index)
+{
+	uint32_t x = index * 2654435761u + 1;
+	size_t len;
+	size_t i;
+
+	len = 64 + (index * 40503u) % (page_size * 3 / 4);
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		page[i] = x;
+	}
+	memset(page + len, 0, page_size - len);
+}
+
+static void *walker_fn(void *arg)
+{
+	struct walker *w = arg;
+	unsigned char *page;
+	unsigned long i;
+	double t;
+	long us;
+	int r;
+
+	for (r = 0; r < passes; r++) {
+		for (i = w->first; i < w->last; i++) {
+			page = mem + i * page_size;
+
+			t = now();
+			page[page_size - 1] = page[0] + 1;
+			us = (now() - t) * 1e6;
+
+			w->hist[us < MAX_US ? us : MAX_US]++;
+		}
+	}
+
+	return NULL;
+}
+
+/* Access time below which 'permille' of the 'count' accesses fell */
+static long percentile(unsigned long *hist, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	long us;
+
+	for (us = 0; us < MAX_US; us++) {
+		seen += hist[us];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return us;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-m megabytes] [-t threads] [-r passes]\n"
+		"  -d  ramzswap device in use as swap (default %s)\n"
+		"  -m  working set, more than is available (default %lu)\n"
+		"  -t  threads walking the working set (default %d)\n"
+		"  -r  passes over the working set (default %d)\n",
+		prog, device, megabytes, nthreads, passes);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned long hist[MAX_US + 1];
+	struct ramzswap_ioctl_stats before, after;
+	struct walker *walkers;
+	struct rusage ru_before, ru_after;
+	unsigned long accesses, faults;
+	double start, elapsed, mb_in, mb_out;
+	unsigned long page;
+	size_t size;
+	int dev_fd;
+	int opt;
+	int i, us;
+
+	while ((opt = getopt(argc, argv, "d:m:t:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!megabytes || nthreads < 1 || passes < 1)
+		usage(argv[0]);
+
+	dev_fd = open(device, O_RDONLY);
+	if (dev_fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	size = megabytes << 20;
+	npages = size / page_size;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	walkers = calloc(nthreads, sizeof(*walkers));
+	if (mem == MAP_FAILED || !walkers) {
+		perror("mmap");
+		return 1;
+	}
+
+	for (page = 0; page < npages; page++)
+		fill_page(mem + page * page_size, page);
+
+	get_stats(dev_fd, &before);
+	if (!before.pages_stored) {
+		fprintf(stderr, "nothing was swapped out to %s; run with "
+			"less memory than %lu MB\n", device, megabytes);
+		return 1;
+	}
+	getrusage(RUSAGE_SELF, &ru_before);
+
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		walkers[i].first = npages * i / nthreads;
+		walkers[i].last = npages * (i + 1) / nthreads;
+		if (pthread_create(&walkers[i].thread, NULL, walker_fn,
+				   &walkers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(walkers[i].thread, NULL);
+		for (us = 0; us <= MAX_US; us++)
+			hist[us] += walkers[i].hist[us];
+	}
+	elapsed = now() - start;
+
+	getrusage(RUSAGE_SELF, &ru_after);
+	get_stats(dev_fd, &after);
+
+	accesses = npages * passes;
+	faults = ru_after.ru_majflt - ru_before.ru_majflt;
+	mb_in = (double) (after.num_reads - before.num_reads) *
+		page_size / (1 << 20);
+	mb_out = (double) (after.num_writes - before.num_writes) *
+		 page_size / (1 << 20);
+
+	printf("%lu MB working set, %d threads, %d passes, %.2f s\n",
+	       megabytes, nthreads, passes, elapsed);
+	printf("walked %.1f MB/s, swapped in %.1f MB/s, out %.1f MB/s\n",
+	       (double) accesses * page_size / (1 << 20) / elapsed,
+	       mb_in / elapsed, mb_out / elapsed);
+	printf("%lu of %lu accesses faulted\n", faults, accesses);
+	printf("access us: p50 %ld  p90 %ld  p99 %ld  p99.9 %ld\n",
+	       percentile(hist, accesses, 500), percentile(hist, accesses, 900),
+	       percentile(hist, accesses, 990),
+	       percentile(hist, accesses, 999));
+
+	munmap(mem, size);
+	close(dev_fd);
+	return 0;
+}
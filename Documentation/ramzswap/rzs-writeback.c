@@ -0,0 +1,282 @@
+/*
+ * rzs-writeback.c
+ *
+ * Check that ramzswap writes incompressible and cold pages back to its
+ * backing device, and that they read back intact.
+ *
+ * The device is reset and initialized with the backing device given with
+ * -b and a writeback age of -a seconds. Then -n pages are written through
+ * it with O_DIRECT, alternately incompressible and compressible. The test
+ * checks, each time after waiting for the writeback work to get to them:
+ *
+ *  - that the incompressible pages have been written back, while the
+ *    compressible ones, not yet old enough, are still held in memory;
+ *  - that every page reads back intact, the written back ones from the
+ *    backing device;
+ *  - that once idle for the writeback age the compressible pages have
+ *    been written back too, and still read back intact.
+ *
+ * Memory use and the device's backing statistics are printed along the
+ * way. The test exits with status 1 if any check fails.
+ *
+ * A loop device over a file makes a good backing device, also in QEMU:
+ *
+ *	dd if=/dev/zero of=/tmp/backing bs=1M count=32
+ *	losetup /dev/loop0 /tmp/backing
+ *	rzs-writeback -b /dev/loop0
+ *
+ * The ramzswap device must not be in use, as swap or otherwise: it is
+ * reset first. The backing device is overwritten.
+ *
+ * Usage: rzs-writeback -b backing [-d device] [-n pages] [-a seconds]
+ *
+ * Compile with
+ *	gcc -O2 -I/usr/src/linux/drivers/staging/ramzswap rzs-writeback.c \
+ *		-o rzs-writeback
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+
+#include "ramzswap_ioctl.h"
+
+#define AGE_INTERVAL	5	/* seconds between writeback passes */
+
+static const char *device = "/dev/ramzswap0";
+static const char *backing;
+static unsigned long npages = 4096;
+static unsigned int age = 20;
+
+static int dev_fd;
+static long page_size;
+static unsigned char *buf, *expect;
+
+static int failed;
+
+static void get_stats(struct ramzswap_ioctl_stats_ext *s)
+{
+	if (ioctl(dev_fd, RZSIO_GET_STATS_EXT, s) < 0) {
+		perror("RZSIO_GET_STATS_EXT");
+		exit(1);
+	}
+}
+
+static void show_stats(const char *when, struct ramzswap_ioctl_stats_ext *s)
+{
+	printf("%s:\n", when);
+	printf("  pages_stored       %10u\n", s->stats.pages_stored);
+	printf("  pages_backed       %10u\n", s->pages_backed);
+	printf("  mem_used_total     %10llu kB\n",
+	       (unsigned long long)s->stats.mem_used_total >> 10);
+	printf("  bdev_num_writes    %10llu\n",
+	       (unsigned long long)s->bdev_num_writes);
+	printf("  bdev_failed_writes %10llu\n",
+	       (unsigned long long)s->bdev_failed_writes);
+	printf("  bdev_num_reads     %10llu\n",
+	       (unsigned long long)s->bdev_num_reads);
+}
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		failed = 1;
+}
+
+/*
+ * Odd pages are 'random' throughout and do not compress; even pages are
+ * a short 'random' run followed by zeroes.
+ */
+static void fill_page(unsigned char *page, unsigned long index)
+{
+	uint32_t x = index * 2654435761u + 1;
+	size_t len;
+	size_t i;
+
+	len = index & 1 ? page_size : 256;
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		page[i] = x;
+	}
+	memset(page + len, 0, page_size - len);
+}
+
+/* Reset the device and initialize it with the backing device */
+static void setup_device(void)
+{
+	char name[RZS_BACKING_NAME_LEN];
+	size_t disksize_kb;
+	u32 age_secs = age;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (ioctl(fd, RZSIO_RESET) < 0) {
+		perror("RZSIO_RESET");
+		exit(1);
+	}
+
+	memset(name, 0, sizeof(name));
+	strncpy(name, backing, sizeof(name) - 1);
+	if (ioctl(fd, RZSIO_SET_BACKING_SWAP, name) < 0) {
+		perror("RZSIO_SET_BACKING_SWAP");
+		exit(1);
+	}
+
+	/* Page 0 is the swap header */
+	disksize_kb = (npages + 1) * page_size >> 10;
+	if (ioctl(fd, RZSIO_SET_DISKSIZE_KB, &disksize_kb) < 0) {
+		perror("RZSIO_SET_DISKSIZE_KB");
+		exit(1);
+	}
+	if (ioctl(fd, RZSIO_SET_WRITEBACK_AGE, &age_secs) < 0) {
+		perror("RZSIO_SET_WRITEBACK_AGE");
+		exit(1);
+	}
+	if (ioctl(fd, RZSIO_INIT) < 0) {
+		fprintf(stderr, "RZSIO_INIT: %m (is %s at least %zu kB?)\n",
+			backing, disksize_kb);
+		exit(1);
+	}
+
+	/* Reopened below, so the block device picks up the new size */
+	close(fd);
+}
+
+static void write_pages(void)
+{
+	unsigned long i;
+
+	for (i = 1; i <= npages; i++) {
+		fill_page(buf, i);
+		if (pwrite(dev_fd, buf, page_size, i * page_size) !=
+		    page_size) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+}
+
+/* Read every page back, returning how many differ from what was written */
+static unsigned long verify_pages(void)
+{
+	unsigned long i, bad = 0;
+
+	for (i = 1; i <= npages; i++) {
+		if (pread(dev_fd, buf, page_size, i * page_size) !=
+		    page_size) {
+			perror("pread");
+			exit(1);
+		}
+		fill_page(expect, i);
+		if (memcmp(buf, expect, page_size))
+			bad++;
+	}
+	return bad;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s -b backing [-d device] [-n pages] [-a seconds]\n"
+		"  -b  backing block device, overwritten\n"
+		"  -d  ramzswap device, not in use (default %s)\n"
+		"  -n  pages to write (default %lu)\n"
+		"  -a  writeback age, at least %d (default %u)\n",
+		prog, device, npages, 3 * AGE_INTERVAL, age);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ramzswap_ioctl_stats_ext s, written;
+	unsigned long incompressible;
+	u64 bdev_reads;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:d:n:a:")) != -1) {
+		switch (opt) {
+		case 'b':
+			backing = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			npages = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			age = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/*
+	 * The first check runs two writeback passes in; compressible
+	 * pages must not be old enough by then.
+	 */
+	if (!backing || !npages || age < 3 * AGE_INTERVAL)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (posix_memalign((void **)&buf, page_size, page_size) ||
+	    posix_memalign((void **)&expect, page_size, page_size)) {
+		perror("posix_memalign");
+		return 1;
+	}
+	incompressible = (npages + 1) / 2;
+
+	setup_device();
+	dev_fd = open(device, O_RDWR | O_DIRECT);
+	if (dev_fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	write_pages();
+	get_stats(&written);
+	show_stats("after writing", &written);
+
+	sleep(2 * AGE_INTERVAL + 1);
+	get_stats(&s);
+	show_stats("after two writeback passes", &s);
+	check(s.pages_backed == incompressible,
+	      "incompressible pages written back, compressible ones kept");
+	check(s.stats.mem_used_total < written.stats.mem_used_total,
+	      "memory use went down");
+	check(!s.bdev_failed_writes, "no failed writebacks");
+
+	bdev_reads = s.bdev_num_reads;
+	check(!verify_pages(), "all pages read back intact");
+	get_stats(&s);
+	check(s.bdev_num_reads - bdev_reads == incompressible,
+	      "written back pages read from the backing device");
+
+	/* Reading reset the compressible pages' age; wait it out again */
+	sleep(age + 2 * AGE_INTERVAL + 1);
+	get_stats(&s);
+	show_stats("after the writeback age", &s);
+	check(s.pages_backed == npages, "idle pages written back");
+	check(!s.bdev_failed_writes, "no failed writebacks");
+	check(!verify_pages(), "all pages read back intact");
+
+	close(dev_fd);
+	return failed;
+}
@@ -0,0 +1,244 @@
+/*
+ * wakeup-latency.c
+ *
+ * Measure how long woken tasks wait before they run.
+ *
+ * In pipe mode each of -t pairs has a waker thread that sleeps for a
+ * random 0-1 ms and writes the time to a pipe, and a sleeper thread
+ * blocked reading that pipe, which notes how long after the write it got
+ * to run. In timer mode the sleepers instead sleep until an absolute
+ * time, random 0-1 ms ahead, and note how late they woke.
+ *
+ * -l threads spin alongside to keep the runqueues busy, which is where
+ * the scheduler's choice of whom to run, and its locking, show. The
+ * p50/p90/p99/p99.9 and max latencies over all sleepers are reported.
+ *
+ * For the matching throughput numbers use hackbench, which ships as
+ * "perf bench sched messaging" (tools/perf).
+ *
+ * Usage: wakeup-latency [-m pipe|timer] [-t pairs] [-l threads] [-s seconds]
+ *
+ * Compile with
+ *	gcc -O2 wakeup-latency.c -o wakeup-latency -lpthread -lrt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_US		100000	/* latency histogram range */
+
+static const char *mode = "pipe";
+static int npairs = 4;
+static int nload;
+static int seconds = 10;
+
+static volatile int stop;
+
+struct pair {
+	pthread_t waker, sleeper;
+	int pipe[2];
+	unsigned int seed;
+	unsigned long count;
+	unsigned long hist[MAX_US + 1];	/* per-microsecond latency counts */
+};
+
+static long long ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void record(struct pair *p, const struct timespec *since)
+{
+	struct timespec ts;
+	long long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	us = (ts_ns(&ts) - ts_ns(since)) / 1000;
+	if (us < 0)
+		us = 0;
+	p->hist[us < MAX_US ? us : MAX_US]++;
+	p->count++;
+}
+
+static void sleep_random(unsigned int *seed)
+{
+	struct timespec ts = { 0, rand_r(seed) % 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void *waker_fn(void *arg)
+{
+	struct pair *p = arg;
+	struct timespec sent;
+
+	/* The time of writing goes through the pipe, in one atomic write */
+	while (!stop) {
+		sleep_random(&p->seed);
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		if (write(p->pipe[1], &sent, sizeof(sent)) != sizeof(sent)) {
+			perror("write");
+			exit(1);
+		}
+	}
+	close(p->pipe[1]);
+	return NULL;
+}
+
+static void *pipe_sleeper_fn(void *arg)
+{
+	struct pair *p = arg;
+	struct timespec sent;
+
+	while (read(p->pipe[0], &sent, sizeof(sent)) == sizeof(sent))
+		record(p, &sent);
+	return NULL;
+}
+
+static void *timer_sleeper_fn(void *arg)
+{
+	struct pair *p = arg;
+	struct timespec when;
+	long long ns;
+
+	while (!stop) {
+		clock_gettime(CLOCK_MONOTONIC, &when);
+		ns = ts_ns(&when) + rand_r(&p->seed) % 1000000;
+		when.tv_sec = ns / 1000000000;
+		when.tv_nsec = ns % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+		record(p, &when);
+	}
+	return NULL;
+}
+
+static void *load_fn(void *arg)
+{
+	volatile unsigned long spins = 0;
+
+	while (!stop)
+		spins++;
+	return NULL;
+}
+
+/* Latency below which 'permille' of the 'count' samples in 'hist' fell */
+static long percentile(unsigned long *hist, unsigned long count, int permille)
+{
+	unsigned long seen = 0;
+	long us;
+
+	for (us = 0; us < MAX_US; us++) {
+		seen += hist[us];
+		if (seen * 1000 >= count * permille)
+			break;
+	}
+	return us;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m pipe|timer] [-t pairs] [-l threads] [-s seconds]\n"
+		"  -m  wake sleepers through a pipe or a timer (default %s)\n"
+		"  -t  sleeper threads, each with its waker (default %d)\n"
+		"  -l  spinning threads to load the CPUs (default %d)\n"
+		"  -s  seconds to run (default %d)\n",
+		prog, mode, npairs, nload, seconds);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned long hist[MAX_US + 1];
+	unsigned long count = 0;
+	struct pair *pairs;
+	pthread_t *load;
+	int timer;
+	long max;
+	int opt;
+	int i, us;
+
+	while ((opt = getopt(argc, argv, "m:t:l:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mode = optarg;
+			if (strcmp(mode, "pipe") && strcmp(mode, "timer"))
+				usage(argv[0]);
+			break;
+		case 't':
+			npairs = atoi(optarg);
+			break;
+		case 'l':
+			nload = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (npairs < 1 || nload < 0 || seconds < 1)
+		usage(argv[0]);
+	timer = !strcmp(mode, "timer");
+
+	pairs = calloc(npairs, sizeof(*pairs));
+	load = calloc(nload + 1, sizeof(*load));
+	if (!pairs || !load) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < nload; i++) {
+		if (pthread_create(&load[i], NULL, load_fn, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < npairs; i++) {
+		pairs[i].seed = i + 1;
+		if (!timer && pipe(pairs[i].pipe) < 0) {
+			perror("pipe");
+			return 1;
+		}
+		if (pthread_create(&pairs[i].sleeper, NULL,
+				   timer ? timer_sleeper_fn : pipe_sleeper_fn,
+				   &pairs[i]) ||
+		    (!timer && pthread_create(&pairs[i].waker, NULL, waker_fn,
+					      &pairs[i]))) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < npairs; i++) {
+		if (!timer)
+			pthread_join(pairs[i].waker, NULL);
+		pthread_join(pairs[i].sleeper, NULL);
+		count += pairs[i].count;
+		for (us = 0; us <= MAX_US; us++)
+			hist[us] += pairs[i].hist[us];
+	}
+	for (i = 0; i < nload; i++)
+		pthread_join(load[i], NULL);
+
+	for (max = MAX_US; max > 0 && !hist[max]; max--)
+		;
+	printf("%s wakeups, %d sleepers, %d load threads, %d s\n",
+	       mode, npairs, nload, seconds);
+	printf("%lu wakeups, us p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  "
+	       "max %ld%s\n", count, percentile(hist, count, 500),
+	       percentile(hist, count, 900), percentile(hist, count, 990),
+	       percentile(hist, count, 999), max, max == MAX_US ? "+" : "");
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * zcache-coldread.c
+ *
+ * Measure how much zcache speeds up re-reading a file set that does not
+ * fit in memory.
+ *
+ * The test writes -m MB of files into -d, each 4 kB block made of a
+ * 'random' run and a repeated pattern so it compresses about as well as
+ * typical application data. It then reads the whole set -r times. Before
+ * each pass the page cache is dropped, which hands the clean pages to
+ * cleancache, and the pass reads them back through it. With the set larger
+ * than memory, pages also keep being evicted during the pass itself.
+ *
+ * The passes are run twice: first with zcache held to nothing (max_pages
+ * set to 0), so every page comes from the disk, then with zcache at its usual
+ * size. For each pass the read throughput, the data read from the disk
+ * (pgpgin in /proc/vmstat) and the cleancache hits are reported, and
+ * zcache's size is printed after each pass.
+ *
+ * Needs root and CONFIG_ZCACHE. The files are removed at the end.
+ *
+ * Usage: zcache-coldread [-d dir] [-m megabytes] [-f files] [-r passes]
+ *
+ * Compile with
+ *	gcc -O2 zcache-coldread.c -o zcache-coldread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#define CLEANCACHE	"/sys/kernel/mm/cleancache/"
+#define ZCACHE		"/sys/kernel/mm/zcache/"
+#define BLOCK		4096
+#define CHUNK		(64 * 1024)	/* read and write size */
+
+static const char *dir = ".";
+static unsigned long megabytes = 1024;
+static int nfiles = 64;
+static int passes = 3;
+
+static char buf[CHUNK];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long read_ulong(const char *path)
+{
+	unsigned long val;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f || fscanf(f, "%lu", &val) != 1) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	return val;
+}
+
+static void write_file(const char *path, const char *val)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) != (ssize_t) strlen(val)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+/* pgpgin from /proc/vmstat: kB read from block devices */
+static unsigned long pgpgin(void)
+{
+	unsigned long val;
+	char name[64];
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f) {
+		perror("/proc/vmstat");
+		exit(1);
+	}
+	while (fscanf(f, "%63s %lu", name, &val) == 2) {
+		if (!strcmp(name, "pgpgin")) {
+			fclose(f);
+			return val;
+		}
+	}
+	fprintf(stderr, "no pgpgin in /proc/vmstat\n");
+	exit(1);
+}
+
+static void drop_caches(void)
+{
+	sync();
+	write_file("/proc/sys/vm/drop_caches", "3");
+}
+
+/* A 'random' run of varying length, then a repeated pattern */
+static void fill_block(char *block, unsigned long index)
+{
+	static const char pattern[] = "name=value; count=0000; flags=---\n";
+	uint32_t x = index * 2654435761u + 1;
+	size_t len;
+	size_t i;
+
+	len = 256 + (index * 40503u) % (BLOCK / 2);
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		block[i] = x;
+	}
+	for (; i < BLOCK; i++)
+		block[i] = pattern[i % (sizeof(pattern) - 1)];
+}
+
+static void file_name(char *name, size_t size, int i)
+{
+	snprintf(name, size, "%s/zcache-coldread.%d", dir, i);
+}
+
+static void create_files(void)
+{
+	unsigned long file_size = (megabytes << 20) / nfiles;
+	unsigned long block = 0;
+	unsigned long done;
+	char name[4096];
+	size_t off;
+	int fd;
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		file_name(name, sizeof(name), i);
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(name);
+			exit(1);
+		}
+		for (done = 0; done < file_size; done += CHUNK) {
+			for (off = 0; off < CHUNK; off += BLOCK)
+				fill_block(buf + off, block++);
+			if (write(fd, buf, CHUNK) != CHUNK) {
+				perror(name);
+				exit(1);
+			}
+		}
+		close(fd);
+	}
+}
+
+static void remove_files(void)
+{
+	char name[4096];
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		file_name(name, sizeof(name), i);
+		unlink(name);
+	}
+}
+
+/* Read every file once, returning the bytes read */
+static unsigned long long read_files(void)
+{
+	unsigned long long total = 0;
+	char name[4096];
+	ssize_t ret;
+	int fd;
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		file_name(name, sizeof(name), i);
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			perror(name);
+			exit(1);
+		}
+		while ((ret = read(fd, buf, CHUNK)) > 0)
+			total += ret;
+		if (ret < 0) {
+			perror(name);
+			exit(1);
+		}
+		close(fd);
+	}
+	return total;
+}
+
+static void run_passes(const char *what)
+{
+	unsigned long hits, misses, disk_kb;
+	unsigned long long bytes;
+	double t;
+	int p;
+
+	printf("%s:\n", what);
+	for (p = 0; p < passes; p++) {
+		drop_caches();
+
+		hits = read_ulong(CLEANCACHE "succ_gets");
+		misses = read_ulong(CLEANCACHE "failed_gets");
+		disk_kb = pgpgin();
+
+		t = now();
+		bytes = read_files();
+		t = now() - t;
+
+		hits = read_ulong(CLEANCACHE "succ_gets") - hits;
+		misses = read_ulong(CLEANCACHE "failed_gets") - misses;
+		disk_kb = pgpgin() - disk_kb;
+
+		printf("  pass %d: %.1f MB/s, %lu MB from disk, "
+		       "cleancache %lu hits %lu misses\n", p + 1,
+		       bytes / t / (1 << 20), disk_kb >> 10, hits, misses);
+		printf("          zcache %lu pages in %lu pool pages, "
+		       "%lu evicted, %lu shrunk\n",
+		       read_ulong(ZCACHE "pages_stored"),
+		       read_ulong(ZCACHE "mem_used_pages"),
+		       read_ulong(ZCACHE "evicted"),
+		       read_ulong(ZCACHE "shrunk"));
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d dir] [-m megabytes] [-f files] [-r passes]\n"
+		"  -d  directory to create the files in (default %s)\n"
+		"  -m  size of the file set, more than memory (default %lu)\n"
+		"  -f  number of files (default %d)\n"
+		"  -r  read passes with and without zcache (default %d)\n",
+		prog, dir, megabytes, nfiles, passes);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long max_pages;
+	char val[32];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:f:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			nfiles = atoi(optarg);
+			break;
+		case 'r':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!megabytes || nfiles < 1 || passes < 1 ||
+	    (megabytes << 20) / nfiles < CHUNK)
+		usage(argv[0]);
+
+	max_pages = read_ulong(ZCACHE "max_pages");
+
+	printf("creating %lu MB in %d files\n", megabytes, nfiles);
+	create_files();
+
+	write_file(ZCACHE "max_pages", "0");
+	run_passes("without zcache");
+
+	snprintf(val, sizeof(val), "%lu", max_pages);
+	write_file(ZCACHE "max_pages", val);
+	run_passes("with zcache");
+
+	remove_files();
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ *  drivers/cpufreq/cpufreq_fake.c
+ *
+ *  A cpufreq driver that changes no clocks, for testing governors and
+ *  cpufreq tools in virtual machines, which have no frequency control of
+ *  their own. Every cpu gets its own policy over a table of msm7x30-like
+ *  frequencies, and the requested frequency simply becomes the current
+ *  one. Transitions send the usual notifications, so cpufreq_stats and
+ *  the profiler see them, and emit the power_frequency trace event like
+ *  acpi-cpufreq does.
+ *
+ *  A real switch takes time while the PLL settles; the transition_us
+ *  module parameter makes every transition take that long:
+ *
+ *	echo 200 > /sys/module/cpufreq_fake/parameters/transition_us
+ *
+ *  Only use it where no other cpufreq driver registers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/percpu.h>
+#include <linux/delay.h>
+#include <trace/events/power.h>
+
+static struct cpufreq_frequency_table fake_freq_table[] = {
+	{ 0, 122880 },
+	{ 1, 245760 },
+	{ 2, 368640 },
+	{ 3, 518400 },
+	{ 4, 768000 },
+	{ 5, 1024000 },
+	{ 6, 1200000 },
+	{ 7, CPUFREQ_TABLE_END },
+};
+
+static DEFINE_PER_CPU(unsigned int, fake_cur_freq);
+
+static unsigned int transition_us;
+module_param(transition_us, uint, 0644);
+MODULE_PARM_DESC(transition_us, "Time each frequency transition takes");
+
+static int fake_cpufreq_verify(struct cpufreq_policy *policy)
+{
+	return cpufreq_frequency_table_verify(policy, fake_freq_table);
+}
+
+static int fake_cpufreq_target(struct cpufreq_policy *policy,
+			       unsigned int target_freq,
+			       unsigned int relation)
+{
+	struct cpufreq_freqs freqs;
+	unsigned int index;
+
+	if (cpufreq_frequency_table_target(policy, fake_freq_table,
+					   target_freq, relation, &index))
+		return -EINVAL;
+
+	freqs.cpu = policy->cpu;
+	freqs.old = per_cpu(fake_cur_freq, policy->cpu);
+	freqs.new = fake_freq_table[index].frequency;
+	if (freqs.old == freqs.new)
+		return 0;
+
+	cpufreq_notify_transition(&freqs, CPUFREQ_PRECHANGE);
+
+	if (transition_us >= 1000)
+		msleep(DIV_ROUND_UP(transition_us, 1000));
+	else if (transition_us)
+		udelay(transition_us);
+	per_cpu(fake_cur_freq, policy->cpu) = freqs.new;
+
+	cpufreq_notify_transition(&freqs, CPUFREQ_POSTCHANGE);
+	trace_power_frequency(POWER_PSTATE, freqs.new);
+	return 0;
+}
+
+static unsigned int fake_cpufreq_get(unsigned int cpu)
+{
+	return per_cpu(fake_cur_freq, cpu);
+}
+
+static int fake_cpufreq_init(struct cpufreq_policy *policy)
+{
+	int ret;
+
+	ret = cpufreq_frequency_table_cpuinfo(policy, fake_freq_table);
+	if (ret)
+		return ret;
+
+	if (!per_cpu(fake_cur_freq, policy->cpu))
+		per_cpu(fake_cur_freq, policy->cpu) = policy->cpuinfo.max_freq;
+	policy->cur = per_cpu(fake_cur_freq, policy->cpu);
+
+	/* ondemand refuses drivers that claim no latency at all */
+	policy->cpuinfo.transition_latency =
+		max(transition_us, 1U) * NSEC_PER_USEC;
+
+	cpufreq_frequency_table_get_attr(fake_freq_table, policy->cpu);
+	return 0;
+}
+
+static int fake_cpufreq_exit(struct cpufreq_policy *policy)
+{
+	cpufreq_frequency_table_put_attr(policy->cpu);
+	return 0;
+}
+
+static struct freq_attr *fake_cpufreq_attr[] = {
+	&cpufreq_freq_attr_scaling_available_freqs,
+	NULL,
+};
+
+static struct cpufreq_driver fake_cpufreq_driver = {
+	.owner		= THIS_MODULE,
+	.name		= "fake",
+	.init		= fake_cpufreq_init,
+	.exit		= fake_cpufreq_exit,
+	.verify		= fake_cpufreq_verify,
+	.target		= fake_cpufreq_target,
+	.get		= fake_cpufreq_get,
+	.attr		= fake_cpufreq_attr,
+};
+
+static int __init fake_cpufreq_module_init(void)
+{
+	return cpufreq_register_driver(&fake_cpufreq_driver);
+}
+
+static void __exit fake_cpufreq_module_exit(void)
+{
+	cpufreq_unregister_driver(&fake_cpufreq_driver);
+}
+
+MODULE_DESCRIPTION("Fake cpufreq driver for testing governors");
+MODULE_LICENSE("GPL");
+
+module_init(fake_cpufreq_module_init);
+module_exit(fake_cpufreq_module_exit);
@@ -0,0 +1,438 @@
+/*
+ *  drivers/cpufreq/cpufreq_profile.c
+ *
+ *  Profiles cpufreq behaviour beyond what cpufreq_stats reports: how long
+ *  each frequency transition takes in the driver, how often the governor
+ *  reverses direction within a short window, and how much cpu time each
+ *  task spent at each frequency.
+ *
+ *  Profiling is off by default and costs nothing until it is enabled
+ *  through debugfs:
+ *
+ *	echo 1 > /sys/kernel/debug/cpufreq_profile/enable
+ *	cat /sys/kernel/debug/cpufreq_profile/{latency,oscillation,tasks}
+ *
+ *  Documentation/cpu-freq/cpufreq-profile.c does this around a command and
+ *  summarizes the results.
+ *
+ *  Enabling clears all previous results. Disabling keeps them for reading.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <trace/events/sched.h>
+
+#define PROF_MAX_FREQS		32
+#define PROF_TASK_BITS		8
+#define PROF_TASKS		(1 << PROF_TASK_BITS)
+#define PROF_LAT_BUCKETS	16	/* log2 of the latency in us */
+
+struct prof_task {
+	int used;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	u64 time[PROF_MAX_FREQS];	/* ns at each frequency */
+};
+
+struct prof_cpu {
+	unsigned int cur_freq;		/* kHz */
+	struct prof_task *task;		/* task running on this cpu */
+	u64 last;			/* start of the unaccounted interval */
+
+	/* Transition latency */
+	u64 pre_time;			/* when PRECHANGE was seen, or 0 */
+	unsigned int lat_count;
+	u64 lat_total;
+	u64 lat_min;
+	u64 lat_max;
+	unsigned int lat_hist[PROF_LAT_BUCKETS];
+
+	/* Oscillation */
+	unsigned int transitions;
+	unsigned int oscillations;
+	int last_dir;
+	u64 last_change;
+};
+
+static DEFINE_PER_CPU(struct prof_cpu, prof_cpus);
+static DEFINE_SPINLOCK(prof_lock);
+static DEFINE_MUTEX(prof_mutex);
+
+static int prof_enabled;
+static u32 osc_window_ms = 100;
+
+static unsigned int prof_freqs[PROF_MAX_FREQS];
+static int nr_prof_freqs;
+
+static struct prof_task *prof_tasks;
+static struct prof_task prof_other = {
+	.used = 1,
+	.pid = -1,
+	.comm = "<other>",
+};
+static unsigned int prof_dropped;
+
+static inline u64 prof_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Index of a frequency in prof_freqs, added on first sight. */
+static int prof_freq_index(unsigned int freq)
+{
+	int i;
+
+	for (i = 0; i < nr_prof_freqs; i++)
+		if (prof_freqs[i] == freq)
+			return i;
+
+	if (nr_prof_freqs == PROF_MAX_FREQS)
+		return PROF_MAX_FREQS - 1;
+
+	prof_freqs[nr_prof_freqs] = freq;
+	return nr_prof_freqs++;
+}
+
+static struct prof_task *prof_task_slot(struct task_struct *p)
+{
+	unsigned long h = hash_long(p->pid, PROF_TASK_BITS);
+	struct prof_task *t;
+	int i;
+
+	for (i = 0; i < PROF_TASKS; i++) {
+		t = &prof_tasks[(h + i) & (PROF_TASKS - 1)];
+		if (!t->used) {
+			t->used = 1;
+			t->pid = p->pid;
+			memcpy(t->comm, p->comm, TASK_COMM_LEN);
+			return t;
+		}
+		if (t->pid == p->pid)
+			return t;
+	}
+
+	prof_dropped++;
+	return &prof_other;
+}
+
+/* Charge the time since the last event to the task running on the cpu. */
+static void prof_account(struct prof_cpu *pc, u64 now)
+{
+	if (pc->task && pc->cur_freq && now > pc->last)
+		pc->task->time[prof_freq_index(pc->cur_freq)] += now - pc->last;
+	pc->last = now;
+}
+
+static void prof_sched_switch(void *ignore, struct task_struct *prev,
+			      struct task_struct *next)
+{
+	struct prof_cpu *pc = &per_cpu(prof_cpus, smp_processor_id());
+	unsigned long flags;
+
+	spin_lock_irqsave(&prof_lock, flags);
+	prof_account(pc, prof_now());
+	pc->task = prof_task_slot(next);
+	spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+static void prof_record_latency(struct prof_cpu *pc, u64 lat)
+{
+	int bucket = fls(div_u64(lat, NSEC_PER_USEC));
+
+	if (bucket >= PROF_LAT_BUCKETS)
+		bucket = PROF_LAT_BUCKETS - 1;
+	pc->lat_hist[bucket]++;
+
+	if (!pc->lat_count || lat < pc->lat_min)
+		pc->lat_min = lat;
+	if (lat > pc->lat_max)
+		pc->lat_max = lat;
+	pc->lat_total += lat;
+	pc->lat_count++;
+}
+
+static int prof_transition(struct notifier_block *nb, unsigned long val,
+			   void *data)
+{
+	struct cpufreq_freqs *freq = data;
+	struct prof_cpu *pc = &per_cpu(prof_cpus, freq->cpu);
+	u64 now = prof_now();
+	unsigned long flags;
+	int dir;
+
+	spin_lock_irqsave(&prof_lock, flags);
+
+	if (val == CPUFREQ_PRECHANGE) {
+		pc->pre_time = now;
+	} else if (val == CPUFREQ_POSTCHANGE) {
+		if (pc->pre_time) {
+			prof_record_latency(pc, now - pc->pre_time);
+			pc->pre_time = 0;
+		}
+
+		prof_account(pc, now);
+
+		dir = (freq->new > freq->old) - (freq->new < freq->old);
+		if (dir) {
+			pc->transitions++;
+			if (pc->last_dir && dir != pc->last_dir &&
+			    now - pc->last_change <
+			    (u64)osc_window_ms * NSEC_PER_MSEC)
+				pc->oscillations++;
+			pc->last_dir = dir;
+			pc->last_change = now;
+		}
+		pc->cur_freq = freq->new;
+	}
+
+	spin_unlock_irqrestore(&prof_lock, flags);
+	return 0;
+}
+
+static struct notifier_block prof_transition_nb = {
+	.notifier_call = prof_transition,
+};
+
+static int prof_start(void)
+{
+	struct prof_task *tasks;
+	unsigned long flags;
+	u64 now;
+	int cpu;
+	int ret;
+
+	if (!prof_tasks) {
+		tasks = vmalloc(PROF_TASKS * sizeof(*tasks));
+		if (!tasks)
+			return -ENOMEM;
+		prof_tasks = tasks;
+	}
+
+	spin_lock_irqsave(&prof_lock, flags);
+	memset(prof_tasks, 0, PROF_TASKS * sizeof(*prof_tasks));
+	memset(prof_other.time, 0, sizeof(prof_other.time));
+	prof_dropped = 0;
+	nr_prof_freqs = 0;
+	now = prof_now();
+	for_each_possible_cpu(cpu) {
+		struct prof_cpu *pc = &per_cpu(prof_cpus, cpu);
+
+		memset(pc, 0, sizeof(*pc));
+		pc->last = now;
+	}
+	spin_unlock_irqrestore(&prof_lock, flags);
+
+	for_each_online_cpu(cpu)
+		per_cpu(prof_cpus, cpu).cur_freq = cpufreq_quick_get(cpu);
+
+	ret = cpufreq_register_notifier(&prof_transition_nb,
+					CPUFREQ_TRANSITION_NOTIFIER);
+	if (ret)
+		return ret;
+
+	ret = register_trace_sched_switch(prof_sched_switch, NULL);
+	if (ret) {
+		cpufreq_unregister_notifier(&prof_transition_nb,
+					    CPUFREQ_TRANSITION_NOTIFIER);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void prof_stop(void)
+{
+	unregister_trace_sched_switch(prof_sched_switch, NULL);
+	tracepoint_synchronize_unregister();
+	cpufreq_unregister_notifier(&prof_transition_nb,
+				    CPUFREQ_TRANSITION_NOTIFIER);
+}
+
+static int prof_enable_get(void *data, u64 *val)
+{
+	*val = prof_enabled;
+	return 0;
+}
+
+static int prof_enable_set(void *data, u64 val)
+{
+	int ret = 0;
+
+	mutex_lock(&prof_mutex);
+	if (val && !prof_enabled) {
+		ret = prof_start();
+		if (!ret)
+			prof_enabled = 1;
+	} else if (!val && prof_enabled) {
+		prof_stop();
+		prof_enabled = 0;
+	}
+	mutex_unlock(&prof_mutex);
+
+	return ret;
+}
+DEFINE_SIMPLE_ATTRIBUTE(prof_enable_fops, prof_enable_get, prof_enable_set,
+			"%llu\n");
+
+static int prof_latency_show(struct seq_file *m, void *v)
+{
+	unsigned long flags;
+	int cpu;
+	int i;
+
+	spin_lock_irqsave(&prof_lock, flags);
+	for_each_possible_cpu(cpu) {
+		struct prof_cpu *pc = &per_cpu(prof_cpus, cpu);
+
+		if (!pc->lat_count)
+			continue;
+
+		seq_printf(m, "cpu%d: count %u min %llu avg %llu max %llu (ns)\n",
+			   cpu, pc->lat_count, pc->lat_min,
+			   div_u64(pc->lat_total, pc->lat_count), pc->lat_max);
+		for (i = 0; i < PROF_LAT_BUCKETS; i++) {
+			if (!pc->lat_hist[i])
+				continue;
+			if (i == PROF_LAT_BUCKETS - 1)
+				seq_printf(m, "  >= %6u us: %u\n",
+					   i ? 1 << (i - 1) : 0, pc->lat_hist[i]);
+			else
+				seq_printf(m, "  < %7u us: %u\n",
+					   1 << i, pc->lat_hist[i]);
+		}
+	}
+	spin_unlock_irqrestore(&prof_lock, flags);
+
+	return 0;
+}
+
+static int prof_oscillation_show(struct seq_file *m, void *v)
+{
+	unsigned long flags;
+	int cpu;
+
+	seq_printf(m, "window %u ms\n", osc_window_ms);
+
+	spin_lock_irqsave(&prof_lock, flags);
+	for_each_possible_cpu(cpu) {
+		struct prof_cpu *pc = &per_cpu(prof_cpus, cpu);
+
+		if (!pc->transitions)
+			continue;
+		seq_printf(m, "cpu%d: transitions %u oscillations %u\n",
+			   cpu, pc->transitions, pc->oscillations);
+	}
+	spin_unlock_irqrestore(&prof_lock, flags);
+
+	return 0;
+}
+
+static void prof_show_task(struct seq_file *m, struct prof_task *t)
+{
+	int i;
+
+	seq_printf(m, "%6d %-16s", t->pid, t->comm);
+	for (i = 0; i < nr_prof_freqs; i++)
+		seq_printf(m, " %10llu",
+			   div_u64(t->time[i], NSEC_PER_MSEC));
+	seq_putc(m, '\n');
+}
+
+/*
+ * One line per task: pid, comm, then the milliseconds it ran at each
+ * frequency in the order of the header line.
+ */
+static int prof_tasks_show(struct seq_file *m, void *v)
+{
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&prof_mutex);
+	if (!prof_tasks)
+		goto out;
+
+	spin_lock_irqsave(&prof_lock, flags);
+	seq_printf(m, "%6s %-16s", "pid", "comm");
+	for (i = 0; i < nr_prof_freqs; i++)
+		seq_printf(m, " %10u", prof_freqs[i]);
+	seq_putc(m, '\n');
+
+	for (i = 0; i < PROF_TASKS; i++)
+		if (prof_tasks[i].used)
+			prof_show_task(m, &prof_tasks[i]);
+	if (prof_dropped)
+		prof_show_task(m, &prof_other);
+	spin_unlock_irqrestore(&prof_lock, flags);
+out:
+	mutex_unlock(&prof_mutex);
+	return 0;
+}
+
+static int prof_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, prof_latency_show, NULL);
+}
+
+static int prof_oscillation_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, prof_oscillation_show, NULL);
+}
+
+static int prof_tasks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, prof_tasks_show, NULL);
+}
+
+static const struct file_operations prof_latency_fops = {
+	.open		= prof_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations prof_oscillation_fops = {
+	.open		= prof_oscillation_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations prof_tasks_fops = {
+	.open		= prof_tasks_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init cpufreq_profile_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("cpufreq_profile", NULL);
+	if (!dir)
+		return -ENOMEM;
+
+	debugfs_create_file("enable", 0644, dir, NULL, &prof_enable_fops);
+	debugfs_create_u32("osc_window_ms", 0644, dir, &osc_window_ms);
+	debugfs_create_file("latency", 0444, dir, NULL, &prof_latency_fops);
+	debugfs_create_file("oscillation", 0444, dir, NULL,
+			    &prof_oscillation_fops);
+	debugfs_create_file("tasks", 0444, dir, NULL, &prof_tasks_fops);
+
+	return 0;
+}
+late_initcall(cpufreq_profile_init);
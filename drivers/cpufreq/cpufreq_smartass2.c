@@ -27,9 +27,10 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/tick.h>
-#include <linux/timer.h>
 #include <linux/workqueue.h>
 #include <linux/moduleparam.h>
 #include <asm/cputime.h>
@@ -106,21 +107,38 @@ static unsigned int sleep_wakeup_freq;
 
 /*
  * Sampling rate, I highly recommend to leave it at 2.
+ * The load is sampled at the first scheduler tick or idle exit this many
+ * jiffies after the sample was started.
  */
 #define DEFAULT_SAMPLE_RATE_JIFFIES 2
 static unsigned int sample_rate_jiffies;
 
+/*
+ * The frequency to jump to on input events (touchscreen, keys), so the first
+ * frames after a touch do not wait for the load sampling to ramp up.
+ * Zero disables input boosting.
+ */
+#define DEFAULT_BOOST_FREQ 768000
+static unsigned int boost_freq;
+
+/*
+ * How long after the last input event we stay at or above boost_freq.
+ */
+#define DEFAULT_BOOST_DURATION_US 500000
+static unsigned long boost_duration_us;
+
 
 /*************** End of tunables ***************/
 
 
-static void (*pm_idle_old)(void);
 static atomic_t active_count = ATOMIC_INIT(0);
 
 struct smartass_info_s {
 	struct cpufreq_policy *cur_policy;
 	struct cpufreq_frequency_table *freq_table;
-	struct timer_list timer;
+	struct sched_freq_hook hook;
+	int sampling;		// a load sample is in progress
+	unsigned long sample_end;	// jiffies when the sample is due
 	u64 time_in_idle;
 	u64 idle_exit_time;
 	u64 freq_change_time;
@@ -137,6 +155,10 @@ static DEFINE_PER_CPU(struct smartass_info_s, smartass_info);
 static struct workqueue_struct *up_wq;
 static struct workqueue_struct *down_wq;
 static struct work_struct freq_scale_work;
+static struct work_struct boost_work;
+
+/* Input boosting is active until this time (in jiffies) */
+static unsigned long boost_end;
 
 static cpumask_t work_cpumask;
 static spinlock_t cpumask_lock;
@@ -200,9 +222,17 @@ inline static unsigned int validate_freq(struct cpufreq_policy *policy, int freq
 	return freq;
 }
 
-inline static void reset_timer(unsigned long cpu, struct smartass_info_s *this_smartass) {
+// Frequency we may not go below because of a recent input event, 0 if none:
+inline static unsigned int boost_target(struct cpufreq_policy *policy) {
+	if (!boost_freq || suspended || !time_before(jiffies, boost_end))
+		return 0;
+	return validate_freq(policy,boost_freq);
+}
+
+inline static void reset_sample(unsigned long cpu, struct smartass_info_s *this_smartass) {
 	this_smartass->time_in_idle = get_cpu_idle_time_us(cpu, &this_smartass->idle_exit_time);
-	mod_timer(&this_smartass->timer, jiffies + sample_rate_jiffies);
+	this_smartass->sample_end = jiffies + sample_rate_jiffies;
+	this_smartass->sampling = 1;
 }
 
 inline static void work_cpumask_set(unsigned long cpu) {
@@ -270,7 +300,7 @@ inline static int target_freq(struct cpufreq_policy *policy, struct smartass_inf
 	return target;
 }
 
-static void cpufreq_smartass_timer(unsigned long cpu)
+static void cpufreq_smartass_sample(unsigned long cpu)
 {
 	u64 delta_idle;
 	u64 delta_time;
@@ -291,10 +321,10 @@ static void cpufreq_smartass_timer(unsigned long cpu)
 	delta_idle = cputime64_sub(now_idle, this_smartass->time_in_idle);
 	delta_time = cputime64_sub(update_time, this_smartass->idle_exit_time);
 
-	// If timer ran less than 1ms after short-term sample started, retry.
+	// If we sampled less than 1ms after short-term sample started, retry.
 	if (delta_time < 1000) {
-		if (!timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
+		if (!this_smartass->sampling)
+			reset_sample(cpu,this_smartass);
 		return;
 	}
 
@@ -330,6 +360,7 @@ static void cpufreq_smartass_timer(unsigned long cpu)
 	// Similarly for scale down: load should be below min and if we are at or below ideal
 	// frequency we require that we have been at this frequency for at least down_rate_us:
 	else if (cpu_load < min_cpu_load && old_freq > policy->min &&
+		 old_freq > boost_target(policy) &&
 		 (old_freq > this_smartass->ideal_speed ||
 		  cputime64_sub(update_time, this_smartass->freq_change_time) >= down_rate_us))
 	{
@@ -343,31 +374,48 @@ static void cpufreq_smartass_timer(unsigned long cpu)
 	else this_smartass->ramp_dir = 0;
 
 	// To avoid unnecessary load when the CPU is already at high load, we don't
-	// reset ourselves if we are at max speed. If and when there are idle cycles,
-	// the idle loop will activate the timer.
-	// Additionally, if we queued some work, the work task will reset the timer
+	// start a new sample if we are at max speed. If and when there are idle cycles,
+	// leaving idle will start one.
+	// Additionally, if we queued some work, the work task will start the sample
 	// after it has done its adjustments.
 	if (!queued_work && old_freq < policy->max)
-		reset_timer(cpu,this_smartass);
+		reset_sample(cpu,this_smartass);
 }
 
-static void cpufreq_idle(void)
+/*
+ * Scheduler hook: runs on the cpu itself at busy ticks and idle transitions,
+ * in place of a sampling timer and an idle loop hook.
+ */
+static void cpufreq_smartass_sched_event(struct sched_freq_hook *hook, int cpu,
+					 unsigned int event)
 {
-	struct smartass_info_s *this_smartass = &per_cpu(smartass_info, smp_processor_id());
+	struct smartass_info_s *this_smartass =
+		container_of(hook, struct smartass_info_s, hook);
 	struct cpufreq_policy *policy = this_smartass->cur_policy;
 
-	if (!this_smartass->enable) {
-		pm_idle_old();
+	if (!this_smartass->enable)
 		return;
-	}
-
-	if (policy->cur == policy->min && timer_pending(&this_smartass->timer))
-		del_timer(&this_smartass->timer);
 
-	pm_idle_old();
-
-	if (!timer_pending(&this_smartass->timer))
-		reset_timer(smp_processor_id(), this_smartass);
+	switch (event) {
+	case SCHED_FREQ_IDLE_ENTER:
+		// nothing to ramp down from, so stop sampling while idle:
+		if (policy->cur == policy->min)
+			this_smartass->sampling = 0;
+		break;
+	case SCHED_FREQ_IDLE_EXIT:
+		if (!this_smartass->sampling) {
+			reset_sample(cpu,this_smartass);
+			break;
+		}
+		/* fall through: a sample may have become due while idle */
+	case SCHED_FREQ_TICK:
+		if (this_smartass->sampling &&
+		    time_after_eq(jiffies, this_smartass->sample_end)) {
+			this_smartass->sampling = 0;
+			cpufreq_smartass_sample(cpu);
+		}
+		break;
+	}
 }
 
 /* We use the same work function to sale up and down */
@@ -428,10 +476,13 @@ static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
 				if (new_freq > old_freq) // min_cpu_load > max_cpu_load ?!
 					new_freq = old_freq -1;
 			}
+			// don't ramp below the boost frequency while boosted:
+			if (new_freq < (int)boost_target(policy))
+				new_freq = boost_target(policy);
 			dprintk(SMARTASS_DEBUG_ALG,"smartassQ @ %d ramp down: ramp_dir=%d ideal=%d\n",
 				old_freq,ramp_dir,this_smartass->ideal_speed);
 		}
-		else { // ramp_dir==0 ?! Could the timer change its mind about a queued ramp up/down
+		else { // ramp_dir==0 ?! Could the sampling change its mind about a queued ramp up/down
 		       // before the work task gets to run?
 		       // This may also happen if we refused to ramp up because the nr_running()==1
 			new_freq = old_freq;
@@ -445,16 +496,142 @@ static void cpufreq_smartass_freq_change_time_work(struct work_struct *work)
 			this_smartass->freq_change_time_in_idle =
 				get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
 
-		// reset timer:
+		// start a new sample:
 		if (new_freq < policy->max)
-			reset_timer(cpu,this_smartass);
-		// if we are maxed out, it is pointless to use the timer
-		// (idle cycles wake up the timer when the timer comes)
-		else if (timer_pending(&this_smartass->timer))
-			del_timer(&this_smartass->timer);
+			reset_sample(cpu,this_smartass);
+		// if we are maxed out, it is pointless to sample
+		// (leaving idle starts a new sample)
+		else
+			this_smartass->sampling = 0;
+	}
+}
+
+/* Raise all cpus to the boost frequency after an input event */
+static void cpufreq_smartass_boost_work(struct work_struct *work)
+{
+	unsigned int cpu;
+	unsigned int boost;
+	int new_freq;
+	struct smartass_info_s *this_smartass;
+	struct cpufreq_policy *policy;
+
+	for_each_online_cpu(cpu) {
+		this_smartass = &per_cpu(smartass_info, cpu);
+		if (!this_smartass->enable)
+			continue;
+
+		policy = this_smartass->cur_policy;
+		boost = boost_target(policy);
+		if (policy->cur >= boost)
+			continue;
+
+		dprintk(SMARTASS_DEBUG_JUMPS,"SmartassB: boosting from %d to %d\n",
+			policy->cur,boost);
+
+		new_freq = target_freq(policy,this_smartass,boost,policy->cur,
+				       CPUFREQ_RELATION_L);
+		if (new_freq) {
+			// keep the sampling work from seeing this as a 3rd party change:
+			this_smartass->old_freq = policy->cur;
+			this_smartass->freq_change_time_in_idle =
+				get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
+		}
+
+		if (policy->cur < policy->max)
+			reset_sample(cpu,this_smartass);
 	}
 }
 
+static void smartass_input_event(struct input_handle *handle, unsigned int type,
+		unsigned int code, int value)
+{
+	unsigned int cpu;
+	struct smartass_info_s *this_smartass;
+
+	if (!boost_freq || suspended)
+		return;
+
+	boost_end = jiffies + usecs_to_jiffies(boost_duration_us);
+
+	// Only wake the work queue if some cpu actually needs boosting:
+	for_each_online_cpu(cpu) {
+		this_smartass = &per_cpu(smartass_info, cpu);
+		if (this_smartass->enable &&
+		    this_smartass->cur_policy->cur < boost_target(this_smartass->cur_policy)) {
+			queue_work(up_wq, &boost_work);
+			break;
+		}
+	}
+}
+
+static int smartass_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_smartass";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err2;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err1;
+
+	return 0;
+err1:
+	input_unregister_handle(handle);
+err2:
+	kfree(handle);
+	return error;
+}
+
+static void smartass_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id smartass_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	}, /* multi-touch touchscreen */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	}, /* touchpad */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	}, /* keypad */
+	{ },
+};
+
+static struct input_handler smartass_input_handler = {
+	.event		= smartass_input_event,
+	.connect	= smartass_input_connect,
+	.disconnect	= smartass_input_disconnect,
+	.name		= "cpufreq_smartass",
+	.id_table	= smartass_ids,
+};
+
 static ssize_t show_debug_mask(struct kobject *kobj, struct attribute *attr, char *buf)
 {
 	return sprintf(buf, "%lu\n", debug_mask);
@@ -551,6 +728,36 @@ static ssize_t store_awake_ideal_freq(struct kobject *kobj, struct attribute *at
 	return res;
 }
 
+static ssize_t show_boost_freq(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", boost_freq);
+}
+
+static ssize_t store_boost_freq(struct kobject *kobj, struct attribute *attr, const char *buf, size_t count)
+{
+	ssize_t res;
+	unsigned long input;
+	res = strict_strtoul(buf, 0, &input);
+	if (res >= 0 && input >= 0)
+		boost_freq = input;
+	return res;
+}
+
+static ssize_t show_boost_duration_us(struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boost_duration_us);
+}
+
+static ssize_t store_boost_duration_us(struct kobject *kobj, struct attribute *attr, const char *buf, size_t count)
+{
+	ssize_t res;
+	unsigned long input;
+	res = strict_strtoul(buf, 0, &input);
+	if (res >= 0 && input >= 0 && input <= 100000000)
+		boost_duration_us = input;
+	return res;
+}
+
 static ssize_t show_sample_rate_jiffies(struct kobject *kobj, struct attribute *attr, char *buf)
 {
 	return sprintf(buf, "%u\n", sample_rate_jiffies);
@@ -636,6 +843,8 @@ define_global_rw_attr(down_rate_us);
 define_global_rw_attr(sleep_ideal_freq);
 define_global_rw_attr(sleep_wakeup_freq);
 define_global_rw_attr(awake_ideal_freq);
+define_global_rw_attr(boost_freq);
+define_global_rw_attr(boost_duration_us);
 define_global_rw_attr(sample_rate_jiffies);
 define_global_rw_attr(ramp_up_step);
 define_global_rw_attr(ramp_down_step);
@@ -649,6 +858,8 @@ static struct attribute * smartass_attributes[] = {
 	&sleep_ideal_freq_attr.attr,
 	&sleep_wakeup_freq_attr.attr,
 	&awake_ideal_freq_attr.attr,
+	&boost_freq_attr.attr,
+	&boost_duration_us_attr.attr,
 	&sample_rate_jiffies_attr.attr,
 	&ramp_up_step_attr.attr,
 	&ramp_down_step_attr.attr,
@@ -686,20 +897,25 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 
 		smp_wmb();
 
-		// Do not register the idle hook and create sysfs
-		// entries if we have already done so.
+		// Do not create sysfs entries if we have already done so.
 		if (atomic_inc_return(&active_count) <= 1) {
 			rc = sysfs_create_group(cpufreq_global_kobject,
 						&smartass_attr_group);
-			if (rc)
+			if (rc) {
+				atomic_dec(&active_count);
+				this_smartass->enable = 0;
 				return rc;
+			}
 
-			pm_idle_old = pm_idle;
-			pm_idle = cpufreq_idle;
+			if (input_register_handler(&smartass_input_handler))
+				printk(KERN_WARNING "Smartass: failed to register input handler\n");
 		}
 
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
+		// Only start taking scheduler events once nothing can fail
+		sched_freq_hook_register(cpu, &this_smartass->hook);
+
+		if (this_smartass->cur_policy->cur < new_policy->max && !this_smartass->sampling)
+			reset_sample(cpu,this_smartass);
 
 		break;
 
@@ -717,22 +933,24 @@ static int cpufreq_governor_smartass(struct cpufreq_policy *new_policy,
 						new_policy->min, CPUFREQ_RELATION_L);
 		}
 
-		if (this_smartass->cur_policy->cur < new_policy->max && !timer_pending(&this_smartass->timer))
-			reset_timer(cpu,this_smartass);
+		if (this_smartass->cur_policy->cur < new_policy->max && !this_smartass->sampling)
+			reset_sample(cpu,this_smartass);
 
 		break;
 
 	case CPUFREQ_GOV_STOP:
 		this_smartass->enable = 0;
 		smp_wmb();
-		del_timer(&this_smartass->timer);
+		sched_freq_hook_unregister(cpu);
 		flush_work(&freq_scale_work);
+		flush_work(&boost_work);
+		this_smartass->sampling = 0;
 		this_smartass->idle_exit_time = 0;
 
-		if (atomic_dec_return(&active_count) <= 1) {
+		if (atomic_dec_return(&active_count) == 0) {
+			input_unregister_handler(&smartass_input_handler);
 			sysfs_remove_group(cpufreq_global_kobject,
 					   &smartass_attr_group);
-			pm_idle = pm_idle_old;
 		}
 		break;
 	}
@@ -759,8 +977,8 @@ static void smartass_suspend(int cpu, int suspend)
 					CPUFREQ_RELATION_L);
 	} else {
 		// to avoid wakeup issues with quick sleep/wakeup don't change actual frequency when entering sleep
-		// to allow some time to settle down. Instead we just reset our statistics (and reset the timer).
-		// Eventually, the timer will adjust the frequency if necessary.
+		// to allow some time to settle down. Instead we just reset our statistics (and start a new sample).
+		// Eventually, the sample will adjust the frequency if necessary.
 
 		this_smartass->freq_change_time_in_idle =
 			get_cpu_idle_time_us(cpu,&this_smartass->freq_change_time);
@@ -768,7 +986,7 @@ static void smartass_suspend(int cpu, int suspend)
 		dprintk(SMARTASS_DEBUG_JUMPS,"SmartassS: suspending at %d\n",policy->cur);
 	}
 
-	reset_timer(smp_processor_id(),this_smartass);
+	reset_sample(smp_processor_id(),this_smartass);
 }
 
 static void smartass_early_suspend(struct early_suspend *handler) {
@@ -808,6 +1026,9 @@ static int __init cpufreq_smartass_init(void)
 	sleep_wakeup_freq = DEFAULT_SLEEP_WAKEUP_FREQ;
 	awake_ideal_freq = DEFAULT_AWAKE_IDEAL_FREQ;
 	sample_rate_jiffies = DEFAULT_SAMPLE_RATE_JIFFIES;
+	boost_freq = DEFAULT_BOOST_FREQ;
+	boost_duration_us = DEFAULT_BOOST_DURATION_US;
+	boost_end = jiffies;
 	ramp_up_step = DEFAULT_RAMP_UP_STEP;
 	ramp_down_step = DEFAULT_RAMP_DOWN_STEP;
 	max_cpu_load = DEFAULT_MAX_CPU_LOAD;
@@ -828,10 +1049,8 @@ static int __init cpufreq_smartass_init(void)
 		this_smartass->freq_change_time = 0;
 		this_smartass->freq_change_time_in_idle = 0;
 		this_smartass->cur_cpu_load = 0;
-		// intialize timer:
-		init_timer_deferrable(&this_smartass->timer);
-		this_smartass->timer.function = cpufreq_smartass_timer;
-		this_smartass->timer.data = i;
+		this_smartass->sampling = 0;
+		this_smartass->hook.func = cpufreq_smartass_sched_event;
 		work_cpumask_test_and_clear(i);
 	}
 
@@ -842,6 +1061,7 @@ static int __init cpufreq_smartass_init(void)
 		return -ENOMEM;
 
 	INIT_WORK(&freq_scale_work, cpufreq_smartass_freq_change_time_work);
+	INIT_WORK(&boost_work, cpufreq_smartass_boost_work);
 
 	register_early_suspend(&smartass_power_suspend);
 
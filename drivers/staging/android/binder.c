@@ -19,12 +19,14 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/nsproxy.h>
+#include <linux/percpu.h>
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/proc_fs.h>
@@ -86,6 +88,19 @@ static int procfs_binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * Small buffers are carved in power of two size classes starting at
+ * 1 << BINDER_MIN_CLASS_SHIFT bytes. When freed, up to BINDER_CLASS_CACHE
+ * buffers per class are kept, pages and all, for the next parcel of that
+ * class, and up to BINDER_HOT_PAGES other pages stay mapped in the free
+ * space for reuse.
+ */
+#define BINDER_MIN_CLASS_SHIFT	7
+#define BINDER_SIZE_CLASSES	5
+#define BINDER_CLASS_SIZE(class) ((size_t)1 << (BINDER_MIN_CLASS_SHIFT + (class)))
+#define BINDER_CLASS_CACHE	8
+#define BINDER_HOT_PAGES	16
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -153,13 +168,21 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_TRANSACTION_MULTI) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+struct binder_alloc_stats {
+	unsigned class_hit;
+	unsigned class_miss;
+	unsigned class_flush;
+	unsigned page_hit;
+	unsigned page_miss;
+};
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
 	binder_stats.obj_deleted[type]++;
@@ -170,6 +193,23 @@ static inline void binder_stats_created(enum binder_stat_types type)
 	binder_stats.obj_created[type]++;
 }
 
+/*
+ * Transaction latencies, in power of two buckets of microseconds: bucket 0
+ * counts samples under 1us, bucket n samples in [2^(n-1), 2^n) us and the
+ * last bucket everything slower. 'queue' is the time from binder_transaction
+ * until a thread picks the work up in binder_thread_read, 'reply' the time
+ * from a synchronous call until the callee sends its reply. Counters are
+ * per-cpu so that updating them needs no lock of its own.
+ */
+#define BINDER_LATENCY_BUCKETS 16
+
+struct binder_latency {
+	unsigned long queue[BINDER_LATENCY_BUCKETS];
+	unsigned long reply[BINDER_LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct binder_latency, binder_latency);
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -238,6 +278,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency __percpu *latency;
 };
 
 struct binder_ref_death {
@@ -264,8 +305,11 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* free entry by size or allocated */
+					/* entry by address */
+		struct list_head class_entry; /* cached entry by size class */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -300,12 +344,24 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	/*
+	 * alloc_lock protects the buffer allocator: buffers, free_buffers,
+	 * allocated_buffers, free_async_space and pages. It nests inside
+	 * binder_lock and outside mmap_sem, and may also be taken without
+	 * binder_lock held.
+	 */
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
 	struct page **pages;
+	unsigned long *pages_hot;	/* mapped, but in free space */
+	struct list_head size_class[BINDER_SIZE_CLASSES];
+	int size_class_count[BINDER_SIZE_CLASSES];
+	int pages_cached;
+	struct binder_alloc_stats alloc_stats;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -318,6 +374,9 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	int tmp_ref;
+	int release_pending;
+	struct binder_latency __percpu *latency;
 };
 
 enum {
@@ -361,10 +420,23 @@ struct binder_transaction {
 	long	priority;
 	long	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	queue_time;
+};
+
+/*
+ * State shared by the one-way transactions of a BC_TRANSACTION_MULTI: their
+ * buffers, carved out of one allocation, and the wakeup of the target that is
+ * deferred until the whole batch has been queued.
+ */
+struct binder_batch {
+	struct binder_buffer **buffers;
+	int next;
+	wait_queue_head_t *wait;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_deferred_release(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -622,6 +694,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	struct vm_struct tmp_area;
 	struct page **page;
 	struct mm_struct *mm;
+	size_t index;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -652,9 +725,19 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-
+		index = (page_addr - proc->buffer) / PAGE_SIZE;
+		page = &proc->pages[index];
+
+		if (test_and_clear_bit(index, proc->pages_hot)) {
+			/* still mapped from the hot page cache */
+			BUG_ON(!*page);
+			BUG_ON(proc->pages_cached <= 0);
+			proc->pages_cached--;
+			proc->alloc_stats.page_hit++;
+			continue;
+		}
 		BUG_ON(*page);
+		proc->alloc_stats.page_miss++;
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -691,7 +774,13 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		index = (page_addr - proc->buffer) / PAGE_SIZE;
+		page = &proc->pages[index];
+		if (proc->pages_cached < BINDER_HOT_PAGES) {
+			set_bit(index, proc->pages_hot);
+			proc->pages_cached++;
+			continue;
+		}
 		if (vma)
 			zap_page_range(vma, (uintptr_t)page_addr +
 				proc->user_buffer_offset, PAGE_SIZE, NULL);
@@ -711,17 +800,31 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static int binder_size_class(size_t size)
+{
+	int class;
+
+	for (class = 0; class < BINDER_SIZE_CLASSES; class++)
+		if (size <= BINDER_CLASS_SIZE(class))
+			return class;
+	return -1;
+}
+
+static int binder_flush_cached_buffers(struct binder_proc *proc);
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct rb_node *best_fit;
 	void *has_page_addr;
 	void *end_page_addr;
-	size_t size;
+	size_t size, alloc_size;
+	int class;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -746,15 +849,38 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	alloc_size = size;
+	class = binder_size_class(size);
+	if (class >= 0) {
+		if (!list_empty(&proc->size_class[class])) {
+			buffer = list_first_entry(&proc->size_class[class],
+						  struct binder_buffer,
+						  class_entry);
+			list_del(&buffer->class_entry);
+			proc->size_class_count[class]--;
+			proc->alloc_stats.class_hit++;
+			binder_insert_allocated_buffer(proc, buffer);
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: binder_alloc_buf size %zd "
+				     "got cached %p\n", proc->pid, size, buffer);
+			goto got_buffer;
+		}
+		proc->alloc_stats.class_miss++;
+		alloc_size = BINDER_CLASS_SIZE(class);
+	}
+
+retry:
+	n = proc->free_buffers.rb_node;
+	best_fit = NULL;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (alloc_size < buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else if (alloc_size > buffer_size)
 			n = n->rb_right;
 		else {
 			best_fit = n;
@@ -762,6 +888,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		}
 	}
 	if (best_fit == NULL) {
+		if (binder_flush_cached_buffers(proc))
+			goto retry;
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
@@ -778,10 +906,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
 	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
+		if (alloc_size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+			buffer_size = alloc_size; /* no room for other buffers */
 		else
-			buffer_size = size + sizeof(struct binder_buffer);
+			buffer_size = alloc_size + sizeof(struct binder_buffer);
 	}
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
@@ -794,8 +922,9 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
-	if (buffer_size != size) {
-		struct binder_buffer *new_buffer = (void *)buffer->data + size;
+	if (buffer_size != alloc_size) {
+		struct binder_buffer *new_buffer =
+			(void *)buffer->data + alloc_size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
 		binder_insert_free_buffer(proc, new_buffer);
@@ -803,9 +932,12 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+got_buffer:
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -817,6 +949,80 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+
+	return buffer;
+}
+
+/*
+ * binder_alloc_buf_multi - allocate one buffer for each of the 'count'
+ * one-way transactions in 'trs' with a single free-tree walk and page range
+ * update, by allocating their combined size and splitting it into adjacent
+ * allocated buffers. Each of them is freed individually as usual.
+ */
+static int binder_alloc_buf_multi(struct binder_proc *proc,
+				  struct binder_transaction_data *trs,
+				  int count, struct binder_buffer **buffers)
+{
+	struct binder_buffer *buffer, *next;
+	size_t size, total = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		size = ALIGN(trs[i].data_size, sizeof(void *)) +
+			ALIGN(trs[i].offsets_size, sizeof(void *));
+		if (size < trs[i].data_size || size < trs[i].offsets_size ||
+		    total + size + sizeof(struct binder_buffer) < total) {
+			binder_user_error("binder: %d: got transaction with "
+				"invalid size %zd-%zd\n", proc->pid,
+				trs[i].data_size, trs[i].offsets_size);
+			return -EINVAL;
+		}
+		total += size;
+		if (i)
+			total += sizeof(struct binder_buffer);
+	}
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, total, 0, 1);
+	if (buffer == NULL) {
+		mutex_unlock(&proc->alloc_lock);
+		return -ENOMEM;
+	}
+
+	for (i = 0; ; i++) {
+		buffer->data_size = trs[i].data_size;
+		buffer->offsets_size = trs[i].offsets_size;
+		buffers[i] = buffer;
+		if (i == count - 1)
+			break;
+
+		next = (void *)buffer->data +
+			ALIGN(trs[i].data_size, sizeof(void *)) +
+			ALIGN(trs[i].offsets_size, sizeof(void *));
+		memset(next, 0, sizeof(*next));
+		next->async_transaction = 1;
+		list_add(&next->entry, &buffer->entry);
+		binder_insert_allocated_buffer(proc, next);
+		buffer = next;
+	}
+	mutex_unlock(&proc->alloc_lock);
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: binder_alloc_buf_multi %d buffers size %zd\n",
+		     proc->pid, count, total);
+
+	return 0;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -874,10 +1080,29 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+/*
+ * binder_buffer_class - the size class a free buffer can be cached for,
+ * or -1 if it is too small or too big to be worth keeping.
+ */
+static int binder_buffer_class(size_t buffer_size)
+{
+	int class;
+
+	for (class = BINDER_SIZE_CLASSES - 1; class >= 0; class--)
+		if (buffer_size >= BINDER_CLASS_SIZE(class))
+			return buffer_size < 2 * BINDER_CLASS_SIZE(class) ?
+				class : -1;
+	return -1;
+}
+
+static void binder_put_free_buffer(struct binder_proc *proc,
+				   struct binder_buffer *buffer);
+
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
+	int class;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
@@ -903,11 +1128,25 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
+	class = binder_buffer_class(buffer_size);
+	if (class >= 0 && proc->size_class_count[class] < BINDER_CLASS_CACHE) {
+		list_add(&buffer->class_entry, &proc->size_class[class]);
+		proc->size_class_count[class]++;
+		return;
+	}
+	binder_put_free_buffer(proc, buffer);
+}
+
+static void binder_put_free_buffer(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
+{
+	size_t buffer_size = binder_buffer_size(proc, buffer);
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
 		NULL);
-	rb_erase(&buffer->rb_node, &proc->allocated_buffers);
 	buffer->free = 1;
 	if (!list_is_last(&buffer->entry, &proc->buffers)) {
 		struct binder_buffer *next = list_entry(buffer->entry.next,
@@ -929,6 +1168,38 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
+/*
+ * binder_flush_cached_buffers - give all size class cached buffers back to
+ * the free tree so that they can be merged into larger ones. Returns the
+ * number of buffers released.
+ */
+static int binder_flush_cached_buffers(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer, *tmp;
+	int class, count = 0;
+
+	for (class = 0; class < BINDER_SIZE_CLASSES; class++) {
+		list_for_each_entry_safe(buffer, tmp, &proc->size_class[class],
+					 class_entry) {
+			list_del(&buffer->class_entry);
+			binder_put_free_buffer(proc, buffer);
+			count++;
+		}
+		proc->size_class_count[class] = 0;
+	}
+	if (count)
+		proc->alloc_stats.class_flush++;
+	return count;
+}
+
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -948,6 +1219,13 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_free_node(struct binder_node *node)
+{
+	free_percpu(node->latency);
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
 static struct binder_node *binder_new_node(struct binder_proc *proc,
 					   void __user *ptr,
 					   void __user *cookie)
@@ -981,6 +1259,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	node->latency = alloc_percpu(struct binder_latency);
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -1058,8 +1337,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			binder_free_node(node);
 		}
 	}
 
@@ -1381,13 +1659,74 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+static void binder_account_latency(struct binder_proc *proc,
+				   struct binder_node *node,
+				   ktime_t start, int reply)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	if (us > 0)
+		bucket = min_t(int, fls64(us), BINDER_LATENCY_BUCKETS - 1);
+
+	if (reply) {
+		this_cpu_inc(binder_latency.reply[bucket]);
+		if (proc->latency)
+			this_cpu_inc(proc->latency->reply[bucket]);
+		if (node && node->latency)
+			this_cpu_inc(node->latency->reply[bucket]);
+	} else {
+		this_cpu_inc(binder_latency.queue[bucket]);
+		if (proc->latency)
+			this_cpu_inc(proc->latency->queue[bucket]);
+		if (node && node->latency)
+			this_cpu_inc(node->latency->queue[bucket]);
+	}
+}
+
+/*
+ * A transaction pins its target proc with tmp_ref while it runs without
+ * binder_lock. A release that comes in meanwhile is left to the last
+ * unpin.
+ */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	if (--proc->tmp_ref == 0 && proc->release_pending)
+		binder_deferred_release(proc); /* frees proc */
+}
+
+static int binder_copy_transaction_data(struct binder_proc *proc,
+					struct binder_thread *thread,
+					struct binder_buffer *buffer,
+					struct binder_transaction_data *tr)
+{
+	size_t *offp;
+
+	offp = (size_t *)(buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+
+	if (copy_from_user(buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+		binder_user_error("binder: %d:%d got transaction with invalid "
+			"data ptr\n", proc->pid, thread->pid);
+		return -EFAULT;
+	}
+	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+		binder_user_error("binder: %d:%d got transaction with invalid "
+			"offsets ptr\n", proc->pid, thread->pid);
+		return -EFAULT;
+	}
+	return 0;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       struct binder_batch *batch)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
+	int ret = 0;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
@@ -1487,21 +1826,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1520,6 +1846,7 @@ static void binder_transaction(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
 	t->debug_id = ++binder_last_id;
+	t->queue_time = ktime_get();
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1545,13 +1872,44 @@ static void binder_transaction(struct binder_proc *proc,
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
-	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	if (batch) {
+		t->buffer = batch->buffers[batch->next++];
+		ret = binder_copy_transaction_data(proc, thread, t->buffer, tr);
+	} else {
+		/*
+		 * Mapping pages into the target and copying the payload may
+		 * sleep for a while, so do it without binder_lock. The
+		 * target proc is pinned by tmp_ref and the target node by the
+		 * strong reference taken above for the buffer.
+		 */
+		target_proc->tmp_ref++;
+		mutex_unlock(&binder_lock);
+		t->buffer = binder_alloc_buf(target_proc, tr->data_size,
+			tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		if (t->buffer)
+			ret = binder_copy_transaction_data(proc, thread,
+							   t->buffer, tr);
+		mutex_lock(&binder_lock);
+		if (target_proc->release_pending ||
+		    (reply && in_reply_to->from != target_thread)) {
+			if (t->buffer)
+				binder_free_buf(target_proc, t->buffer);
+			if (target_node)
+				binder_dec_node(target_node, 1, 0);
+			binder_proc_dec_tmpref(target_proc);
+			return_error = BR_DEAD_REPLY;
+			goto err_binder_alloc_buf_failed;
+		}
+		binder_proc_dec_tmpref(target_proc);
+	}
 	if (t->buffer == NULL) {
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
@@ -1559,20 +1917,10 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
-	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+	if (ret) {
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
@@ -1721,8 +2069,33 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	/*
+	 * Pick the target thread only now: the call stack may have changed
+	 * while binder_lock was dropped above.
+	 */
+	if (!reply && !(tr->flags & TF_ONE_WAY)) {
+		struct binder_transaction *tmp;
+
+		for (tmp = thread->transaction_stack; tmp;
+		     tmp = tmp->from_parent)
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+	}
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+	t->to_thread = target_thread;
+
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_account_latency(proc, in_reply_to->buffer ?
+				       in_reply_to->buffer->target_node : NULL,
+				       in_reply_to->queue_time, 1);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1742,8 +2115,19 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_wait) {
+		/*
+		 * The sender of a call or reply is about to block in
+		 * binder_thread_read, so let the scheduler hand its cpu
+		 * straight to the target instead of waking it elsewhere.
+		 */
+		if (batch)
+			batch->wait = target_wait;
+		else if (reply || !(t->flags & TF_ONE_WAY))
+			wake_up_interruptible_sync(target_wait);
+		else
+			wake_up_interruptible(target_wait);
+	}
 	return;
 
 err_get_unused_fd_failed:
@@ -1789,6 +2173,79 @@ err_no_context_mgr_node:
 		thread->return_error = return_error;
 }
 
+static void binder_transaction_multi(struct binder_proc *proc,
+				     struct binder_thread *thread,
+				     struct binder_transaction_data *trs,
+				     int count)
+{
+	struct binder_buffer **buffers;
+	struct binder_proc *target_proc;
+	struct binder_node *target_node;
+	struct binder_batch batch;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!(trs[i].flags & TF_ONE_WAY) ||
+		    trs[i].target.handle != trs[0].target.handle) {
+			binder_user_error("binder: %d:%d BC_TRANSACTION_MULTI "
+				"entry %d is not one-way to handle %zd\n",
+				proc->pid, thread->pid, i,
+				trs[0].target.handle);
+			thread->return_error = BR_FAILED_REPLY;
+			return;
+		}
+	}
+
+	if (trs[0].target.handle) {
+		struct binder_ref *ref;
+		ref = binder_get_ref(proc, trs[0].target.handle);
+		if (ref == NULL) {
+			binder_user_error("binder: %d:%d got "
+				"transaction to invalid handle\n",
+				proc->pid, thread->pid);
+			thread->return_error = BR_FAILED_REPLY;
+			return;
+		}
+		target_node = ref->node;
+	} else {
+		target_node = binder_context_mgr_node;
+		if (target_node == NULL) {
+			thread->return_error = BR_DEAD_REPLY;
+			return;
+		}
+	}
+	target_proc = target_node->proc;
+	if (target_proc == NULL) {
+		thread->return_error = BR_DEAD_REPLY;
+		return;
+	}
+
+	buffers = kmalloc(sizeof(*buffers) * count, GFP_KERNEL);
+	if (buffers == NULL) {
+		thread->return_error = BR_FAILED_REPLY;
+		return;
+	}
+	if (binder_alloc_buf_multi(target_proc, trs, count, buffers)) {
+		kfree(buffers);
+		thread->return_error = BR_FAILED_REPLY;
+		return;
+	}
+
+	batch.buffers = buffers;
+	batch.next = 0;
+	batch.wait = NULL;
+	for (i = 0; i < count && thread->return_error == BR_OK; i++)
+		binder_transaction(proc, thread, &trs[i], 0, &batch);
+
+	/* a failed transaction leaves the rest of the batch unsent */
+	while (batch.next < count)
+		binder_free_buf(target_proc, buffers[batch.next++]);
+	kfree(buffers);
+
+	if (batch.wait)
+		wake_up_interruptible(batch.wait);
+}
+
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *buffer, int size, signed long *consumed)
 {
@@ -1939,20 +2396,31 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			/*
+			 * The buffer is freed below without binder_lock, so
+			 * claim it under alloc_lock: a concurrent BC_FREE_BUFFER
+			 * for the same pointer then sees allow_user_free clear
+			 * and never touches it again.
+			 */
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1970,7 +2438,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			mutex_unlock(&binder_lock);
 			binder_free_buf(proc, buffer);
+			mutex_lock(&binder_lock);
 			break;
 		}
 
@@ -1981,7 +2451,36 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr,
+					   cmd == BC_REPLY, NULL);
+			break;
+		}
+
+		case BC_TRANSACTION_MULTI: {
+			struct binder_transaction_data *trs;
+			uint32_t count;
+
+			if (get_user(count, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+			if (count == 0 || count > BINDER_TRANSACTION_MULTI_MAX ||
+			    count > (end - ptr) / sizeof(*trs)) {
+				binder_user_error("binder: %d:%d "
+					"BC_TRANSACTION_MULTI with bad "
+					"count %u\n", proc->pid, thread->pid,
+					count);
+				return -EINVAL;
+			}
+			trs = kmalloc(sizeof(*trs) * count, GFP_KERNEL);
+			if (trs == NULL)
+				return -ENOMEM;
+			if (copy_from_user(trs, ptr, sizeof(*trs) * count)) {
+				kfree(trs);
+				return -EFAULT;
+			}
+			ptr += sizeof(*trs) * count;
+			binder_transaction_multi(proc, thread, trs, count);
+			kfree(trs);
 			break;
 		}
 
@@ -2358,8 +2857,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
+					binder_free_node(node);
 				} else {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p state unchanged\n",
@@ -2408,6 +2906,8 @@ retry:
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		binder_account_latency(proc, t->buffer->target_node,
+				       t->queue_time, 0);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
@@ -2838,6 +3338,13 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		failure_string = "alloc page array";
 		goto err_alloc_pages_failed;
 	}
+	proc->pages_hot = kzalloc(BITS_TO_LONGS((vma->vm_end - vma->vm_start) /
+				  PAGE_SIZE) * sizeof(long), GFP_KERNEL);
+	if (proc->pages_hot == NULL) {
+		ret = -ENOMEM;
+		failure_string = "alloc hot page map";
+		goto err_alloc_pages_hot_failed;
+	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
 
 	vma->vm_ops = &binder_vm_ops;
@@ -2863,6 +3370,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	kfree(proc->pages_hot);
+	proc->pages_hot = NULL;
+err_alloc_pages_hot_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2905,6 +3415,7 @@ static int exist_proc_entry(const char *name, struct proc_dir_entry *parent)
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2916,6 +3427,10 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->alloc_lock);
+	proc->latency = alloc_percpu(struct binder_latency);
+	for (i = 0; i < BINDER_SIZE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->size_class[i]);
 	proc->default_priority = task_nice(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
@@ -3022,8 +3537,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
 		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			binder_free_node(node);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
@@ -3096,6 +3610,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 				page_count++;
 			}
 		}
+		kfree(proc->pages_hot);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3109,6 +3624,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
 		     active_transactions, buffers, page_count);
 
+	free_percpu(proc->latency);
 	kfree(proc);
 }
 
@@ -3143,8 +3659,12 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_FLUSH)
 			binder_deferred_flush(proc);
 
-		if (defer & BINDER_DEFERRED_RELEASE)
-			binder_deferred_release(proc); /* frees proc */
+		if (defer & BINDER_DEFERRED_RELEASE) {
+			if (proc->tmp_ref)
+				proc->release_pending = 1;
+			else
+				binder_deferred_release(proc); /* frees proc */
+		}
 
 		mutex_unlock(&binder_lock);
 		if (files)
@@ -3327,9 +3847,24 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	if (print_all) {
+		int class, cached = 0;
+
+		for (class = 0; class < BINDER_SIZE_CLASSES; class++)
+			cached += proc->size_class_count[class];
+		seq_printf(m, "  alloc: class hit %u miss %u flush %u "
+			   "cached %d, page hit %u miss %u cached %d\n",
+			   proc->alloc_stats.class_hit,
+			   proc->alloc_stats.class_miss,
+			   proc->alloc_stats.class_flush, cached,
+			   proc->alloc_stats.page_hit,
+			   proc->alloc_stats.page_miss, proc->pages_cached);
+	}
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3545,12 +4080,14 @@ static char *procfs_print_binder_proc(char *buf, char *end,
 					       rb_entry(n, struct binder_ref,
 							rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
 		buf = procfs_print_binder_buffer(buf, end, "  buffer",
 					  rb_entry(n, struct binder_buffer,
 						   rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
@@ -3607,7 +4144,8 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_MULTI"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3688,8 +4226,10 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
@@ -3752,6 +4292,89 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 const char *name, unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "%s%s:", prefix, name);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %lu", hist[i]);
+	seq_puts(m, "\n");
+}
+
+/*
+ * binder_latency_sum - add up the per-cpu histograms in 'latency' and
+ * return the total number of samples.
+ */
+static unsigned long binder_latency_sum(struct binder_latency __percpu *latency,
+					struct binder_latency *sum)
+{
+	unsigned long count = 0;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	if (latency == NULL)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		struct binder_latency *l = per_cpu_ptr(latency, cpu);
+
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+			sum->queue[i] += l->queue[i];
+			sum->reply[i] += l->reply[i];
+			count += l->queue[i] + l->reply[i];
+		}
+	}
+	return count;
+}
+
+static void print_binder_latencies(struct seq_file *m, const char *prefix,
+				   struct binder_latency *sum)
+{
+	print_binder_latency(m, prefix, "queue", sum->queue);
+	print_binder_latency(m, prefix, "reply", sum->reply);
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+	struct binder_latency sum;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		mutex_lock(&binder_lock);
+
+	seq_puts(m, "binder latency (usecs):");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, i ? " %lu" : " <%lu", i ? 1UL << (i - 1) : 1UL);
+	seq_puts(m, "+\n");
+
+	binder_latency_sum(&binder_latency, &sum);
+	print_binder_latencies(m, "", &sum);
+
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		seq_printf(m, "proc %d\n", proc->pid);
+		binder_latency_sum(proc->latency, &sum);
+		print_binder_latencies(m, "  ", &sum);
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			struct binder_node *node = rb_entry(n,
+						struct binder_node, rb_node);
+
+			if (!binder_latency_sum(node->latency, &sum))
+				continue;
+			seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+				   node->ptr, node->cookie);
+			print_binder_latencies(m, "    ", &sum);
+		}
+	}
+	if (do_lock)
+		mutex_unlock(&binder_lock);
+	return 0;
+}
+
 static int binder_transactions_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
@@ -3897,8 +4520,10 @@ static char *procfs_print_binder_proc_stats(char *buf, char *end,
 		return buf;
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mutex_unlock(&proc->alloc_lock);
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -4149,6 +4774,7 @@ static struct miscdevice binder_miscdev = {
 
 BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
+BINDER_DEBUG_ENTRY(latency);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
 
@@ -4180,6 +4806,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    NULL,
 				    &binder_stats_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 		debugfs_create_file("transactions",
 				    S_IRUGO,
 				    binder_debugfs_dir_entry_root,
@@ -324,7 +324,20 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_MULTI = _IOW('c', 17, int),
+	/*
+	 * int: number of transactions, at most BINDER_TRANSACTION_MULTI_MAX,
+	 * followed by that many binder_transaction_data. Every one of them
+	 * must be TF_ONE_WAY and name the same target handle. They are
+	 * queued in order from a single buffer allocation and with a single
+	 * wakeup of the target; each still gets its own
+	 * BR_TRANSACTION_COMPLETE. On failure the rest of the batch is
+	 * dropped and the error is returned as for BC_TRANSACTION.
+	 */
 };
 
+#define BINDER_TRANSACTION_MULTI_MAX	64
+
 #endif /* _LINUX_BINDER_H */
 
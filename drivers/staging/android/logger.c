@@ -25,6 +25,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,32 +34,49 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the reader list are
+ * protected by the spinlock 'lock'; the buffer contents are not.
+ *
+ * Writers reserve space by advancing 'w_off' under the lock, copy their
+ * payload in without holding anything, and then commit. Entries between
+ * 'c_off' and 'w_off' have been reserved but not necessarily committed, so
+ * readers only ever consume up to 'c_off'.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	space_wq; /* writers waiting for in-flight ones */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting offsets and readers */
 	size_t			w_off;	/* current write head offset */
+	size_t			c_off;	/* everything before here is committed */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	unsigned int		gen;	/* times w_off has wrapped */
+	struct logger_mmap_header *mmap_hdr; /* shared with mmap() readers */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned long		laps;	/* times a writer pulled us forward */
 };
 
+/*
+ * An entry whose header carries this in its __pad field has been reserved
+ * but its payload is still being copied in. The field is cleared again on
+ * commit, so readers never see it.
+ */
+#define LOGGER_ENTRY_PENDING	0x1
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +107,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,15 +126,15 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes at offset 'off' of 'log'
+ * into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Called without log->lock, since copy_to_user() may fault. A writer can
+ * therefore overwrite the bytes while we copy them; the caller detects that
+ * afterwards via reader->laps and retries.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
@@ -125,8 +143,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +155,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -159,6 +175,8 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned long laps;
+	size_t off;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,9 +184,9 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->c_off == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,26 +207,40 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(log->c_off == reader->r_off)) {
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	off = reader->r_off;
+	laps = reader->laps;
+	spin_unlock(&log->lock);
+
+	if (count < ret)
+		return -EINVAL;
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, off, buf, ret);
+	if (ret < 0)
+		return ret;
 
-out:
-	mutex_unlock(&log->mutex);
+	/*
+	 * If a writer lapped us while we were copying, what we handed to
+	 * user-space may be torn; throw it away and read the entry we were
+	 * pulled forward to instead.
+	 */
+	spin_lock(&log->lock);
+	if (unlikely(reader->laps != laps || reader->r_off != off)) {
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	reader->r_off = logger_offset(off + ret);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -217,17 +249,17 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
 	size_t count = 0;
 
-	do {
+	while (count < len) {
 		size_t nr = get_entry_len(log, off);
 		off = logger_offset(off + nr);
 		count += nr;
-	} while (count < len);
+	}
 
 	return off;
 }
@@ -249,13 +281,38 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * update_mmap_header - publish the current offsets to mmap() readers
+ *
+ * The caller needs to hold log->lock.
+ */
+static void update_mmap_header(struct logger_log *log)
+{
+	struct logger_mmap_header *hdr = log->mmap_hdr;
+
+	if (unlikely(!hdr))
+		return;
+
+	hdr->seq++;
+	smp_wmb();
+	hdr->w_off = log->w_off;
+	hdr->c_off = log->c_off;
+	hdr->head = log->head;
+	hdr->gen = log->gen;
+	smp_wmb();
+	hdr->seq++;
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * We only walk as far as the first entry boundary past the new write head,
+ * which logger_reserve() guarantees lies in committed data.
+ *
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -264,71 +321,187 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	struct logger_reader *reader;
 
 	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+		log->head = get_next_entry(log, log->head,
+					   logger_offset(new - log->head));
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		if (clock_interval(old, new, reader->r_off)) {
+			reader->r_off = get_next_entry(log, reader->r_off,
+					logger_offset(new - reader->r_off));
+			reader->laps++;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at offset 'off'
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
 
-	log->w_off = logger_offset(log->w_off + count);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
+	if (count != len)
+		memset(log->buffer, 0, count - len);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * Called without log->lock; the caller must own the reservation covering
+ * the destination.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * entry_pending - is the entry starting at 'off' reserved but uncommitted?
+ *
+ * Caller must hold log->lock.
+ */
+static int entry_pending(struct logger_log *log, size_t off)
+{
+	size_t pad = logger_offset(off + offsetof(struct logger_entry, __pad));
+	__u16 val;
+
+	switch (log->size - pad) {
+	case 1:
+		memcpy(&val, log->buffer + pad, 1);
+		memcpy(((char *) &val) + 1, log->buffer, 1);
+		break;
+	default:
+		memcpy(&val, log->buffer + pad, 2);
+	}
+
+	return val & LOGGER_ENTRY_PENDING;
+}
+
+/*
+ * logger_reserve - reserve room for the entry described by 'header' and
+ * write the header into it, marked pending. Returns the offset of the
+ * entry, or -EAGAIN if that would overwrite an entry that is still being
+ * copied in.
+ *
+ * Never wrapping past c_off while entries are in flight keeps everything
+ * fix_up_readers() has to walk committed.
+ */
+static ssize_t logger_reserve(struct logger_log *log,
+			      struct logger_entry *header)
+{
+	size_t len = sizeof(struct logger_entry) + header->len;
+	ssize_t off;
+
+	spin_lock(&log->lock);
+
+	if (log->c_off != log->w_off &&
+	    len >= logger_offset(log->c_off - log->w_off)) {
+		spin_unlock(&log->lock);
+		return -EAGAIN;
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. We do this now
+	 * because once we drop the lock the payload is copied in without
+	 * any protection against concurrent readers.
+	 */
+	fix_up_readers(log, len);
+
+	off = log->w_off;
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, off, header, sizeof(struct logger_entry));
+	log->w_off = logger_offset(off + len);
+	if (log->w_off < off)
+		log->gen++;
+	update_mmap_header(log);
+
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_commit - publish the entry reserved at 'off' and advance the commit
+ * offset over every contiguous committed entry behind it.
+ */
+static void logger_commit(struct logger_log *log, size_t off)
+{
+	static const __u16 zero;
+	int moved = 0;
+
+	spin_lock(&log->lock);
+
+	do_write_log(log,
+		     logger_offset(off + offsetof(struct logger_entry, __pad)),
+		     &zero, sizeof(zero));
+
+	while (log->c_off != log->w_off && !entry_pending(log, log->c_off)) {
+		log->c_off = logger_offset(log->c_off +
+					   get_entry_len(log, log->c_off));
+		moved = 1;
+	}
+	if (moved)
+		update_mmap_header(log);
+
+	spin_unlock(&log->lock);
+
+	if (moved) {
+		/* wake up any blocked readers */
+		wake_up_interruptible(&log->wq);
+		if (waitqueue_active(&log->space_wq))
+			wake_up(&log->space_wq);
+	}
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Concurrent writers only serialize for the reservation and the commit; the
+ * payload copies run in parallel and never wait on readers.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
+	ssize_t off;
+	size_t pos;
 
 	now = current_kernel_time();
 
@@ -342,17 +515,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	wait_event(log->space_wq,
+		   (off = logger_reserve(log, &header)) != -EAGAIN);
+	pos = logger_offset(off + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +527,26 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, pos, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * Writers behind us may already own the space after
+			 * this entry, so it cannot be given back. Commit it
+			 * with an empty payload instead.
+			 */
+			do_clear_log(log,
+				logger_offset(off + sizeof(struct logger_entry)),
+				header.len);
+			ret = nr;
+			break;
 		}
 
+		pos = logger_offset(pos + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, off);
 
 	return ret;
 }
@@ -409,12 +579,13 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->laps = 0;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -433,9 +604,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
@@ -465,21 +636,97 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->c_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * set_read_off - move 'reader' forward to 'off', for readers that consume
+ * entries in place through mmap() and then want logger_poll() to block until
+ * there is something newer. 'off' must be an entry boundary between the
+ * reader's current offset and the commit offset.
+ *
+ * The caller needs to hold log->lock.
+ */
+static long set_read_off(struct logger_log *log, struct logger_reader *reader,
+			 unsigned long off)
+{
+	size_t r_off = reader->r_off;
+
+	if (off >= log->size)
+		return -EINVAL;
+
+	while (r_off != off) {
+		if (r_off == log->c_off)
+			return -EINVAL;
+		r_off = logger_offset(r_off + get_entry_len(log, r_off));
+	}
+
+	reader->r_off = r_off;
+	reader->laps++;
+
+	return 0;
+}
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the struct logger_mmap_header page followed by the ring buffer,
+ * read-only, so readers can consume entries without a read() per entry.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long addr, pfn;
+	unsigned char *p;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if (vma->vm_pgoff || size > PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	pfn = page_to_pfn(virt_to_page(log->mmap_hdr));
+	ret = remap_pfn_range(vma, vma->vm_start, pfn, PAGE_SIZE,
+			      vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	/* the buffer is in the module area when we are built modular */
+	p = log->buffer;
+	for (addr = vma->vm_start + PAGE_SIZE; addr < vma->vm_end;
+	     addr += PAGE_SIZE, p += PAGE_SIZE) {
+		if (is_vmalloc_or_module_addr(p))
+			pfn = vmalloc_to_pfn(p);
+		else
+			pfn = page_to_pfn(virt_to_page(p));
+
+		ret = remap_pfn_range(vma, addr, pfn, PAGE_SIZE,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -491,10 +738,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->c_off >= reader->r_off)
+			ret = log->c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->c_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -502,7 +749,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (log->c_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -512,14 +759,25 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		list_for_each_entry(reader, &log->readers, list) {
+			reader->r_off = log->c_off;
+			reader->laps++;
+		}
+		log->head = log->c_off;
+		update_mmap_header(log);
 		ret = 0;
 		break;
+	case LOGGER_SET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = set_read_off(log, reader, arg);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -529,6 +787,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -537,11 +796,11 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, at least PAGE_SIZE, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -551,9 +810,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.space_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .space_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -580,10 +841,17 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_hdr = (void *) get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!log->mmap_hdr))
+		return -ENOMEM;
+	log->mmap_hdr->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long) log->mmap_hdr);
+		log->mmap_hdr = NULL;
 		return ret;
 	}
 
@@ -30,6 +30,27 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - the first page of a log's mmap() region
+ *
+ * The ring buffer itself follows at offset PAGE_SIZE. The kernel bumps 'seq'
+ * to an odd value before updating the other fields and back to an even one
+ * afterwards, so a reader retries its snapshot while 'seq' is odd or changed.
+ *
+ * Entries between 'head' and 'c_off' are committed and may be consumed in
+ * place. A byte at absolute position gen * size + off stays valid until the
+ * absolute write position gen * size + w_off passes it by more than 'size';
+ * re-check that after copying an entry out.
+ */
+struct logger_mmap_header {
+	__u32		seq;	/* odd while an update is in progress */
+	__u32		size;	/* size of the ring buffer */
+	__u32		w_off;	/* write head offset */
+	__u32		c_off;	/* entries before here are committed */
+	__u32		head;	/* oldest entry still in the ring */
+	__u32		gen;	/* times w_off has wrapped around */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +66,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 5) /* advance reader */
 
 #endif /* _LINUX_LOGGER_H */
@@ -35,6 +35,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/cleancache.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
@@ -76,6 +81,95 @@ static uint32_t lowmem_check_filepages = 0;
 		}					\
 	} while (0)
 
+/*
+ * Every process is kept in the bucket of its oom_adj, so that lowmem_shrink
+ * only looks at the highest non-empty buckets at or above min_adj instead of
+ * walking all processes. A process is indexed when it is forked, becomes the
+ * thread group leader in exec or has its oom_adj written, and dropped when
+ * its task is freed. The index only says which bucket to look at: rss
+ * changes all the time, so it is read from each process of that bucket when
+ * a victim is picked.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+struct lowmem_task {
+	struct list_head adj_node;	/* in lowmem_adj_bucket by oom_adj */
+	struct hlist_node hash_node;	/* in lowmem_task_hash by task */
+	struct list_head select_node;	/* in lowmem_select's candidates */
+	struct task_struct *task;	/* thread group leader */
+	int oom_adj;
+};
+
+static struct list_head lowmem_adj_bucket[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+
+/* protects the index; tasks are freed from softirq context too */
+static DEFINE_SPINLOCK(lowmem_task_lock);
+/* serializes lowmem_select, which owns select_node */
+static DEFINE_MUTEX(lowmem_select_lock);
+static struct kmem_cache *lowmem_task_cachep;
+
+/* set if a process could not be indexed, victims are then found by a scan */
+static int lowmem_index_incomplete;
+
+static struct lowmem_task *lowmem_task_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(lt, pos,
+			     &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)],
+			     hash_node)
+		if (lt->task == task)
+			return lt;
+	return NULL;
+}
+
+static void lowmem_task_update(struct task_struct *task, int oom_adj)
+{
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	if (oom_adj < OOM_DISABLE || oom_adj > OOM_ADJUST_MAX)
+		return;
+
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	lt = lowmem_task_find(task);
+	if (lt) {
+		list_del(&lt->adj_node);
+	} else {
+		lt = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+		if (!lt) {
+			lowmem_index_incomplete = 1;
+			goto out;
+		}
+		lt->task = task;
+		hlist_add_head(&lt->hash_node, &lowmem_task_hash[
+			       hash_ptr(task, LOWMEM_HASH_BITS)]);
+	}
+	lt->oom_adj = oom_adj;
+	list_add_tail(&lt->adj_node,
+		      &lowmem_adj_bucket[oom_adj - OOM_DISABLE]);
+out:
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
+}
+
+static void lowmem_task_remove(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	lt = lowmem_task_find(task);
+	if (lt) {
+		list_del(&lt->adj_node);
+		hlist_del(&lt->hash_node);
+		kmem_cache_free(lowmem_task_cachep, lt);
+	}
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -83,11 +177,24 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	lowmem_task_update(data, (int)val);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
 
+	lowmem_task_remove(task);
+
 	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
 		lowmem_print(2, "deathpending end %d (%s)\n",
@@ -133,12 +240,128 @@ static void dump_deathpending(struct task_struct *t_deathpending)
 	read_unlock(&tasklist_lock);
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+/*
+ * lowmem_select - pick the process with the highest oom_adj at or above
+ * 'min_adj' and, among those, the largest rss, from the oom_adj buckets.
+ * The victim is returned with a reference held.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj,
+					 int *tasksize)
+{
+	struct lowmem_task *lt, *next;
+	struct task_struct *p, *selected = NULL;
+	unsigned long flags;
+	LIST_HEAD(candidates);
+	int i, adj, size;
+
+	mutex_lock(&lowmem_select_lock);
+	for (i = LOWMEM_ADJ_BUCKETS - 1;
+	     i >= min_adj - OOM_DISABLE && !selected; i--) {
+		/*
+		 * The rss can only be read under task_lock, which must not
+		 * nest in lowmem_task_lock, so pin the bucket's tasks first.
+		 */
+		spin_lock_irqsave(&lowmem_task_lock, flags);
+		list_for_each_entry(lt, &lowmem_adj_bucket[i], adj_node)
+			if (atomic_inc_not_zero(&lt->task->usage))
+				list_add_tail(&lt->select_node, &candidates);
+		spin_unlock_irqrestore(&lowmem_task_lock, flags);
+
+		list_for_each_entry_safe(lt, next, &candidates, select_node) {
+			p = lt->task;
+			list_del(&lt->select_node);
+
+			task_lock(p);
+			if (!p->mm || !p->signal) {
+				task_unlock(p);
+				put_task_struct(p);
+				continue;
+			}
+			size = get_mm_rss(p->mm);
+			adj = p->signal->oom_adj;
+			task_unlock(p);
+			if (size <= 0 || adj < min_adj ||
+			    (selected && size <= *tasksize)) {
+				put_task_struct(p);
+				continue;
+			}
+			if (selected)
+				put_task_struct(selected);
+			selected = p;
+			*tasksize = size;
+			*oom_adj = adj;
+		}
+	}
+	mutex_unlock(&lowmem_select_lock);
+
+	if (selected)
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     selected->pid, selected->comm, *oom_adj,
+			     *tasksize);
+	return selected;
+}
+
+/*
+ * lowmem_select_scan - as lowmem_select, but walking every process. Used
+ * when the oom_adj index could not keep up with all of them.
+ */
+static struct task_struct *lowmem_select_scan(int min_adj, int *oom_adj,
+					      int *tasksize)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	int selected_tasksize = 0;
+	int selected_oom_adj = min_adj;
+	int size;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		struct mm_struct *mm;
+		struct signal_struct *sig;
+		int adj;
+
+		task_lock(p);
+		mm = p->mm;
+		sig = p->signal;
+		if (!mm || !sig) {
+			task_unlock(p);
+			continue;
+		}
+		adj = sig->oom_adj;
+		if (adj < min_adj) {
+			task_unlock(p);
+			continue;
+		}
+		size = get_mm_rss(mm);
+		task_unlock(p);
+		if (size <= 0)
+			continue;
+		if (selected) {
+			if (adj < selected_oom_adj)
+				continue;
+			if (adj == selected_oom_adj &&
+			    size <= selected_tasksize)
+				continue;
+		}
+		selected = p;
+		selected_tasksize = size;
+		selected_oom_adj = adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, adj, size);
+	}
+	if (selected)
+		get_task_struct(selected);
+	read_unlock(&tasklist_lock);
+
+	*oom_adj = selected_oom_adj;
+	*tasksize = selected_tasksize;
+	return selected;
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
@@ -150,6 +373,13 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int lru_file = global_page_state(NR_ACTIVE_FILE) +
 			global_page_state(NR_INACTIVE_FILE);
 
+	/*
+	 * A compressed cleancache backend holds clean page cache that it
+	 * gives back through its own shrinker, so count it as file pages
+	 * rather than kill for the memory it uses.
+	 */
+	other_file += cleancache_total_pages();
+
 	/*
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
@@ -191,55 +421,28 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	if (lowmem_index_incomplete)
+		selected = lowmem_select_scan(min_adj, &selected_oom_adj,
+					      &selected_tasksize);
+	else
+		selected = lowmem_select(min_adj, &selected_oom_adj,
+					 &selected_tasksize);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		read_lock(&tasklist_lock);
+		if (pid_alive(selected))
+			force_sig(SIGKILL, selected);
+		read_unlock(&tasklist_lock);
 		rem -= selected_tasksize;
+		put_task_struct(selected);
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -250,15 +453,42 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_bucket[i]);
+
 	task_free_register(&task_nb);
+	oom_adj_register(&oom_adj_nb);
+
+	/* index the processes that exist already */
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_task_update(p, p->signal->oom_adj);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *lt, *next;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	oom_adj_unregister(&oom_adj_nb);
 	task_free_unregister(&task_nb);
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(lt, next, &lowmem_adj_bucket[i],
+					 adj_node)
+			kmem_cache_free(lowmem_task_cachep, lt);
+	kmem_cache_destroy(lowmem_task_cachep);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
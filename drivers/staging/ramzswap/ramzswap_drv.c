@@ -20,11 +20,13 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/percpu.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -36,9 +38,31 @@
 static int ramzswap_major;
 static struct ramzswap *devices;
 
+/* Writeback does synchronous bio I/O, so keep it off keventd */
+static struct workqueue_struct *ramzswap_writeback_wq;
+
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
+/*
+ * Compressors from crypto/ a device can use. The index is the ID kept in
+ * the table flags of each page, so existing entries must not move.
+ */
+static const char * const compressors[RZS_MAX_COMPRESSORS] = {
+	"lzo",
+	"deflate",
+};
+
+static spinlock_t *rzs_table_lock(struct ramzswap *rzs, u32 index)
+{
+	return &rzs->table_lock[index & (RZS_TABLE_LOCKS - 1)];
+}
+
+static spinlock_t *rzs_handle_lock(struct ramzswap *rzs, u32 handle)
+{
+	return &rzs->handle_lock[handle & (RZS_HANDLE_LOCKS - 1)];
+}
+
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
 {
@@ -57,6 +81,72 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
+static int rzs_get_comp(struct ramzswap *rzs, u32 index)
+{
+	return (rzs->table[index].flags & RZS_COMP_MASK) >> RZS_COMP_SHIFT;
+}
+
+static void rzs_set_comp(struct ramzswap *rzs, u32 index, int comp_id)
+{
+	rzs->table[index].flags &= ~RZS_COMP_MASK;
+	rzs->table[index].flags |= comp_id << RZS_COMP_SHIFT;
+}
+
+static int find_compressor(const char *name)
+{
+	int i;
+
+	for (i = 0; i < RZS_MAX_COMPRESSORS; i++) {
+		if (compressors[i] && !strcmp(compressors[i], name))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Take a handle off the free list. Returns 0 if none is left, which
+ * can't happen unless objects leak: there is a handle for every table
+ * entry plus one for each compression stream, whose writer holds a new
+ * handle until the slot it overwrites gives up the old one.
+ */
+static u32 alloc_handle(struct ramzswap *rzs)
+{
+	u32 handle;
+
+	spin_lock(&rzs->handle_free_lock);
+	handle = rzs->handle_free;
+	if (handle)
+		rzs->handle_free = rzs->handles[handle].next_free;
+	spin_unlock(&rzs->handle_free_lock);
+
+	return handle;
+}
+
+static void free_handle(struct ramzswap *rzs, u32 handle)
+{
+	spin_lock(&rzs->handle_free_lock);
+	rzs->handles[handle].page = NULL;
+	rzs->handles[handle].next_free = rzs->handle_free;
+	rzs->handle_free = handle;
+	spin_unlock(&rzs->handle_free_lock);
+}
+
+/*
+ * Publish the location of a newly written object. From here on it is
+ * only moved by compaction, under the handle lock.
+ */
+static void set_handle(struct ramzswap *rzs, u32 handle,
+			struct page *page, u32 offset)
+{
+	spinlock_t *lock = rzs_handle_lock(rzs, handle);
+
+	spin_lock(lock);
+	rzs->handles[handle].page = page;
+	rzs->handles[handle].offset = offset;
+	spin_unlock(lock);
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -116,9 +206,9 @@ static void setup_swap_header(struct ramzswap *rzs, union swap_header *s)
 }
 
 static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
-			struct ramzswap_ioctl_stats *s)
+			struct ramzswap_ioctl_stats_ext *s)
 {
-	s->disksize = rzs->disksize;
+	s->stats.disksize = rzs->disksize;
 
 #if defined(CONFIG_RAMZSWAP_STATS)
 	{
@@ -138,68 +228,170 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 					/ rs->pages_stored;
 	}
 
-	s->num_reads = rzs_stat64_read(rzs, &rs->num_reads);
-	s->num_writes = rzs_stat64_read(rzs, &rs->num_writes);
-	s->failed_reads = rzs_stat64_read(rzs, &rs->failed_reads);
-	s->failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
-	s->invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
-	s->notify_free = rzs_stat64_read(rzs, &rs->notify_free);
-	s->pages_zero = rs->pages_zero;
-
-	s->good_compress_pct = good_compress_perc;
-	s->pages_expand_pct = no_compress_perc;
-
-	s->pages_stored = rs->pages_stored;
-	s->pages_used = mem_used >> PAGE_SHIFT;
-	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
-	s->compr_data_size = rs->compr_size;
-	s->mem_used_total = mem_used;
+	s->stats.num_reads = rzs_stat64_read(rzs, &rs->num_reads);
+	s->stats.num_writes = rzs_stat64_read(rzs, &rs->num_writes);
+	s->stats.failed_reads = rzs_stat64_read(rzs, &rs->failed_reads);
+	s->stats.failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
+	s->stats.invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
+	s->stats.notify_free = rzs_stat64_read(rzs, &rs->notify_free);
+	s->stats.pages_zero = rs->pages_zero;
+
+	s->stats.good_compress_pct = good_compress_perc;
+	s->stats.pages_expand_pct = no_compress_perc;
+
+	s->stats.pages_stored = rs->pages_stored;
+	s->stats.pages_used = mem_used >> PAGE_SHIFT;
+	s->stats.orig_data_size = rs->pages_stored << PAGE_SHIFT;
+	s->stats.compr_data_size = rs->compr_size;
+	s->stats.mem_used_total = mem_used;
+
+	s->dedup_hits = rzs_stat64_read(rzs, &rs->dedup_hits);
+	s->pages_dedup = rs->pages_dedup;
+
+	s->bdev_num_reads = rzs_stat64_read(rzs, &rs->bdev_num_reads);
+	s->bdev_num_writes = rzs_stat64_read(rzs, &rs->bdev_num_writes);
+	s->bdev_failed_writes = rzs_stat64_read(rzs,
+					&rs->bdev_failed_writes);
+	s->pages_backed = rs->pages_backed;
+
+	s->pool_pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	s->pool_used_bytes = xv_get_used_size_bytes(rzs->mem_pool);
+	if (s->pool_pages)
+		s->pool_frag_pct = 100 - div64_u64(s->pool_used_bytes * 100,
+					s->pool_pages << PAGE_SHIFT);
+	s->num_compactions = rzs_stat64_read(rzs, &rs->num_compactions);
+	s->pages_compacted = rzs_stat64_read(rzs, &rs->pages_compacted);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
+/*
+ * Called with the table lock of 'index' held.
+ */
 static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
-	u32 clen;
+	u32 clen, offset;
 	void *obj;
+	int last;
+	struct page *page;
+	spinlock_t *lock;
+
+	u32 handle = rzs->table[index].handle;
 
-	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+	/* Make an in-flight writeback of this entry back off */
+	rzs_clear_flag(rzs, index, RZS_WRITEBACK);
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
 		 */
 		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
 			rzs_clear_flag(rzs, index, RZS_ZERO);
-			rzs_stat_dec(&rzs->stats.pages_zero);
+			rzs_stat_dec(rzs, &rzs->stats.pages_zero);
+		}
+		/* Its slot on the backing device is simply reused */
+		if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+			rzs_clear_flag(rzs, index, RZS_BACKED);
+			rzs_stat_dec(rzs, &rzs->stats.pages_backed);
 		}
 		return;
 	}
 
+	/* Uncompressed pages are not in the pool and never move */
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(rzs->handles[handle].page);
+		free_handle(rzs, handle);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
-		rzs_stat_dec(&rzs->stats.pages_expand);
+		rzs_stat_dec(rzs, &rzs->stats.pages_expand);
 		goto out;
 	}
 
+	/*
+	 * The count is read and written under the handle lock so that
+	 * compaction does not copy the object from under an update.
+	 */
+	lock = rzs_handle_lock(rzs, handle);
+	spin_lock(lock);
+	page = rzs->handles[handle].page;
+	offset = rzs->handles[handle].offset;
 	obj = kmap_atomic(page, KM_USER0) + offset;
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	last = atomic_dec_and_test(&((struct zobj_header *)obj)->count);
 	kunmap_atomic(obj, KM_USER0);
+	if (last)
+		rzs->handles[handle].page = NULL;
+	spin_unlock(lock);
 
-	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
-		rzs_stat_dec(&rzs->stats.good_compress);
+		rzs_stat_dec(rzs, &rzs->stats.good_compress);
+
+	/* Other pages still share this object */
+	if (!last) {
+		rzs_stat_dec(rzs, &rzs->stats.pages_dedup);
+		rzs_stat_dec(rzs, &rzs->stats.pages_stored);
+		goto clear;
+	}
+
+	xv_free(rzs->mem_pool, page, offset);
+	free_handle(rzs, handle);
 
 out:
+	spin_lock(&rzs->stat_lock);
 	rzs->stats.compr_size -= clen;
-	rzs_stat_dec(&rzs->stats.pages_stored);
+	spin_unlock(&rzs->stat_lock);
+	rzs_stat_dec(rzs, &rzs->stats.pages_stored);
+
+clear:
+	rzs->table[index].handle = 0;
+}
+
+/*
+ * Look for a stored object with the same compressed contents as 'src',
+ * starting from the page the dedup index remembers for them. If found,
+ * a reference is taken on it and its location returned.
+ */
+static u32 find_dup_object(struct ramzswap *rzs, int comp_id,
+			unsigned char *src, unsigned int clen)
+{
+	u32 index, handle, found = 0;
+	spinlock_t *lock, *hlock;
+	unsigned char *cmem;
+	struct zobj_header *zheader;
+	struct rzs_handle *h;
+
+	index = ACCESS_ONCE(rzs->dedup_index[
+			jhash(src, clen, comp_id) & rzs->dedup_mask]);
+	lock = rzs_table_lock(rzs, index);
+
+	spin_lock(lock);
+
+	handle = rzs->table[index].handle;
+	if (!handle ||
+	    rzs_test_flag(rzs, index, RZS_UNCOMPRESSED) ||
+	    rzs_get_comp(rzs, index) != comp_id)
+		goto out;
+
+	h = &rzs->handles[handle];
+	hlock = rzs_handle_lock(rzs, handle);
+	spin_lock(hlock);
+
+	cmem = kmap_atomic(h->page, KM_USER1) + h->offset;
+	zheader = (struct zobj_header *)cmem;
+
+	if (xv_get_object_size(cmem) == clen + sizeof(*zheader) &&
+	    !memcmp(cmem + sizeof(*zheader), src, clen)) {
+		/* Can't drop to zero: this entry holds a reference */
+		atomic_inc(&zheader->count);
+		found = handle;
+	}
 
-	rzs->table[index].page = NULL;
-	rzs->table[index].offset = 0;
+	kunmap_atomic(cmem, KM_USER1);
+	spin_unlock(hlock);
+out:
+	spin_unlock(lock);
+	return found;
 }
 
 static int handle_zero_page(struct bio *bio)
@@ -228,8 +420,8 @@ static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(rzs->handles[rzs->table[index].handle].page,
+			KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -261,47 +453,60 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
-static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
+/*
+ * Decompress the object of table entry 'index' into 'dst'. Called with
+ * the table lock of 'index' held, so this CPU's decompressors are ours.
+ */
+static int decompress_entry(struct ramzswap *rzs, u32 index, void *dst)
 {
 	int ret;
-	u32 index;
-	size_t clen;
-	struct page *page;
+	unsigned int clen;
+	struct crypto_comp *tfm;
 	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem;
+	struct rzs_handle *h;
+	unsigned char *cmem;
+	spinlock_t *lock;
+	u32 handle = rzs->table[index].handle;
 
-	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
+	tfm = per_cpu_ptr(rzs->dstreams, smp_processor_id())->tfm[
+			rzs_get_comp(rzs, index)];
 
-	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	clen = PAGE_SIZE;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
-		return handle_zero_page(bio);
+	/* Keep compaction from moving the object while we read it */
+	h = &rzs->handles[handle];
+	lock = rzs_handle_lock(rzs, handle);
+	spin_lock(lock);
 
-	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
-		return handle_ramzswap_fault(rzs, bio);
+	cmem = kmap_atomic(h->page, KM_USER1) + h->offset;
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	ret = crypto_comp_decompress(tfm,
+		cmem + sizeof(*zheader),
+		xv_get_object_size(cmem) - sizeof(*zheader),
+		dst, &clen);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	kunmap_atomic(cmem, KM_USER1);
+	spin_unlock(lock);
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	return ret;
+}
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+static int handle_compressed_page(struct ramzswap *rzs, struct bio *bio)
+{
+	int ret;
+	u32 index;
+	struct page *page;
+	unsigned char *user_mem;
+
+	page = bio->bi_io_vec[0].bv_page;
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = decompress_entry(rzs, index, user_mem);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -319,43 +524,100 @@ out:
 	return 0;
 }
 
-static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
+static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 offset, index;
-	size_t clen;
+	u32 index;
+	spinlock_t *lock;
+
+	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	lock = rzs_table_lock(rzs, index);
+
+	/* Keep the entry from being freed or replaced while we copy it */
+	spin_lock(lock);
+
+	/*
+	 * Written back pages sit at the same sector of the backing
+	 * device, so just send the bio there.
+	 */
+	if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+		spin_unlock(lock);
+		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_reads);
+		bio->bi_bdev = rzs->backing_swap;
+		generic_make_request(bio);
+		return 0;
+	}
+
+	rzs->table[index].age = 0;
+
+	if (rzs_test_flag(rzs, index, RZS_ZERO))
+		ret = handle_zero_page(bio);
+
+	/* Requested page is not present in compressed area */
+	else if (!rzs->table[index].handle)
+		ret = handle_ramzswap_fault(rzs, bio);
+
+	/* Page is stored uncompressed since it's incompressible */
+	else if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+		ret = handle_uncompressed_page(rzs, bio);
+
+	else
+		ret = handle_compressed_page(rzs, bio);
+
+	spin_unlock(lock);
+	return ret;
+}
+
+static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
+{
+	int ret, comp_id, uncompressed = 0, shared = 0;
+	u32 offset, index, handle;
+	unsigned int clen;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct ramzswap_stream *stream;
 	unsigned char *user_mem, *cmem, *src;
+	spinlock_t *lock;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
+	lock = rzs_table_lock(rzs, index);
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
+		spin_lock(lock);
+		ramzswap_free_page(rzs, index);
 		rzs_set_flag(rzs, index, RZS_ZERO);
+		spin_unlock(lock);
+		rzs_stat_inc(rzs, &rzs->stats.pages_zero);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	stream = per_cpu_ptr(rzs->streams, raw_smp_processor_id());
+	mutex_lock(&stream->lock);
+	src = stream->buffer;
+	clen = 2 * PAGE_SIZE;
 
+	/* Pairs with smp_wmb() in alloc_compressor() */
+	comp_id = rzs->comp_id;
+	smp_rmb();
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(stream->tfm[comp_id], user_mem, PAGE_SIZE,
+				src, &clen);
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	if (unlikely(ret)) {
+		mutex_unlock(&stream->lock);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -370,7 +632,7 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
+			mutex_unlock(&stream->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -378,51 +640,97 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		}
 
 		offset = 0;
-		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
-		rzs_stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
+		uncompressed = 1;
 		src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
+	handle = find_dup_object(rzs, comp_id, src, clen);
+	if (handle) {
+		mutex_unlock(&stream->lock);
+		shared = 1;
+		goto install;
+	}
+
 	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
+			&page_store, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
 
 memstore:
-	rzs->table[index].offset = offset;
+	handle = alloc_handle(rzs);
+	if (unlikely(!handle)) {
+		mutex_unlock(&stream->lock);
+		pr_err("Out of handles for page: %u\n", index);
+		if (uncompressed) {
+			kunmap_atomic(src, KM_USER0);
+			__free_page(page_store);
+		} else {
+			xv_free(rzs->mem_pool, page_store, offset);
+		}
+		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
+		goto out;
+	}
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+	if (!uncompressed) {
 		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
+		zheader->handle = handle;
+		atomic_set(&zheader->count, 1);
 		cmem += sizeof(*zheader);
+
+		/* Let later writes of the same contents find this page */
+		rzs->dedup_index[jhash(src, clen, comp_id) &
+				 rzs->dedup_mask] = index;
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+	if (unlikely(uncompressed))
 		kunmap_atomic(src, KM_USER0);
 
-	/* Update stats */
-	rzs->stats.compr_size += clen;
-	rzs_stat_inc(&rzs->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		rzs_stat_inc(&rzs->stats.good_compress);
+	set_handle(rzs, handle, page_store, offset);
 
-	mutex_unlock(&rzs->lock);
+install:
+	/* Replace whatever this slot held before */
+	spin_lock(lock);
+	ramzswap_free_page(rzs, index);
+	rzs->table[index].handle = handle;
+	rzs->table[index].age = 0;
+	if (unlikely(uncompressed))
+		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+	else
+		rzs_set_comp(rzs, index, comp_id);
+	spin_unlock(lock);
+
+	/*
+	 * The old handle is free again, so let the next writer on this
+	 * stream take one. This bounds the handles in flight.
+	 */
+	if (!shared)
+		mutex_unlock(&stream->lock);
+
+	/* Update stats */
+	if (shared) {
+		rzs_stat64_inc(rzs, &rzs->stats.dedup_hits);
+		rzs_stat_inc(rzs, &rzs->stats.pages_dedup);
+	} else {
+		spin_lock(&rzs->stat_lock);
+		rzs->stats.compr_size += clen;
+		spin_unlock(&rzs->stat_lock);
+	}
+	rzs_stat_inc(rzs, &rzs->stats.pages_stored);
+	if (unlikely(uncompressed))
+		rzs_stat_inc(rzs, &rzs->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		rzs_stat_inc(rzs, &rzs->stats.good_compress);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -433,6 +741,300 @@ out:
 	return 0;
 }
 
+static void backing_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int backing_write_page(struct ramzswap *rzs, u32 index,
+			struct page *page)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = rzs->backing_swap;
+	bio->bi_sector = index << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = backing_end_io;
+	bio->bi_private = &done;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Move the page of table entry 'index' to the backing device, using
+ * 'buf' to hold its uncompressed contents. The entry stays readable
+ * from memory until the write completes. If it is freed or rewritten
+ * meanwhile, RZS_WRITEBACK is gone and the written copy is dropped.
+ */
+static void writeback_page(struct ramzswap *rzs, u32 index, struct page *buf)
+{
+	int ret;
+	void *dst, *src;
+	spinlock_t *lock = rzs_table_lock(rzs, index);
+
+	spin_lock(lock);
+	if (!rzs->table[index].handle ||
+	    rzs_test_flag(rzs, index, RZS_WRITEBACK)) {
+		spin_unlock(lock);
+		return;
+	}
+
+	dst = kmap_atomic(buf, KM_USER0);
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		src = kmap_atomic(rzs->handles[rzs->table[index].handle].page,
+				KM_USER1);
+		memcpy(dst, src, PAGE_SIZE);
+		kunmap_atomic(src, KM_USER1);
+		ret = 0;
+	} else {
+		ret = decompress_entry(rzs, index, dst);
+	}
+	kunmap_atomic(dst, KM_USER0);
+
+	if (!ret)
+		rzs_set_flag(rzs, index, RZS_WRITEBACK);
+	spin_unlock(lock);
+
+	if (ret)
+		return;
+
+	ret = backing_write_page(rzs, index, buf);
+
+	spin_lock(lock);
+	if (rzs_test_flag(rzs, index, RZS_WRITEBACK)) {
+		if (!ret) {
+			ramzswap_free_page(rzs, index);
+			rzs_set_flag(rzs, index, RZS_BACKED);
+			rzs_stat_inc(rzs, &rzs->stats.pages_backed);
+		} else {
+			rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+		}
+	}
+	spin_unlock(lock);
+
+	if (ret) {
+		pr_info("Error writing back page: %u, err=%d\n", index, ret);
+		rzs_stat64_inc(rzs, &rzs->stats.bdev_failed_writes);
+	} else {
+		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_writes);
+	}
+}
+
+/*
+ * Runs every RZS_AGE_INTERVAL while a backing device is set. Ages all
+ * pages held in memory and writes back the incompressible ones and
+ * those idle for writeback_age seconds.
+ */
+static void writeback_work_fn(struct work_struct *work)
+{
+	u32 index, max_age;
+	struct page *buf;
+	struct ramzswap *rzs = container_of(to_delayed_work(work),
+					struct ramzswap, writeback_work);
+
+	buf = alloc_page(GFP_KERNEL);
+	if (!buf)
+		goto out;
+
+	max_age = rzs->writeback_age * HZ / RZS_AGE_INTERVAL;
+	max_age = min_t(u32, max_age, RZS_MAX_AGE);
+
+	/* Page 0 is the swap header */
+	for (index = 1; index < rzs->disksize >> PAGE_SHIFT; index++) {
+		spinlock_t *lock = rzs_table_lock(rzs, index);
+		int cold;
+
+		spin_lock(lock);
+		if (!rzs->table[index].handle) {
+			spin_unlock(lock);
+			continue;
+		}
+		if (rzs->table[index].age < RZS_MAX_AGE)
+			rzs->table[index].age++;
+		cold = rzs_test_flag(rzs, index, RZS_UNCOMPRESSED) ||
+			(max_age && rzs->table[index].age >= max_age);
+		spin_unlock(lock);
+
+		if (cold)
+			writeback_page(rzs, index, buf);
+
+		cond_resched();
+	}
+
+	__free_page(buf);
+out:
+	queue_delayed_work(ramzswap_writeback_wq, &rzs->writeback_work,
+			   RZS_AGE_INTERVAL);
+}
+
+/*
+ * Move the object at <obj->page, obj->offset> to a new location and
+ * point its handle there. The object may be freed, or already moved,
+ * at any time before we take the handle lock, so obj is only a hint
+ * until checked against the handle.
+ */
+static int migrate_object(struct ramzswap *rzs, struct xv_object *obj)
+{
+	u32 size, offset, handle = obj->tag;
+	struct page *page;
+	struct rzs_handle *h;
+	spinlock_t *lock;
+	unsigned char *src, *dst;
+
+	if (!handle || handle > rzs->nr_handles)
+		return -EINVAL;
+
+	h = &rzs->handles[handle];
+	lock = rzs_handle_lock(rzs, handle);
+
+	spin_lock(lock);
+	if (h->page != obj->page || h->offset != obj->offset) {
+		spin_unlock(lock);
+		return -EAGAIN;
+	}
+	src = kmap_atomic(obj->page, KM_USER0) + obj->offset;
+	size = xv_get_object_size(src);
+	kunmap_atomic(src, KM_USER0);
+	spin_unlock(lock);
+
+	/* Isolated pages are not allocated from, so this lands elsewhere */
+	if (xv_malloc(rzs->mem_pool, size, &page, &offset,
+			GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN))
+		return -ENOMEM;
+
+	spin_lock(lock);
+	if (h->page != obj->page || h->offset != obj->offset) {
+		spin_unlock(lock);
+		xv_free(rzs->mem_pool, page, offset);
+		return -EAGAIN;
+	}
+	src = kmap_atomic(obj->page, KM_USER0) + obj->offset;
+	dst = kmap_atomic(page, KM_USER1) + offset;
+	memcpy(dst, src, size);
+	kunmap_atomic(dst, KM_USER1);
+	kunmap_atomic(src, KM_USER0);
+	h->page = page;
+	h->offset = offset;
+	spin_unlock(lock);
+
+	xv_free(rzs->mem_pool, obj->page, obj->offset);
+	return 0;
+}
+
+/*
+ * Compaction pass: isolate pool pages that are at most a quarter used
+ * and move their objects to the remaining pages. An isolated page is
+ * freed by xv_free() as soon as its last object is gone; pages whose
+ * objects could not all be moved are handed back to the allocator.
+ */
+static void compact_work_fn(struct work_struct *work)
+{
+	int i, nr, moved;
+	u64 pages_before, pages_after;
+	struct xv_object *objs;
+	struct ramzswap *rzs = container_of(to_delayed_work(work),
+					struct ramzswap, compact_work);
+
+	objs = kmalloc(RZS_COMPACT_BATCH * sizeof(*objs), GFP_KERNEL);
+	if (!objs)
+		return;
+
+	pages_before = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+
+	if (!xv_isolate_pages(rzs->mem_pool, PAGE_SIZE / 4, RZS_COMPACT_PAGES))
+		goto out;
+
+	/* Stop once a batch makes no progress, e.g. on allocation failure */
+	do {
+		moved = 0;
+		nr = xv_isolated_objects(rzs->mem_pool, objs,
+					RZS_COMPACT_BATCH);
+		for (i = 0; i < nr; i++) {
+			if (!migrate_object(rzs, &objs[i]))
+				moved++;
+		}
+		cond_resched();
+	} while (nr && moved);
+
+	xv_putback_pages(rzs->mem_pool);
+
+	pages_after = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	rzs_stat64_inc(rzs, &rzs->stats.num_compactions);
+#if defined(CONFIG_RAMZSWAP_STATS)
+	if (pages_after < pages_before) {
+		spin_lock(&rzs->stat_lock);
+		rzs->stats.pages_compacted += pages_before - pages_after;
+		spin_unlock(&rzs->stat_lock);
+	}
+#endif
+
+out:
+	kfree(objs);
+}
+
+/*
+ * Called as pages are freed. Schedules compaction when the pool has
+ * grown sparse enough for it to be worth a pass.
+ */
+static void ramzswap_check_compact(struct ramzswap *rzs)
+{
+	u64 total, used;
+
+	if (!rzs->init_done)
+		return;
+
+	total = xv_get_total_size_bytes(rzs->mem_pool);
+	used = xv_get_used_size_bytes(rzs->mem_pool);
+
+	if (total < RZS_COMPACT_MIN_PAGES << PAGE_SHIFT ||
+	    used * 100 >= total * compact_used_perc)
+		return;
+
+	if (!delayed_work_pending(&rzs->compact_work))
+		schedule_delayed_work(&rzs->compact_work, RZS_COMPACT_DELAY);
+}
+
+static int open_backing_swap(struct ramzswap *rzs)
+{
+	struct block_device *bdev;
+	size_t size;
+
+	bdev = open_bdev_exclusive(rzs->backing_swap_name,
+				FMODE_READ | FMODE_WRITE, rzs);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device %s\n",
+			rzs->backing_swap_name);
+		return PTR_ERR(bdev);
+	}
+
+	/* Pages are written back to the sector they were swapped to */
+	size = i_size_read(bdev->bd_inode) & PAGE_MASK;
+	if (!rzs->disksize) {
+		rzs->disksize = size;
+	} else if (size < rzs->disksize) {
+		pr_err("Backing device %s smaller than disksize\n",
+			rzs->backing_swap_name);
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -EINVAL;
+	}
+
+	rzs->backing_swap = bdev;
+	pr_info("Using backing device %s\n", rzs->backing_swap_name);
+	return 0;
+}
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -484,6 +1086,107 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void free_compressor(struct ramzswap *rzs, int comp_id)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+		struct ramzswap_dstream *dstream =
+				per_cpu_ptr(rzs->dstreams, cpu);
+
+		if (stream->tfm[comp_id])
+			crypto_free_comp(stream->tfm[comp_id]);
+		if (dstream->tfm[comp_id])
+			crypto_free_comp(dstream->tfm[comp_id]);
+		stream->tfm[comp_id] = NULL;
+		dstream->tfm[comp_id] = NULL;
+	}
+
+	clear_bit(comp_id, &rzs->comp_mask);
+}
+
+/*
+ * Allocate the per-cpu transforms for compressor 'comp_id'. Once set up,
+ * a compressor stays until the device is reset since pages written with
+ * it may still be stored.
+ */
+static int alloc_compressor(struct ramzswap *rzs, int comp_id)
+{
+	int cpu, ret;
+	struct crypto_comp *tfm;
+
+	if (test_bit(comp_id, &rzs->comp_mask))
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(compressors[comp_id], 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		per_cpu_ptr(rzs->streams, cpu)->tfm[comp_id] = tfm;
+
+		tfm = crypto_alloc_comp(compressors[comp_id], 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		per_cpu_ptr(rzs->dstreams, cpu)->tfm[comp_id] = tfm;
+	}
+
+	/* Transforms must be visible before any page tagged with comp_id */
+	smp_wmb();
+	set_bit(comp_id, &rzs->comp_mask);
+	return 0;
+
+fail:
+	ret = PTR_ERR(tfm);
+	free_compressor(rzs, comp_id);
+	return ret;
+}
+
+static void free_streams(struct ramzswap *rzs)
+{
+	int cpu, comp_id;
+
+	if (!rzs->streams || !rzs->dstreams)
+		goto out;
+
+	for (comp_id = 0; comp_id < RZS_MAX_COMPRESSORS; comp_id++)
+		free_compressor(rzs, comp_id);
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		free_pages((unsigned long)stream->buffer, 1);
+	}
+
+out:
+	free_percpu(rzs->streams);
+	free_percpu(rzs->dstreams);
+	rzs->streams = NULL;
+	rzs->dstreams = NULL;
+}
+
+static int alloc_streams(struct ramzswap *rzs)
+{
+	int cpu;
+
+	rzs->streams = alloc_percpu(struct ramzswap_stream);
+	rzs->dstreams = alloc_percpu(struct ramzswap_dstream);
+	if (!rzs->streams || !rzs->dstreams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->buffer = (void *)__get_free_pages(GFP_KERNEL |
+							  __GFP_ZERO, 1);
+		if (!stream->buffer)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static void reset_device(struct ramzswap *rzs)
 {
 	size_t index;
@@ -491,33 +1194,38 @@ static void reset_device(struct ramzswap *rzs)
 	/* Do not accept any new I/O request */
 	rzs->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
-
-	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	cancel_delayed_work_sync(&rzs->compact_work);
 
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
+	if (rzs->backing_swap) {
+		cancel_delayed_work_sync(&rzs->writeback_work);
+		close_bdev_exclusive(rzs->backing_swap,
+				FMODE_READ | FMODE_WRITE);
+		rzs->backing_swap = NULL;
+	}
 
-		if (!page)
-			continue;
+	/* Free various per-device buffers */
+	free_streams(rzs);
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+	/*
+	 * Free all pages that are still in this ramzswap device. Objects
+	 * may be shared, so go through the reference counts.
+	 */
+	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
+		if (rzs->table[index].handle)
+			ramzswap_free_page(rzs, index);
 	}
 
 	vfree(rzs->table);
 	rzs->table = NULL;
 
+	vfree(rzs->handles);
+	rzs->handles = NULL;
+	rzs->nr_handles = 0;
+	rzs->handle_free = 0;
+
+	vfree(rzs->dedup_index);
+	rzs->dedup_index = NULL;
+
 	xv_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
@@ -525,12 +1233,13 @@ static void reset_device(struct ramzswap *rzs)
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
 
 	rzs->disksize = 0;
+	rzs->comp_id = 0;
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret;
-	size_t num_pages;
+	size_t i, num_pages;
 	struct page *page;
 	union swap_header *swap_header;
 
@@ -539,19 +1248,24 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		return -EBUSY;
 	}
 
+	if (rzs->backing_swap_name[0]) {
+		ret = open_backing_swap(rzs);
+		if (ret)
+			goto fail;
+	}
+
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
+	ret = alloc_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating compressor streams!\n");
 		goto fail;
 	}
 
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = alloc_compressor(rzs, rzs->comp_id);
+	if (ret) {
+		pr_err("Error allocating %s compressor: err=%d\n",
+			compressors[rzs->comp_id], ret);
 		goto fail;
 	}
 
@@ -566,13 +1280,47 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	/*
+	 * Every table entry may reference its own object, and a writer
+	 * takes the handle for its new object before freeing the one the
+	 * slot held. Writers hold their compression stream until then, so
+	 * one spare handle per stream is enough. Handle 0 means "none".
+	 */
+	rzs->nr_handles = num_pages + num_possible_cpus();
+	rzs->handles = vmalloc((rzs->nr_handles + 1) * sizeof(*rzs->handles));
+	if (!rzs->handles) {
+		pr_err("Error allocating ramzswap handles\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->handles, 0, (rzs->nr_handles + 1) * sizeof(*rzs->handles));
+	for (i = rzs->nr_handles; i > 0; i--)
+		free_handle(rzs, i);
+
+	/*
+	 * About one index slot per four pages. Slots start out pointing
+	 * at page 0, the swap header, which never matches.
+	 */
+	rzs->dedup_mask = roundup_pow_of_two(max_t(size_t, num_pages / 4,
+						   1)) - 1;
+	rzs->dedup_index = vmalloc((rzs->dedup_mask + 1) *
+				   sizeof(*rzs->dedup_index));
+	if (!rzs->dedup_index) {
+		pr_err("Error allocating ramzswap dedup index\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->dedup_index, 0,
+	       (rzs->dedup_mask + 1) * sizeof(*rzs->dedup_index));
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
-	rzs->table[0].page = page;
+	rzs->table[0].handle = alloc_handle(rzs);
+	rzs->handles[rzs->table[0].handle].page = page;
 	rzs_set_flag(rzs, 0, RZS_UNCOMPRESSED);
 
 	swap_header = kmap(page);
@@ -593,6 +1341,10 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	rzs->init_done = 1;
 
+	if (rzs->backing_swap)
+		queue_delayed_work(ramzswap_writeback_wq, &rzs->writeback_work,
+				   RZS_AGE_INTERVAL);
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -635,8 +1387,9 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		break;
 
 	case RZSIO_GET_STATS:
+	case RZSIO_GET_STATS_EXT:
 	{
-		struct ramzswap_ioctl_stats *stats;
+		struct ramzswap_ioctl_stats_ext *stats;
 		if (!rzs->init_done) {
 			ret = -ENOTTY;
 			goto out;
@@ -647,7 +1400,8 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			goto out;
 		}
 		ramzswap_ioctl_get_stats(rzs, stats);
-		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+		/* The old stats are a prefix of the extended ones */
+		if (copy_to_user((void *)arg, stats, _IOC_SIZE(cmd))) {
 			kfree(stats);
 			ret = -EFAULT;
 			goto out;
@@ -655,8 +1409,71 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[RZS_COMP_NAME_LEN];
+		int comp_id;
+
+		if (copy_from_user(name, (void *)arg, sizeof(name))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[sizeof(name) - 1] = '\0';
+
+		comp_id = find_compressor(name);
+		if (comp_id < 0) {
+			pr_info("Unknown compressor %s\n", name);
+			ret = comp_id;
+			goto out;
+		}
+
+		/*
+		 * An initialized device switches for new pages only and
+		 * keeps reading old ones with their own compressor.
+		 */
+		mutex_lock(&rzs->lock);
+		if (rzs->init_done)
+			ret = alloc_compressor(rzs, comp_id);
+		if (!ret) {
+			rzs->comp_id = comp_id;
+			pr_info("Compressor set to %s\n", name);
+		}
+		mutex_unlock(&rzs->lock);
+		break;
+	}
+	case RZSIO_SET_BACKING_SWAP:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		mutex_lock(&rzs->lock);
+		if (copy_from_user(rzs->backing_swap_name, (void *)arg,
+				sizeof(rzs->backing_swap_name)))
+			ret = -EFAULT;
+		rzs->backing_swap_name[sizeof(rzs->backing_swap_name) - 1] =
+									'\0';
+		mutex_unlock(&rzs->lock);
+		break;
+
+	case RZSIO_SET_WRITEBACK_AGE:
+	{
+		u32 age;
+
+		if (copy_from_user(&age, (void *)arg, sizeof(age))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		age = min_t(u32, age, RZS_MAX_WRITEBACK_AGE);
+		mutex_lock(&rzs->lock);
+		rzs->writeback_age = age;
+		mutex_unlock(&rzs->lock);
+		pr_info("Writeback age set to %u s\n", age);
+		break;
+	}
 	case RZSIO_INIT:
+		mutex_lock(&rzs->lock);
 		ret = ramzswap_ioctl_init_device(rzs);
+		mutex_unlock(&rzs->lock);
 		break;
 
 	case RZSIO_RESET:
@@ -670,7 +1487,9 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		if (bdev)
 			fsync_bdev(bdev);
 
+		mutex_lock(&rzs->lock);
 		ret = ramzswap_ioctl_reset_device(rzs);
+		mutex_unlock(&rzs->lock);
 		break;
 
 	default:
@@ -687,9 +1506,13 @@ void ramzswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct ramzswap *rzs;
 
 	rzs = bdev->bd_disk->private_data;
+	spin_lock(rzs_table_lock(rzs, index));
 	ramzswap_free_page(rzs, index);
+	spin_unlock(rzs_table_lock(rzs, index));
 	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
 
+	ramzswap_check_compact(rzs);
+
 	return;
 }
 
@@ -701,10 +1524,18 @@ static struct block_device_operations ramzswap_devops = {
 
 static int create_device(struct ramzswap *rzs, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
 	mutex_init(&rzs->lock);
-	spin_lock_init(&rzs->stat64_lock);
+	INIT_DELAYED_WORK(&rzs->writeback_work, writeback_work_fn);
+	INIT_DELAYED_WORK(&rzs->compact_work, compact_work_fn);
+	rzs->writeback_age = default_writeback_age;
+	for (i = 0; i < RZS_TABLE_LOCKS; i++)
+		spin_lock_init(&rzs->table_lock[i]);
+	for (i = 0; i < RZS_HANDLE_LOCKS; i++)
+		spin_lock_init(&rzs->handle_lock[i]);
+	spin_lock_init(&rzs->handle_free_lock);
+	spin_lock_init(&rzs->stat_lock);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
@@ -770,11 +1601,17 @@ static int __init ramzswap_init(void)
 		goto out;
 	}
 
+	ramzswap_writeback_wq = create_singlethread_workqueue("ramzswap");
+	if (!ramzswap_writeback_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ramzswap_major = register_blkdev(0, "ramzswap");
 	if (ramzswap_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -803,6 +1640,8 @@ free_devices:
 		destroy_device(&devices[--dev_id]);
 unregister:
 	unregister_blkdev(ramzswap_major, "ramzswap");
+destroy_wq:
+	destroy_workqueue(ramzswap_writeback_wq);
 out:
 	return ret;
 }
@@ -821,6 +1660,7 @@ static void __exit ramzswap_exit(void)
 	}
 
 	unregister_blkdev(ramzswap_major, "ramzswap");
+	destroy_workqueue(ramzswap_writeback_wq);
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
@@ -17,6 +17,7 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -30,13 +31,14 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * handle is the back-reference compaction uses to find the owner of an
+ * object it moves, so it must stay first: xv_isolated_objects() reports
+ * the first u32 of each object. count is the no. of table entries
+ * sharing this object (see dedup_index).
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	u32 handle;
+	atomic_t count;
 };
 
 /*-- Configurable parameters */
@@ -50,6 +52,32 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * With a backing device, stored pages are aged once per this interval
+ * (in jiffies) and the ones found incompressible or idle for longer than
+ * writeback_age are written back.
+ */
+#define RZS_AGE_INTERVAL	(5 * HZ)
+#define RZS_MAX_AGE		255	/* table[].age is a u8 */
+
+/* Longest writeback age, in seconds, that the u8 page ages can count to */
+#define RZS_MAX_WRITEBACK_AGE	(RZS_MAX_AGE * RZS_AGE_INTERVAL / HZ)
+
+/* Default idle time in seconds before a page is written back */
+static const unsigned default_writeback_age = 60;
+
+/*
+ * Compaction is scheduled once the pool holds at least
+ * RZS_COMPACT_MIN_PAGES pages and less than compact_used_perc% of
+ * them is in use. A pass isolates up to RZS_COMPACT_PAGES pages which
+ * are at most a quarter full and moves their objects elsewhere.
+ */
+#define RZS_COMPACT_MIN_PAGES	64
+#define RZS_COMPACT_PAGES	256
+#define RZS_COMPACT_BATCH	64	/* objects looked up at a time */
+#define RZS_COMPACT_DELAY	(HZ)
+static const unsigned compact_used_perc = 75;
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
@@ -63,6 +91,15 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 
+/*
+ * Table entries are protected by a small array of spinlocks hashed by
+ * page no. Must be power of two.
+ */
+#define RZS_TABLE_LOCKS		64
+
+/* Same for handles, hashed by handle no. Must be power of two. */
+#define RZS_HANDLE_LOCKS	64
+
 /* Flags for ramzswap pages (table[page_no].flags) */
 enum rzs_pageflags {
 	/* Page is stored uncompressed */
@@ -71,9 +108,24 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page was written back and lives on the backing device */
+	RZS_BACKED,
+
+	/* Page is being written back; cleared if it is freed meanwhile */
+	RZS_WRITEBACK,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
+/*
+ * The compressor that wrote a page is kept in the top bits of its
+ * table flags, so that a device can switch compressors and still read
+ * back the pages written by the previous one.
+ */
+#define RZS_COMP_SHIFT		6
+#define RZS_COMP_MASK		(0x3 << RZS_COMP_SHIFT)
+#define RZS_MAX_COMPRESSORS	4
+
 /*-- Data structures */
 
 /*
@@ -81,12 +133,29 @@ enum rzs_pageflags {
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u32 handle;	/* 0: nothing stored in memory */
+	u16 pad;
+	u8 age;		/* aging passes since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Location of a stored object. Table entries refer to objects through
+ * handles so that compaction can move an object by updating a single
+ * place, whichever and however many table entries share it.
+ *
+ * Protected by the handle lock. Free handles are chained through
+ * next_free under handle_free_lock. Handle 0 is never used.
+ */
+struct rzs_handle {
+	union {
+		struct page *page;
+		u32 next_free;
+	};
+	u16 offset;
+	u16 pad;
+};
+
 struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
@@ -103,16 +172,58 @@ struct ramzswap_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 dedup_hits;		/* writes that reused a stored object */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 bdev_num_reads;	/* reads redirected to backing device */
+	u64 bdev_num_writes;	/* pages written back */
+	u64 bdev_failed_writes;
+	u32 pages_backed;	/* no. of pages on backing device */
+	u64 num_compactions;	/* compaction passes run */
+	u64 pages_compacted;	/* pool pages released by compaction */
 #endif
 };
 
+/*
+ * Compressor transforms and output buffer. There is one per possible
+ * CPU and writers use the one of the CPU they start on, so that writes
+ * from different CPUs compress in parallel. The mutex only matters if a
+ * writer is migrated or preempted while compressing.
+ */
+struct ramzswap_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm[RZS_MAX_COMPRESSORS];
+	void *buffer;		/* 2 pages: output can exceed PAGE_SIZE */
+};
+
+/*
+ * Decompressor transforms, one set per possible CPU. Only used under a
+ * table lock, so preemption is off and the CPU's set is not shared.
+ */
+struct ramzswap_dstream {
+	struct crypto_comp *tfm[RZS_MAX_COMPRESSORS];
+};
+
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct ramzswap_stream *streams;	/* per-cpu */
+	struct ramzswap_dstream *dstreams;	/* per-cpu */
+	int comp_id;		/* compressor used for new pages */
+	unsigned long comp_mask;	/* compressors with tfms allocated */
+	struct mutex lock;	/* serializes device configuration */
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	spinlock_t table_lock[RZS_TABLE_LOCKS];
+	struct rzs_handle *handles;	/* nr_handles + 1 */
+	u32 nr_handles;
+	spinlock_t handle_lock[RZS_HANDLE_LOCKS];
+	u32 handle_free;	/* head of free handle list */
+	spinlock_t handle_free_lock;
+	/*
+	 * Hash of compressed contents -> page no. that last stored them.
+	 * Only a hint: a candidate is checked under its table lock.
+	 */
+	u32 *dedup_index;
+	u32 dedup_mask;
+	spinlock_t stat_lock;	/* protect stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -123,6 +234,15 @@ struct ramzswap {
 	 */
 	size_t disksize;	/* bytes */
 
+	/* Optional device that takes incompressible and idle pages */
+	char backing_swap_name[RZS_BACKING_NAME_LEN];
+	struct block_device *backing_swap;
+	unsigned writeback_age;	/* seconds, 0: incompressible pages only */
+	struct delayed_work writeback_work;
+
+	/* Moves objects out of sparsely used pool pages */
+	struct delayed_work compact_work;
+
 	struct ramzswap_stats stats;
 };
 
@@ -130,36 +250,40 @@ struct ramzswap {
 
 /* Debugging and Stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
-static void rzs_stat_inc(u32 *v)
+static void rzs_stat_inc(struct ramzswap *rzs, u32 *v)
 {
+	spin_lock(&rzs->stat_lock);
 	*v = *v + 1;
+	spin_unlock(&rzs->stat_lock);
 }
 
-static void rzs_stat_dec(u32 *v)
+static void rzs_stat_dec(struct ramzswap *rzs, u32 *v)
 {
+	spin_lock(&rzs->stat_lock);
 	*v = *v - 1;
+	spin_unlock(&rzs->stat_lock);
 }
 
 static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
 {
-	spin_lock(&rzs->stat64_lock);
+	spin_lock(&rzs->stat_lock);
 	*v = *v + 1;
-	spin_unlock(&rzs->stat64_lock);
+	spin_unlock(&rzs->stat_lock);
 }
 
 static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
 
-	spin_lock(&rzs->stat64_lock);
+	spin_lock(&rzs->stat_lock);
 	val = *v;
-	spin_unlock(&rzs->stat64_lock);
+	spin_unlock(&rzs->stat_lock);
 
 	return val;
 }
 #else
-#define rzs_stat_inc(v)
-#define rzs_stat_dec(v)
+#define rzs_stat_inc(r, v)
+#define rzs_stat_dec(r, v)
 #define rzs_stat64_inc(r, v)
 #define rzs_stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
@@ -15,6 +15,9 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define RZS_COMP_NAME_LEN	16
+#define RZS_BACKING_NAME_LEN	64
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -34,9 +37,33 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * RZSIO_GET_STATS encodes the size of the struct above, so it cannot grow
+ * without breaking existing binaries. Newer counters come with
+ * RZSIO_GET_STATS_EXT, which returns the same stats followed by them.
+ */
+struct ramzswap_ioctl_stats_ext {
+	struct ramzswap_ioctl_stats stats;
+	u64 dedup_hits;		/* writes that reused a stored object */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 bdev_num_reads;	/* reads redirected to backing device */
+	u64 bdev_num_writes;	/* pages written back */
+	u64 bdev_failed_writes;
+	u32 pages_backed;	/* no. of pages on backing device */
+	u64 pool_pages;		/* pages held by the allocator */
+	u64 pool_used_bytes;	/* bytes allocated from those pages */
+	u32 pool_frag_pct;	/* % of pool memory not in use */
+	u64 num_compactions;	/* compaction passes run */
+	u64 pages_compacted;	/* pool pages released by compaction */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 4, char[RZS_COMP_NAME_LEN])
+#define RZSIO_SET_BACKING_SWAP	_IOW('z', 5, char[RZS_BACKING_NAME_LEN])
+#define RZSIO_SET_WRITEBACK_AGE	_IOW('z', 6, u32)
+#define RZSIO_GET_STATS_EXT	_IOR('z', 7, struct ramzswap_ioctl_stats_ext)
 
 #endif
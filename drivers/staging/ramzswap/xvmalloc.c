@@ -14,6 +14,7 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/module.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -284,9 +285,10 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
-	stat_inc(&pool->total_pages);
-
 	spin_lock(&pool->lock);
+	stat_inc(&pool->total_pages);
+	set_page_private(page, 0);
+	list_add(&page->lru, &pool->pages);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,14 +319,18 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
+	INIT_LIST_HEAD(&pool->isolated);
 
 	return pool;
 }
+EXPORT_SYMBOL_GPL(xv_create_pool);
 
 void xv_destroy_pool(struct xv_pool *pool)
 {
 	kfree(pool);
 }
+EXPORT_SYMBOL_GPL(xv_destroy_pool);
 
 /**
  * xv_malloc - Allocate block of given size from pool.
@@ -406,6 +412,9 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	block->size = origsize;
 	clear_flag(block, BLOCK_FREE);
 
+	set_page_private(*page, page_private(*page) + size + XV_ALIGN);
+	pool->used_bytes += origsize;
+
 	put_ptr_atomic(block, KM_USER0);
 	spin_unlock(&pool->lock);
 
@@ -413,12 +422,14 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	return 0;
 }
+EXPORT_SYMBOL_GPL(xv_malloc);
 
 /*
  * Free block identified with <page, offset>
  */
 void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 {
+	int isolated;
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
@@ -432,7 +443,14 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* Catch double free bugs */
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
+	/*
+	 * Free blocks of an isolated page are not on any freelist;
+	 * the page is only allowed to drain until xv_putback_pages().
+	 */
+	isolated = page_private(page) & XV_PAGE_ISOLATED;
+	pool->used_bytes -= block->size;
 	block->size = ALIGN(block->size, XV_ALIGN);
+	set_page_private(page, page_private(page) - block->size - XV_ALIGN);
 
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
@@ -444,7 +462,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		 * Blocks smaller than XV_MIN_ALLOC_SIZE
 		 * are not inserted in any free list.
 		 */
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE) {
+		if (!isolated && tmpblock->size >= XV_MIN_ALLOC_SIZE) {
 			remove_block(pool, page,
 				    offset + block->size + XV_ALIGN, tmpblock,
 				    get_index_for_insert(tmpblock->size));
@@ -458,7 +476,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 						get_blockprev(block));
 		offset = offset - tmpblock->size - XV_ALIGN;
 
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+		if (!isolated && tmpblock->size >= XV_MIN_ALLOC_SIZE)
 			remove_block(pool, page, offset, tmpblock,
 				    get_index_for_insert(tmpblock->size));
 
@@ -469,15 +487,17 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
 		put_ptr_atomic(page_start, KM_USER0);
+		stat_dec(&pool->total_pages);
+		list_del(&page->lru);
+		set_page_private(page, 0);
 		spin_unlock(&pool->lock);
 
 		__free_page(page);
-		stat_dec(&pool->total_pages);
 		return;
 	}
 
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
+	if (!isolated && block->size >= XV_MIN_ALLOC_SIZE)
 		insert_block(pool, page, offset, block);
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
@@ -489,6 +509,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	put_ptr_atomic(page_start, KM_USER0);
 	spin_unlock(&pool->lock);
 }
+EXPORT_SYMBOL_GPL(xv_free);
 
 u32 xv_get_object_size(void *obj)
 {
@@ -497,6 +518,7 @@ u32 xv_get_object_size(void *obj)
 	blk = (struct block_header *)((char *)(obj) - XV_ALIGN);
 	return blk->size;
 }
+EXPORT_SYMBOL_GPL(xv_get_object_size);
 
 /*
  * Returns total memory used by allocator (userdata + metadata)
@@ -505,3 +527,165 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+EXPORT_SYMBOL_GPL(xv_get_total_size_bytes);
+
+/*
+ * Returns memory handed out to callers, excluding allocator metadata
+ * and fragmentation.
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+EXPORT_SYMBOL_GPL(xv_get_used_size_bytes);
+
+/*
+ * Size of the block at 'block' including its header. Used blocks
+ * record the requested size, free blocks are already aligned.
+ */
+static inline u32 block_span(struct block_header *block)
+{
+	return XV_ALIGN + ALIGN(block->size, XV_ALIGN);
+}
+
+/**
+ * xv_isolate_pages - Take sparsely used pages out of allocation.
+ * @pool: pool to compact
+ * @max_used: only pages with at most this many bytes allocated qualify
+ * @max_pages: isolate at most this many pages
+ *
+ * The free blocks of each isolated page are removed from the freelists
+ * so that new objects are never placed there. The caller is expected
+ * to move the remaining objects elsewhere (see xv_isolated_objects())
+ * which frees the page once the last one is gone, and then to return
+ * whatever is left with xv_putback_pages().
+ *
+ * Returns the number of pages isolated.
+ */
+int xv_isolate_pages(struct xv_pool *pool, u32 max_used, int max_pages)
+{
+	int count = 0;
+	struct page *page, *tmp;
+
+	spin_lock(&pool->lock);
+
+	list_for_each_entry_safe(page, tmp, &pool->pages, lru) {
+		u32 offset;
+		char *page_start;
+		struct block_header *block;
+
+		if (count >= max_pages)
+			break;
+		if (page_private(page) > max_used)
+			continue;
+
+		page_start = get_ptr_atomic(page, 0, KM_USER0);
+		for (offset = 0; offset < PAGE_SIZE;
+				offset += block_span(block)) {
+			block = (struct block_header *)(page_start + offset);
+			if (test_flag(block, BLOCK_FREE) &&
+					block->size >= XV_MIN_ALLOC_SIZE)
+				remove_block(pool, page, offset, block,
+					get_index_for_insert(block->size));
+		}
+		put_ptr_atomic(page_start, KM_USER0);
+
+		set_page_private(page, page_private(page) | XV_PAGE_ISOLATED);
+		list_move(&page->lru, &pool->isolated);
+		count++;
+	}
+
+	spin_unlock(&pool->lock);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(xv_isolate_pages);
+
+/**
+ * xv_isolated_objects - List objects still living in isolated pages.
+ * @pool: pool being compacted
+ * @objs: array to fill
+ * @max: size of @objs
+ *
+ * The tag of each object is its first u32 (zero for smaller objects),
+ * which lets the owner find its reference to the object without a
+ * reverse map. The list is only a snapshot: objects may be freed as
+ * soon as the pool lock is dropped, so owners must validate each entry
+ * against their own bookkeeping before moving it.
+ *
+ * Returns the number of entries filled.
+ */
+int xv_isolated_objects(struct xv_pool *pool, struct xv_object *objs,
+			int max)
+{
+	int count = 0;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+
+	list_for_each_entry(page, &pool->isolated, lru) {
+		u32 offset;
+		char *page_start;
+		struct block_header *block;
+
+		page_start = get_ptr_atomic(page, 0, KM_USER0);
+		for (offset = 0; offset < PAGE_SIZE && count < max;
+				offset += block_span(block)) {
+			block = (struct block_header *)(page_start + offset);
+			if (test_flag(block, BLOCK_FREE))
+				continue;
+
+			objs[count].page = page;
+			objs[count].offset = offset + XV_ALIGN;
+			objs[count].tag = 0;
+			if (block->size >= sizeof(u32))
+				objs[count].tag = *(u32 *)(page_start +
+							offset + XV_ALIGN);
+			count++;
+		}
+		put_ptr_atomic(page_start, KM_USER0);
+
+		if (count >= max)
+			break;
+	}
+
+	spin_unlock(&pool->lock);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(xv_isolated_objects);
+
+/**
+ * xv_putback_pages - Return isolated pages to the allocator.
+ * @pool: pool being compacted
+ *
+ * Free blocks of every page still isolated go back on the freelists.
+ */
+void xv_putback_pages(struct xv_pool *pool)
+{
+	struct page *page, *tmp;
+
+	spin_lock(&pool->lock);
+
+	list_for_each_entry_safe(page, tmp, &pool->isolated, lru) {
+		u32 offset;
+		char *page_start;
+		struct block_header *block;
+
+		page_start = get_ptr_atomic(page, 0, KM_USER0);
+		for (offset = 0; offset < PAGE_SIZE;
+				offset += block_span(block)) {
+			block = (struct block_header *)(page_start + offset);
+			if (test_flag(block, BLOCK_FREE) &&
+					block->size >= XV_MIN_ALLOC_SIZE)
+				insert_block(pool, page, offset, block);
+		}
+		put_ptr_atomic(page_start, KM_USER0);
+
+		set_page_private(page, page_private(page) & ~XV_PAGE_ISOLATED);
+		list_move(&page->lru, &pool->pages);
+	}
+
+	spin_unlock(&pool->lock);
+}
+EXPORT_SYMBOL_GPL(xv_putback_pages);
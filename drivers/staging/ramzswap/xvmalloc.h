@@ -15,8 +15,16 @@
 
 #include <linux/types.h>
 
+struct page;
 struct xv_pool;
 
+/* An object in a page isolated for compaction, see xv_isolated_objects() */
+struct xv_object {
+	struct page *page;
+	u32 offset;
+	u32 tag;	/* first u32 of the object */
+};
+
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
 
@@ -26,5 +34,11 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+int xv_isolate_pages(struct xv_pool *pool, u32 max_used, int max_pages);
+int xv_isolated_objects(struct xv_pool *pool, struct xv_object *objs,
+			int max);
+void xv_putback_pages(struct xv_pool *pool);
 
 #endif
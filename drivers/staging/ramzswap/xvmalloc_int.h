@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -47,6 +48,13 @@ enum blockflags {
 #define FLAGS_MASK	XV_ALIGN_MASK
 #define PREV_MASK	(~FLAGS_MASK)
 
+/*
+ * page->private of pool pages holds the bytes allocated in the page,
+ * and this bit while the page is isolated for compaction: its free
+ * blocks are then kept off the freelists so it only drains.
+ */
+#define XV_PAGE_ISOLATED	(1UL << (BITS_PER_LONG - 1))
+
 struct freelist_entry {
 	struct page *page;
 	u16 offset;
@@ -79,8 +87,12 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	struct list_head pages;		/* via page->lru */
+	struct list_head isolated;	/* pages being compacted */
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;			/* allocated, excluding headers */
 };
 
 #endif
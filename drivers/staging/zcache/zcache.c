@@ -0,0 +1,666 @@
+/*
+ * zcache - compressed cache for clean page cache pages
+ *
+ * A cleancache backend: clean pages dropped from the page cache of
+ * cleancache-enabled filesystems are LZO compressed and kept in an
+ * xvmalloc pool, then handed back when the filesystem reads them again
+ * instead of going to the disk. The pool is bounded by max_pages, and
+ * gives memory back through a shrinker, oldest pages first.
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zcache"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cleancache.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/lzo.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/radix-tree.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "../ramzswap/xvmalloc.h"
+
+#define ZCACHE_MAX_POOLS	16
+
+/* Pages that compress to more than this are not worth keeping */
+static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
+
+/* Default max_pages: 10% of RAM */
+static const unsigned default_max_pages_perc_ram = 10;
+
+/*
+ * Puts run with the mapping's tree_lock held, and are only worth doing
+ * if memory is at hand: never wait, retry or use the reserves.
+ */
+#define ZCACHE_GFP_MASK	(__GFP_NORETRY | __GFP_NOWARN | __GFP_NOMEMALLOC)
+
+struct zcache_pool {
+	struct rb_root inodes;		/* zcache_inode by key */
+	int in_use;
+};
+
+/* A file with pages in zcache */
+struct zcache_inode {
+	struct rb_node node;		/* in zcache_pool.inodes */
+	struct cleancache_filekey key;
+	struct radix_tree_root pages;	/* zcache_page by page index */
+	unsigned long nr_pages;
+	struct zcache_pool *pool;
+};
+
+/* A compressed page */
+struct zcache_page {
+	struct list_head lru;		/* in zcache_lru, oldest first */
+	struct zcache_inode *zinode;
+	pgoff_t index;
+	struct page *page;		/* xvmalloc object */
+	u32 offset;
+};
+
+/* Used with preemption disabled, one per CPU */
+struct zcache_stream {
+	void *workmem;
+	void *buffer;		/* 2 pages: LZO output can exceed PAGE_SIZE */
+};
+
+static struct zcache_pool zcache_pools[ZCACHE_MAX_POOLS];
+static LIST_HEAD(zcache_lru);
+
+/* Protects the pools, their inodes, the LRU and the stats */
+static DEFINE_SPINLOCK(zcache_lock);
+
+static struct xv_pool *zcache_mem_pool;
+static DEFINE_PER_CPU(struct zcache_stream, zcache_streams);
+static struct kmem_cache *zcache_inode_cachep;
+static struct kmem_cache *zcache_page_cachep;
+
+/* Module params (documentation at end) */
+static unsigned long zcache_max_pages;
+
+/* Stats */
+static unsigned long zcache_pages_stored;
+static unsigned long zcache_compr_size;
+static unsigned long zcache_rejected;	/* incompressible or no memory */
+static unsigned long zcache_evicted;	/* to stay within max_pages */
+static unsigned long zcache_shrunk;	/* by the shrinker */
+
+static unsigned long zcache_pool_pages(void)
+{
+	return xv_get_total_size_bytes(zcache_mem_pool) >> PAGE_SHIFT;
+}
+
+static struct zcache_pool *zcache_get_pool(int pool_id)
+{
+	if (pool_id < 0 || pool_id >= ZCACHE_MAX_POOLS ||
+	    !zcache_pools[pool_id].in_use)
+		return NULL;
+	return &zcache_pools[pool_id];
+}
+
+static struct zcache_inode *zcache_inode_find(struct zcache_pool *pool,
+					struct cleancache_filekey *key)
+{
+	struct rb_node *n = pool->inodes.rb_node;
+	struct zcache_inode *zinode;
+	int cmp;
+
+	while (n) {
+		zinode = rb_entry(n, struct zcache_inode, node);
+		cmp = memcmp(key, &zinode->key, sizeof(*key));
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return zinode;
+	}
+	return NULL;
+}
+
+static struct zcache_inode *zcache_inode_get(struct zcache_pool *pool,
+					struct cleancache_filekey *key)
+{
+	struct rb_node **p = &pool->inodes.rb_node;
+	struct rb_node *parent = NULL;
+	struct zcache_inode *zinode;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		zinode = rb_entry(parent, struct zcache_inode, node);
+		cmp = memcmp(key, &zinode->key, sizeof(*key));
+		if (cmp < 0)
+			p = &parent->rb_left;
+		else if (cmp > 0)
+			p = &parent->rb_right;
+		else
+			return zinode;
+	}
+
+	zinode = kmem_cache_alloc(zcache_inode_cachep, ZCACHE_GFP_MASK);
+	if (!zinode)
+		return NULL;
+
+	zinode->key = *key;
+	INIT_RADIX_TREE(&zinode->pages, ZCACHE_GFP_MASK);
+	zinode->nr_pages = 0;
+	zinode->pool = pool;
+	rb_link_node(&zinode->node, parent, p);
+	rb_insert_color(&zinode->node, &pool->inodes);
+
+	return zinode;
+}
+
+static void zcache_inode_put(struct zcache_inode *zinode)
+{
+	if (zinode->nr_pages)
+		return;
+	rb_erase(&zinode->node, &zinode->pool->inodes);
+	kmem_cache_free(zcache_inode_cachep, zinode);
+}
+
+/*
+ * Take 'zp' out of its inode and the LRU and queue it on 'freed'. Its
+ * memory is released by zcache_release_pages() once zcache_lock is
+ * dropped. Called with zcache_lock held.
+ */
+static void zcache_unlink_page(struct zcache_page *zp, struct list_head *freed)
+{
+	struct zcache_inode *zinode = zp->zinode;
+	void *obj;
+
+	radix_tree_delete(&zinode->pages, zp->index);
+	zinode->nr_pages--;
+	zcache_inode_put(zinode);
+
+	obj = kmap_atomic(zp->page, KM_USER0) + zp->offset;
+	zcache_compr_size -= xv_get_object_size(obj);
+	kunmap_atomic(obj, KM_USER0);
+	zcache_pages_stored--;
+
+	list_move(&zp->lru, freed);
+}
+
+static void zcache_release_pages(struct list_head *freed)
+{
+	struct zcache_page *zp, *next;
+
+	list_for_each_entry_safe(zp, next, freed, lru) {
+		xv_free(zcache_mem_pool, zp->page, zp->offset);
+		kmem_cache_free(zcache_page_cachep, zp);
+	}
+}
+
+/* Drop up to 'nr' of the oldest pages. Called with zcache_lock held. */
+static unsigned long zcache_evict(unsigned long nr, struct list_head *freed)
+{
+	unsigned long done = 0;
+
+	while (done < nr && !list_empty(&zcache_lru)) {
+		zcache_unlink_page(list_first_entry(&zcache_lru,
+					struct zcache_page, lru), freed);
+		done++;
+	}
+	return done;
+}
+
+static void zcache_unlink_inode(struct zcache_inode *zinode,
+				struct list_head *freed)
+{
+	struct zcache_page *batch[16];
+	unsigned long left = zinode->nr_pages;
+	unsigned int i, n;
+
+	/* The last unlink frees zinode, so count down instead */
+	while (left) {
+		n = radix_tree_gang_lookup(&zinode->pages, (void **)batch, 0,
+					   ARRAY_SIZE(batch));
+		left -= n;
+		for (i = 0; i < n; i++)
+			zcache_unlink_page(batch[i], freed);
+	}
+}
+
+static int zcache_init_fs(size_t pagesize)
+{
+	unsigned long flags;
+	int pool_id;
+
+	if (pagesize != PAGE_SIZE)
+		return -1;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	for (pool_id = 0; pool_id < ZCACHE_MAX_POOLS; pool_id++) {
+		if (!zcache_pools[pool_id].in_use) {
+			zcache_pools[pool_id].inodes = RB_ROOT;
+			zcache_pools[pool_id].in_use = 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (pool_id == ZCACHE_MAX_POOLS) {
+		pr_info("Out of pools\n");
+		return -1;
+	}
+	return pool_id;
+}
+
+/* Nothing is shared beyond this kernel, so a shared fs is just an fs */
+static int zcache_init_shared_fs(char *uuid, size_t pagesize)
+{
+	return zcache_init_fs(pagesize);
+}
+
+static int zcache_get_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_pool *pool;
+	struct zcache_inode *zinode;
+	struct zcache_page *zp = NULL;
+	unsigned long flags;
+	LIST_HEAD(freed);
+	size_t clen;
+	void *src, *dst;
+	int ret;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		zinode = zcache_inode_find(pool, &key);
+		if (zinode)
+			zp = radix_tree_lookup(&zinode->pages, index);
+	}
+	/* The page returns to the page cache, so drop it from here */
+	if (zp)
+		zcache_unlink_page(zp, &freed);
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	if (!zp)
+		return -1;
+
+	src = kmap_atomic(zp->page, KM_USER0) + zp->offset;
+	dst = kmap_atomic(page, KM_USER1);
+	clen = PAGE_SIZE;
+	ret = lzo1x_decompress_safe(src, xv_get_object_size(src), dst, &clen);
+	kunmap_atomic(dst, KM_USER1);
+	kunmap_atomic(src, KM_USER0);
+
+	zcache_release_pages(&freed);
+
+	/* should NEVER happen */
+	if (unlikely(ret != LZO_E_OK || clen != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, index=%lu\n",
+			ret, index);
+		return -1;
+	}
+	return 0;
+}
+
+static void zcache_put_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index, struct page *page)
+{
+	struct zcache_stream *stream;
+	struct zcache_pool *pool;
+	struct zcache_inode *zinode;
+	struct zcache_page *zp, *old;
+	unsigned long flags, over;
+	LIST_HEAD(freed);
+	size_t clen;
+	void *src, *dst;
+	int ret;
+
+	zp = kmem_cache_alloc(zcache_page_cachep, ZCACHE_GFP_MASK);
+	if (!zp)
+		goto reject;
+
+	stream = &get_cpu_var(zcache_streams);
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, stream->buffer, &clen,
+				stream->workmem);
+	kunmap_atomic(src, KM_USER0);
+
+	if (ret != LZO_E_OK || clen > max_zpage_size ||
+	    xv_malloc(zcache_mem_pool, clen, &zp->page, &zp->offset,
+			ZCACHE_GFP_MASK | __GFP_HIGHMEM)) {
+		put_cpu_var(zcache_streams);
+		kmem_cache_free(zcache_page_cachep, zp);
+		zp = NULL;
+		goto reject;
+	}
+
+	dst = kmap_atomic(zp->page, KM_USER0) + zp->offset;
+	memcpy(dst, stream->buffer, clen);
+	kunmap_atomic(dst, KM_USER0);
+	put_cpu_var(zcache_streams);
+
+	zp->index = index;
+	INIT_LIST_HEAD(&zp->lru);
+
+	spin_lock_irqsave(&zcache_lock, flags);
+
+	pool = zcache_get_pool(pool_id);
+	if (!pool)
+		goto unlock_reject;
+
+	/* Replace an older copy; this may free its zinode */
+	zinode = zcache_inode_find(pool, &key);
+	if (zinode) {
+		old = radix_tree_lookup(&zinode->pages, index);
+		if (old)
+			zcache_unlink_page(old, &freed);
+	}
+
+	zinode = zcache_inode_get(pool, &key);
+	if (!zinode)
+		goto unlock_reject;
+	if (radix_tree_insert(&zinode->pages, index, zp)) {
+		zcache_inode_put(zinode);
+		goto unlock_reject;
+	}
+	zinode->nr_pages++;
+	zp->zinode = zinode;
+	list_add_tail(&zp->lru, &zcache_lru);
+
+	zcache_pages_stored++;
+	zcache_compr_size += clen;
+
+	/* Keep within budget, at the expense of the oldest pages */
+	if (zcache_pool_pages() > zcache_max_pages) {
+		over = zcache_pool_pages() - zcache_max_pages;
+		zcache_evicted += zcache_evict(over * PAGE_SIZE / clen + 1,
+					       &freed);
+	}
+
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	zcache_release_pages(&freed);
+	return;
+
+unlock_reject:
+	zcache_rejected++;
+	spin_unlock_irqrestore(&zcache_lock, flags);
+	xv_free(zcache_mem_pool, zp->page, zp->offset);
+	kmem_cache_free(zcache_page_cachep, zp);
+	zcache_release_pages(&freed);
+	return;
+
+reject:
+	/* A stale copy must not be returned by a later get */
+	spin_lock_irqsave(&zcache_lock, flags);
+	zcache_rejected++;
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		zinode = zcache_inode_find(pool, &key);
+		if (zinode) {
+			old = radix_tree_lookup(&zinode->pages, index);
+			if (old)
+				zcache_unlink_page(old, &freed);
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+	zcache_release_pages(&freed);
+}
+
+static void zcache_flush_page(int pool_id, struct cleancache_filekey key,
+			pgoff_t index)
+{
+	struct zcache_pool *pool;
+	struct zcache_inode *zinode;
+	struct zcache_page *zp;
+	unsigned long flags;
+	LIST_HEAD(freed);
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		zinode = zcache_inode_find(pool, &key);
+		if (zinode) {
+			zp = radix_tree_lookup(&zinode->pages, index);
+			if (zp)
+				zcache_unlink_page(zp, &freed);
+		}
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	zcache_release_pages(&freed);
+}
+
+static void zcache_flush_inode(int pool_id, struct cleancache_filekey key)
+{
+	struct zcache_pool *pool;
+	struct zcache_inode *zinode;
+	unsigned long flags;
+	LIST_HEAD(freed);
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		zinode = zcache_inode_find(pool, &key);
+		if (zinode)
+			zcache_unlink_inode(zinode, &freed);
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	zcache_release_pages(&freed);
+}
+
+static void zcache_flush_fs(int pool_id)
+{
+	struct zcache_pool *pool;
+	struct rb_node *n;
+	unsigned long flags;
+	LIST_HEAD(freed);
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	pool = zcache_get_pool(pool_id);
+	if (pool) {
+		while ((n = rb_first(&pool->inodes)))
+			zcache_unlink_inode(rb_entry(n, struct zcache_inode,
+						     node), &freed);
+		pool->in_use = 0;
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	zcache_release_pages(&freed);
+}
+
+static unsigned long zcache_total_pages(void)
+{
+	return zcache_pool_pages();
+}
+
+static struct cleancache_ops zcache_ops = {
+	.init_fs	= zcache_init_fs,
+	.init_shared_fs	= zcache_init_shared_fs,
+	.get_page	= zcache_get_page,
+	.put_page	= zcache_put_page,
+	.flush_page	= zcache_flush_page,
+	.flush_inode	= zcache_flush_inode,
+	.flush_fs	= zcache_flush_fs,
+	.total_pages	= zcache_total_pages,
+};
+
+/*
+ * Clean pages are cheap to read back, so give them up before anything
+ * else. The lowmemorykiller counts zcache as page cache (see
+ * cleancache_total_pages()) and so leaves it to this shrinker.
+ */
+static int zcache_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	unsigned long flags;
+	LIST_HEAD(freed);
+	int nr;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	if (nr_to_scan > 0)
+		zcache_shrunk += zcache_evict(nr_to_scan, &freed);
+	nr = zcache_pages_stored;
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	zcache_release_pages(&freed);
+	return nr;
+}
+
+static struct shrinker zcache_shrinker = {
+	.shrink = zcache_shrink,
+	.seeks = 1,
+};
+
+#ifdef CONFIG_SYSFS
+
+#define ZCACHE_SYSFS_RO(_name, _value) \
+	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
+				struct kobj_attribute *attr, char *buf) \
+	{ \
+		return sprintf(buf, "%lu\n", _value); \
+	} \
+	static struct kobj_attribute zcache_##_name##_attr = { \
+		.attr = { .name = __stringify(_name), .mode = 0444 }, \
+		.show = zcache_##_name##_show, \
+	}
+
+ZCACHE_SYSFS_RO(pages_stored, zcache_pages_stored);
+ZCACHE_SYSFS_RO(compr_data_size, zcache_compr_size);
+ZCACHE_SYSFS_RO(mem_used_pages, zcache_pool_pages());
+ZCACHE_SYSFS_RO(rejected, zcache_rejected);
+ZCACHE_SYSFS_RO(evicted, zcache_evicted);
+ZCACHE_SYSFS_RO(shrunk, zcache_shrunk);
+
+static ssize_t zcache_max_pages_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", zcache_max_pages);
+}
+
+static ssize_t zcache_max_pages_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long val, flags;
+	LIST_HEAD(freed);
+
+	if (strict_strtoul(buf, 10, &val))
+		return -EINVAL;
+
+	spin_lock_irqsave(&zcache_lock, flags);
+	zcache_max_pages = val;
+	while (zcache_pool_pages() > zcache_max_pages &&
+	       !list_empty(&zcache_lru)) {
+		zcache_evicted += zcache_evict(16, &freed);
+		/* Pool pages only go away once released */
+		spin_unlock_irqrestore(&zcache_lock, flags);
+		zcache_release_pages(&freed);
+		INIT_LIST_HEAD(&freed);
+		spin_lock_irqsave(&zcache_lock, flags);
+	}
+	spin_unlock_irqrestore(&zcache_lock, flags);
+
+	return count;
+}
+
+static struct kobj_attribute zcache_max_pages_attr =
+	__ATTR(max_pages, 0644, zcache_max_pages_show, zcache_max_pages_store);
+
+static struct attribute *zcache_attrs[] = {
+	&zcache_pages_stored_attr.attr,
+	&zcache_compr_data_size_attr.attr,
+	&zcache_mem_used_pages_attr.attr,
+	&zcache_rejected_attr.attr,
+	&zcache_evicted_attr.attr,
+	&zcache_shrunk_attr.attr,
+	&zcache_max_pages_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zcache_attr_group = {
+	.attrs = zcache_attrs,
+	.name = "zcache",
+};
+
+#endif /* CONFIG_SYSFS */
+
+static void zcache_free_streams(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_stream *stream = &per_cpu(zcache_streams, cpu);
+
+		kfree(stream->workmem);
+		free_pages((unsigned long)stream->buffer, 1);
+		stream->workmem = NULL;
+		stream->buffer = NULL;
+	}
+}
+
+static int __init zcache_init(void)
+{
+	struct cleancache_ops old_ops;
+	int cpu, ret = -ENOMEM;
+
+	zcache_mem_pool = xv_create_pool();
+	if (!zcache_mem_pool)
+		goto out;
+
+	zcache_inode_cachep = KMEM_CACHE(zcache_inode, 0);
+	zcache_page_cachep = KMEM_CACHE(zcache_page, 0);
+	if (!zcache_inode_cachep || !zcache_page_cachep)
+		goto free;
+
+	for_each_possible_cpu(cpu) {
+		struct zcache_stream *stream = &per_cpu(zcache_streams, cpu);
+
+		stream->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		stream->buffer = (void *)__get_free_pages(GFP_KERNEL, 1);
+		if (!stream->workmem || !stream->buffer)
+			goto free;
+	}
+
+	if (!zcache_max_pages)
+		zcache_max_pages = totalram_pages / 100 *
+					default_max_pages_perc_ram;
+
+	register_shrinker(&zcache_shrinker);
+#ifdef CONFIG_SYSFS
+	ret = sysfs_create_group(mm_kobj, &zcache_attr_group);
+	if (ret)
+		pr_warning("Error creating sysfs group\n");
+#endif
+
+	old_ops = cleancache_register_ops(&zcache_ops);
+	if (old_ops.init_fs)
+		pr_warning("Replaced another cleancache backend\n");
+
+	pr_info("Enabled, max_pages=%lu\n", zcache_max_pages);
+	return 0;
+
+free:
+	zcache_free_streams();
+	if (zcache_page_cachep)
+		kmem_cache_destroy(zcache_page_cachep);
+	if (zcache_inode_cachep)
+		kmem_cache_destroy(zcache_inode_cachep);
+	xv_destroy_pool(zcache_mem_pool);
+out:
+	pr_err("Initialization failed: err=%d\n", ret);
+	return ret;
+}
+
+module_param_named(max_pages, zcache_max_pages, ulong, 0);
+MODULE_PARM_DESC(max_pages, "Maximum memory used, in pages "
+		"(default: 10% of RAM)");
+
+module_init(zcache_init);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed cache for clean page cache pages");
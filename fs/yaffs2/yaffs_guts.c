@@ -37,14 +37,18 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Chunks copied per gc step unless we are about to run out of erased blocks */
+#define YAFFS_GC_STEP_COPIES 5
+
+/* Block age (in blocks allocated since) past which age adds no more weight */
+#define YAFFS_GC_MAX_AGE 0xFFFF
+
 #include "yaffs_ecc.h"
 
 
 
 /* Robustification (if it ever comes about...) */
 static void yaffs_RetireBlock(yaffs_Device *dev, int blockInNAND);
-static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
-		int erasedOk);
 static void yaffs_HandleWriteChunkOk(yaffs_Device *dev, int chunkInNAND,
 				const __u8 *data,
 				const yaffs_ExtendedTags *tags);
@@ -468,6 +472,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		yaffs2_SummaryAdd(dev, tags, chunk);
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -568,7 +574,7 @@ void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi)
 	}
 }
 
-static void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
+void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
 		int erasedOk)
 {
 	int blockInNAND = chunkInNAND / dev->param.nChunksPerBlock;
@@ -1097,6 +1103,9 @@ static void yaffs_SoftDeleteFile(yaffs_Object *obj)
 {
 	if (obj->deleted &&
 	    obj->variantType == YAFFS_OBJECT_TYPE_FILE && !obj->softDeleted) {
+		if (!yaffs_CheckFileChunksLoaded(obj))
+			return;
+
 		if (obj->nDataChunks <= 0) {
 			/* Empty file with no duplicate object headers, just delete it immediately */
 			yaffs_FreeTnode(obj->myDev,
@@ -1216,6 +1225,59 @@ static int yaffs_PruneFileStructure(yaffs_Device *dev,
 	return YAFFS_OK;
 }
 
+static void yaffs_FreeTnodeTree(yaffs_Device *dev, yaffs_Tnode *tn, int level)
+{
+	int i;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (tn->internal[i])
+				yaffs_FreeTnodeTree(dev, tn->internal[i], level - 1);
+		}
+	}
+
+	yaffs_FreeTnode(dev, tn);
+}
+
+/*
+ * With lazy file loading the tnode tree of a file is only built when the
+ * file is first used. If that fails the partial tree is thrown away, so that
+ * the next use starts again from scratch. Chunks already found to be stale
+ * stay deleted, which does not change the result.
+ */
+int yaffs_CheckFileChunksLoaded(yaffs_Object *in)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_FileStructure *fStruct = &in->variant.fileVariant;
+	int i;
+
+	if (in->variantType != YAFFS_OBJECT_TYPE_FILE || !fStruct->deferred)
+		return YAFFS_OK;
+
+	if (yaffs2_LoadDeferredChunks(in)) {
+		yaffs2_FreeDeferredChunks(in);
+		dev->nDeferredLoads++;
+		return YAFFS_OK;
+	}
+
+	if (fStruct->topLevel > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (fStruct->top->internal[i])
+				yaffs_FreeTnodeTree(dev, fStruct->top->internal[i],
+						fStruct->topLevel - 1);
+		}
+	}
+	memset(fStruct->top, 0, dev->tnodeSize);
+	fStruct->topLevel = 0;
+	in->nDataChunks = 0;
+
+	T(YAFFS_TRACE_ERROR,
+	  (TSTR("yaffs: could not load the chunks of object %d" TENDSTR),
+	   in->objectId));
+
+	return YAFFS_FAIL;
+}
+
 /*-------------------- End of File Structure functions.-------------------*/
 
 
@@ -1318,6 +1380,9 @@ static void yaffs_FreeObject(yaffs_Object *obj)
 		return;
 	}
 
+	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE)
+		yaffs2_FreeDeferredChunks(obj);
+
 	yaffs_UnhashObject(obj);
 
 	yaffs_FreeRawObject(dev,obj);
@@ -1898,6 +1963,7 @@ void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 	if(blockNo == dev->gcDirtiest){
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
+		dev->gcScore = 0;
 	}
 
 	if (!bi->needsRetiring) {
@@ -2023,6 +2089,8 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* Get next block to allocate off */
 		dev->allocationBlock = yaffs_FindBlockForAllocation(dev);
 		dev->allocationPage = 0;
+		if (dev->allocationBlock >= 0)
+			yaffs2_SummaryClear(dev, dev->allocationBlock);
 	}
 
 	if (!useReserve && !yaffs_CheckSpaceForAllocation(dev, 1)) {
@@ -2049,8 +2117,10 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 
 		dev->nFreeChunks--;
 
-		/* If the block is full set the state to full */
-		if (dev->allocationPage >= dev->param.nChunksPerBlock) {
+		/* If the block is full set the state to full.
+		 * With summaries the last chunk is kept for the summary.
+		 */
+		if (dev->allocationPage >= dev->chunksPerSummary) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
 			dev->allocationBlock = -1;
 		}
@@ -2074,7 +2144,7 @@ static int yaffs_GetErasedChunks(yaffs_Device *dev)
 	n = dev->nErasedBlocks * dev->param.nChunksPerBlock;
 
 	if (dev->allocationBlock > 0)
-		n += (dev->param.nChunksPerBlock - dev->allocationPage);
+		n += (dev->chunksPerSummary - dev->allocationPage);
 
 	return n;
 
@@ -2149,7 +2219,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 		yaffs_VerifyBlock(dev, bi, block);
 
-		maxCopies = (wholeBlock) ? dev->param.nChunksPerBlock : 5;
+		maxCopies = (wholeBlock) ? dev->param.nChunksPerBlock : YAFFS_GC_STEP_COPIES;
 		oldChunk = block * dev->param.nChunksPerBlock + dev->gcChunk;
 
 		for (/* init already done */;
@@ -2181,6 +2251,19 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 				   dev->gcChunk, tags.objectId, tags.chunkId,
 				   tags.byteCount));
 
+				/* A lazily loaded file needs its tree before its data
+				 * can be moved. Loading it may find this chunk stale
+				 * and delete it.
+				 */
+				if (object && tags.chunkId > 0) {
+					if (!yaffs_CheckFileChunksLoaded(object)) {
+						retVal = YAFFS_FAIL;
+						continue;
+					}
+					if (!yaffs_CheckChunkBit(dev, block, dev->gcChunk))
+						continue;
+				}
+
 				if (object && !yaffs_SkipVerification(dev)) {
 					if (tags.chunkId == 0)
 						matchingChunk = object->hdrChunk;
@@ -2317,6 +2400,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 	}
 
+	dev->nGCSteps++;
+
 	yaffs_VerifyCollectedBlock(dev, bi, block);
 
 
@@ -2369,8 +2454,29 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 }
 
 /*
- * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * Cost-benefit score of collecting a block: the space reclaimed, weighted by
+ * how long the block's data has been left alone (old data is unlikely to be
+ * rewritten soon, so it is worth moving), over the cost of copying the live
+ * chunks off.
+ * For yaffs1 all blocks have the same age and this is just dirtiness.
+ */
+static unsigned yaffs_GCScore(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int pagesUsed)
+{
+	unsigned age = 0;
+	unsigned dirty = dev->param.nChunksPerBlock - pagesUsed;
+
+	if (dev->param.isYaffs2 && dev->sequenceNumber > bi->sequenceNumber)
+		age = dev->sequenceNumber - bi->sequenceNumber;
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return dirty * (age + 1) / (pagesUsed + 1);
+}
+
+/*
+ * FindBlockForgarbageCollection is used to select the block with the best
+ * cost-benefit score among those dirty enough for the current urgency.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
@@ -2388,6 +2494,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs && !aggressive) {
 		dev->gcDirtiest = 0;
+		dev->gcScore = 0;
 		bi = dev->blockInfo;
 		for (i = dev->internalStartBlock;
 			i <= dev->internalEndBlock && !selected;
@@ -2470,10 +2577,15 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
 				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
+				pagesUsed <= threshold &&
 				yaffs2_BlockNotDisqualifiedFromGC(dev, bi)) {
-				dev->gcDirtiest = dev->gcBlockFinder;
-				dev->gcPagesInUse = pagesUsed;
+				unsigned score = yaffs_GCScore(dev, bi, pagesUsed);
+
+				if (dev->gcDirtiest < 1 || score > dev->gcScore) {
+					dev->gcDirtiest = dev->gcBlockFinder;
+					dev->gcPagesInUse = pagesUsed;
+					dev->gcScore = score;
+				}
 			}
 		}
 
@@ -2512,6 +2624,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
+		dev->gcScore = 0;
 		dev->gcNotDone = 0;
 		if(dev->refreshSkip > 0)
 			dev->refreshSkip--;
@@ -2568,8 +2681,10 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		minErased  = dev->param.nReservedBlocks + checkpointBlockAdjust + 1;
 		erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
 
-		/* If we need a block soon then do aggressive gc.*/
-		if (dev->nErasedBlocks < minErased)
+		/* If we need a block soon then do aggressive gc. Start a few
+		 * blocks early, so that it can still go in bounded steps.
+		 */
+		if (dev->nErasedBlocks < minErased + YAFFS_GC_STEP_BLOCKS)
 			aggressive = 1;
 		else {
 			if(!background && erasedChunks > (dev->nFreeChunks / 4))
@@ -2612,7 +2727,19 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
 			   dev->nErasedBlocks, aggressive));
 
-			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock, aggressive);
+			/*
+			 * Even aggressive gc proceeds in bounded steps, which
+			 * keeps a writer from stalling behind a whole block copy,
+			 * while the background thread is urged to refill the
+			 * YAFFS_GC_STEP_BLOCKS above the reserve. Only once the
+			 * erased blocks dip into the blocks held back for writing
+			 * and for the checkpoint do we need the block back before
+			 * anything else.
+			 */
+			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock,
+				aggressive &&
+				dev->nErasedBlocks < dev->param.nReservedBlocks +
+					checkpointBlockAdjust);
 		}
 
 		if (dev->nErasedBlocks < (dev->param.nReservedBlocks) && dev->gcBlock > 0) {
@@ -2630,17 +2757,22 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 
 /*
  * yaffs_BackgroundGarbageCollect()
- * Garbage collects. Intended to be called from a background thread.
- * Returns non-zero if at least half the free chunks are erased.
+ * Garbage collects one bounded step. Intended to be called from a background
+ * thread, which should drop the device lock between steps so that reads and
+ * writes are not held up for a whole block.
+ * Returns non-zero if at least half the free chunks are erased and no block
+ * is left partly collected, ie. there is no point in another step right now.
  */
 int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
 {
-	int erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	int erasedChunks;
 
 	T(YAFFS_TRACE_BACKGROUND, (TSTR("Background gc %u" TENDSTR),urgency));
 
 	yaffs_CheckGarbageCollection(dev, 1);
-	return erasedChunks > dev->nFreeChunks/2;
+
+	erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	return dev->gcBlock < 1 && erasedChunks > dev->nFreeChunks/2;
 }
 
 /*-------------------------  TAGS --------------------------------*/
@@ -2667,6 +2799,9 @@ static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 
 	yaffs_Device *dev = in->myDev;
 
+	if (!yaffs_CheckFileChunksLoaded(in))
+		return -1;
+
 	if (!tags) {
 		/* Passed a NULL, so use our own tags space */
 		tags = &localTags;
@@ -2695,6 +2830,9 @@ static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 	yaffs_Device *dev = in->myDev;
 	int retVal = -1;
 
+	if (!yaffs_CheckFileChunksLoaded(in))
+		return -1;
+
 	if (!tags) {
 		/* Passed a NULL, so use our own tags space */
 		tags = &localTags;
@@ -2752,6 +2890,9 @@ int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
+	if (!inScan && !yaffs_CheckFileChunksLoaded(in))
+		return YAFFS_FAIL;
+
 	tn = yaffs_AddOrFindLevel0Tnode(dev,
 					&in->variant.fileVariant,
 					chunkInInode,
@@ -3176,21 +3317,71 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are found through a hash on (object, chunk) and kept on an LRU
+ *   list, with unused chunks on a free list and dirty ones on a dirty list. This
+ *   keeps lookups and replacement O(1) so the cache can hold a few hundred chunks.
  */
 
+static Y_INLINE struct ylist_head *yaffs_CacheBucket(yaffs_Device *dev,
+						int objectId, int chunkId)
+{
+	return &dev->srCacheHash[(objectId * 31 + chunkId) &
+				(dev->srCacheBuckets - 1)];
+}
+
+static void yaffs_SetCacheDirty(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (!cache->dirty) {
+		cache->dirty = 1;
+		ylist_add_tail(&cache->dirtyLink, &dev->srCacheDirty);
+		dev->srDirtyCaches++;
+	}
+}
+
+static void yaffs_SetCacheClean(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		ylist_del_init(&cache->dirtyLink);
+		dev->srDirtyCaches--;
+	}
+}
+
+/* Put a cache chunk back on the free list. */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_SetCacheClean(dev, cache);
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheFree);
+	cache->object = NULL;
+	cache->readAhead = 0;
+}
+
+/* Bind a free cache chunk to an object's chunk. */
+static void yaffs_AssignChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	cache->readAhead = 0;
+	ylist_add(&cache->hashLink,
+		yaffs_CacheBucket(dev, obj->objectId, chunkId));
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheLru);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &dev->srCacheDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+		if (cache->object == obj)
 			return 1;
 	}
 
@@ -3202,8 +3393,9 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
 	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
+	yaffs_ChunkCache *c;
 	int chunkWritten = 0;
 	int nCaches = obj->myDev->param.nShortOpCaches;
 
@@ -3212,15 +3404,12 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 			cache = NULL;
 
 			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
+			ylist_for_each(i, &dev->srCacheDirty) {
+				c = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+				if (c->object == obj &&
+				    (!cache || c->chunkId < lowest)) {
+					cache = c;
+					lowest = cache->chunkId;
 				}
 			}
 
@@ -3233,8 +3422,7 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 								 cache->data,
 								 cache->nBytes,
 								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_ReleaseChunkCache(dev, cache);
 			}
 
 		} while (cache && chunkWritten > 0);
@@ -3257,20 +3445,16 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
-	int nCaches = dev->param.nShortOpCaches;
-	int i;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
-		}
+		if (dev->param.nShortOpCaches > 0 &&
+		    !ylist_empty(&dev->srCacheDirty))
+			obj = ylist_entry(dev->srCacheDirty.next,
+					yaffs_ChunkCache, dirtyLink)->object;
 		if (obj)
 			yaffs_FlushFilesChunkCache(obj);
 
@@ -3286,13 +3470,24 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
+	if (dev->param.nShortOpCaches > 0 &&
+	    !ylist_empty(&dev->srCacheFree))
+		return ylist_entry(dev->srCacheFree.next,
+				yaffs_ChunkCache, lruLink);
 
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+	return NULL;
+}
+
+/* Least recently used cache chunk that is not locked. */
+static yaffs_ChunkCache *yaffs_LeastRecentChunkCache(yaffs_Device *dev)
+{
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+
+	for (i = dev->srCacheLru.prev; i != &dev->srCacheLru; i = i->prev) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (!cache->locked)
+			return cache;
 	}
 
 	return NULL;
@@ -3301,10 +3496,6 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Try find a non-dirty one... */
@@ -3312,36 +3503,21 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
+			/* They were all in use, take the least recently used one.
+			 * If that is dirty then flush its object and find again.
 			 * NB what's here is not very accurate, we actually flush the object
 			 * the last recently used page.
 			 */
 
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+			cache = yaffs_LeastRecentChunkCache(dev);
 
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
+			if (cache && !cache->dirty) {
+				yaffs_ReleaseChunkCache(dev, cache);
+			} else if (cache) {
 				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
+				yaffs_FlushFilesChunkCache(cache->object);
 			}
-
+			cache = yaffs_GrabChunkCacheWorker(dev);
 		}
 		return cache;
 	} else
@@ -3354,15 +3530,15 @@ static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
 
-				return &dev->srCache[i];
-			}
+	if (dev->param.nShortOpCaches > 0) {
+		ylist_for_each(i, yaffs_CacheBucket(dev, obj->objectId, chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
@@ -3374,21 +3550,44 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 {
 
 	if (dev->param.nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
 
-			dev->srLastUse = 0;
-		}
+		cache->readAhead = 0;
 
-		dev->srLastUse++;
+		if (isAWrite)
+			yaffs_SetCacheDirty(dev, cache);
+	}
+}
 
-		cache->lastUse = dev->srLastUse;
+/* Read ahead the chunks following a sequential read into clean or unused
+ * cache chunks. Dirty chunks are never flushed to make room.
+ */
+static void yaffs_ReadAheadChunkCache(yaffs_Object *in, int chunk, int nChunks)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ChunkCache *cache;
+	loff_t fileSize = in->variant.fileVariant.fileSize;
 
-		if (isAWrite)
-			cache->dirty = 1;
+	for (; nChunks > 0; nChunks--, chunk++) {
+		if ((loff_t)(chunk - 1) * dev->nDataBytesPerChunk >= fileSize)
+			break;
+
+		if (yaffs_FindChunkCache(in, chunk))
+			continue;
+
+		cache = yaffs_GrabChunkCacheWorker(dev);
+		if (!cache) {
+			cache = yaffs_LeastRecentChunkCache(dev);
+			if (!cache || cache->dirty)
+				break;
+			yaffs_ReleaseChunkCache(dev, cache);
+		}
+
+		yaffs_AssignChunkCache(dev, cache, in, chunk);
+		yaffs_ReadChunkDataFromObject(in, chunk, cache->data);
+		cache->readAhead = 1;
+		dev->cacheReadAheads++;
 	}
 }
 
@@ -3402,7 +3601,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -3411,14 +3610,17 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache;
 	yaffs_Device *dev = in->myDev;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+		ylist_for_each_safe(i, n, &dev->srCacheLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->object == in)
+				yaffs_ReleaseChunkCache(dev, cache);
 		}
 	}
 }
@@ -3443,12 +3645,34 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	int nToCopy;
 	int n = nBytes;
 	int nDone = 0;
+	int sequential;
+	int missed;
 	yaffs_ChunkCache *cache;
 
 	yaffs_Device *dev;
 
 	dev = in->myDev;
 
+	/* A read that starts where the last one on this object stopped is
+	 * treated as sequential and grows the read-ahead window.
+	 */
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	chunk++;
+	sequential = (in->objectId == dev->srReadObjectId &&
+			chunk == dev->srReadNextChunk);
+	if (!sequential)
+		dev->srReadAhead = 0;
+	else if (dev->srReadAhead == 0)
+		dev->srReadAhead = 1;
+	else
+		dev->srReadAhead <<= 1;
+
+	/* Leave most of the cache for data that is not read ahead */
+	if (dev->srReadAhead > dev->param.nShortOpCaches / 4)
+		dev->srReadAhead = dev->param.nShortOpCaches / 4;
+	if (dev->srReadAhead > YAFFS_CACHE_READAHEAD_MAX)
+		dev->srReadAhead = YAFFS_CACHE_READAHEAD_MAX;
+
 	while (n > 0) {
 		/* chunk = offset / dev->nDataBytesPerChunk + 1; */
 		/* start = offset % dev->nDataBytesPerChunk; */
@@ -3464,6 +3688,7 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			nToCopy = dev->nDataBytesPerChunk - start;
 
 		cache = yaffs_FindChunkCache(in, chunk);
+		missed = 0;
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
@@ -3475,15 +3700,18 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
+					dev->cacheMisses++;
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AssignChunkCache(dev, cache,
+								in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
+					missed = 1;
+				} else {
+					dev->cacheHits++;
+					if (cache->readAhead)
+						dev->cacheReadAheadHits++;
 				}
 
 				yaffs_UseChunkCache(dev, cache, 0);
@@ -3513,9 +3741,15 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 			/* A full chunk. Read directly into the supplied buffer. */
 			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
-
+			missed = 1;
 		}
 
+		/* A sequential read that had to go to NAND, whether through the
+		 * cache or directly, fills the cache with the chunks after it.
+		 */
+		if (missed && dev->srReadAhead > 0)
+			yaffs_ReadAheadChunkCache(in, chunk + 1, dev->srReadAhead);
+
 		n -= nToCopy;
 		offset += nToCopy;
 		buffer += nToCopy;
@@ -3523,6 +3757,10 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 	}
 
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	dev->srReadObjectId = in->objectId;
+	dev->srReadNextChunk = chunk + 1;
+
 	return nDone;
 }
 
@@ -3561,6 +3799,16 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 		 * the same chunk.
 		 */
 
+		chunkStart = ((chunk - 1) * dev->nDataBytesPerChunk);
+
+		if (chunkStart > in->variant.fileVariant.fileSize)
+			nBytesRead = 0; /* Past end of file */
+		else
+			nBytesRead = in->variant.fileVariant.fileSize - chunkStart;
+
+		if (nBytesRead > dev->nDataBytesPerChunk)
+			nBytesRead = dev->nDataBytesPerChunk;
+
 		if ((start + n) < dev->nDataBytesPerChunk) {
 			nToCopy = n;
 
@@ -3569,16 +3817,6 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			 * we need to write back as much as was there before.
 			 */
 
-			chunkStart = ((chunk - 1) * dev->nDataBytesPerChunk);
-
-			if (chunkStart > in->variant.fileVariant.fileSize)
-				nBytesRead = 0; /* Past end of file */
-			else
-				nBytesRead = in->variant.fileVariant.fileSize - chunkStart;
-
-			if (nBytesRead > dev->nDataBytesPerChunk)
-				nBytesRead = dev->nDataBytesPerChunk;
-
 			nToWriteBack =
 			    (nBytesRead >
 			     (start + n)) ? nBytesRead : (start + n);
@@ -3597,18 +3835,30 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			 */
 			if (dev->param.nShortOpCaches > 0) {
 				yaffs_ChunkCache *cache;
-				/* If we can't find the data in the cache, then load the cache */
+				/* If we can't find the data in the cache, then load the cache.
+				 * There is nothing to read if the write covers all the data
+				 * already in the chunk.
+				 */
 				cache = yaffs_FindChunkCache(in, chunk);
+				if (cache)
+					dev->cacheHits++;
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
+					dev->cacheMisses++;
 					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->data);
+					yaffs_AssignChunkCache(dev, cache,
+								in, chunk);
+					if (chunkStart >= in->variant.fileVariant.fileSize ||
+					    (start == 0 && nToCopy >= nBytesRead)) {
+						memset(cache->data, 0,
+							dev->nDataBytesPerChunk);
+						dev->cacheSkippedReads++;
+					} else
+						yaffs_ReadChunkDataFromObject(in, chunk,
+									cache->data);
+				} else if (cache && cache->dirty) {
+					dev->cacheCoalescedWrites++;
 				} else if (cache &&
 					!cache->dirty &&
 					!yaffs_CheckSpaceForAllocation(dev, 1)) {
@@ -3637,7 +3887,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						yaffs_SetCacheClean(dev, cache);
 					}
 
 				} else {
@@ -3799,6 +4049,9 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	if (in->variantType != YAFFS_OBJECT_TYPE_FILE)
 		return YAFFS_FAIL;
 
+	if (!yaffs_CheckFileChunksLoaded(in))
+		return YAFFS_FAIL;
+
 	if (newSize == oldFileSize)
 		return YAFFS_OK;
 		
@@ -3937,6 +4190,9 @@ int yaffs_DeleteFile(yaffs_Object *in)
 	int deleted; /* Need to cache value on stack if in is freed */
 	yaffs_Device *dev = in->myDev;
 
+	if (!yaffs_CheckFileChunksLoaded(in))
+		return YAFFS_FAIL;
+
 	if (dev->param.disableSoftDelete || dev->param.isYaffs2)
 		yaffs_ResizeFile(in, 0);
 
@@ -5294,37 +5550,67 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 	dev->srCache = NULL;
 	dev->gcCleanupList = NULL;
+	dev->sumTags = NULL;
 
 
+	dev->srCacheHash = NULL;
+	YINIT_LIST_HEAD(&dev->srCacheLru);
+	YINIT_LIST_HEAD(&dev->srCacheFree);
+	YINIT_LIST_HEAD(&dev->srCacheDirty);
+	dev->srDirtyCaches = 0;
+
 	if (!init_failed &&
 	    dev->param.nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
 
 		if (dev->param.nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		for (dev->srCacheBuckets = 1;
+		     dev->srCacheBuckets < dev->param.nShortOpCaches;
+		     dev->srCacheBuckets <<= 1) {}
+
 		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srCacheHash = YMALLOC(dev->srCacheBuckets *
+					sizeof(struct ylist_head));
 
 		buf = (__u8 *) dev->srCache;
+		if (!dev->srCacheHash)
+			buf = NULL;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < dev->srCacheBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srCacheHash[i]);
+
 		for (i = 0; i < dev->param.nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].dirtyLink);
+			ylist_add_tail(&dev->srCache[i].lruLink,
+					&dev->srCacheFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->param.totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
+	dev->srReadObjectId = 0;
+	dev->srReadNextChunk = 0;
+	dev->srReadAhead = 0;
+
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->cacheReadAheads = 0;
+	dev->cacheReadAheadHits = 0;
+	dev->cacheCoalescedWrites = 0;
+	dev->cacheSkippedReads = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->param.nChunksPerBlock * sizeof(__u32));
@@ -5332,6 +5618,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			init_failed = 1;
 	}
 
+	if (!init_failed && !yaffs2_SummaryInitialise(dev))
+		init_failed = 1;
+
 	if (dev->param.isYaffs2)
 		dev->param.useHeaderFileSize = 1;
 
@@ -5425,6 +5714,7 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 		int i;
 
 		yaffs_DeinitialiseBlocks(dev);
+		yaffs2_FreeAllDeferredChunks(dev);
 		yaffs_DeinitialiseTnodesAndObjects(dev);
 		if (dev->param.nShortOpCaches > 0 &&
 		    dev->srCache) {
@@ -5439,8 +5729,14 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		if (dev->srCacheHash)
+			YFREE(dev->srCacheHash);
+		dev->srCacheHash = NULL;
+
 		YFREE(dev->gcCleanupList);
 
+		yaffs2_SummaryDeinitialise(dev);
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -5485,7 +5781,6 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int nFree;
 	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -5497,10 +5792,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->param.nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	nDirtyCacheChunks = dev->srDirtyCaches;
 
 	nFree -= nDirtyCacheChunks;
 
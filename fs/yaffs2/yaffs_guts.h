@@ -87,8 +87,18 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
+/* Pseudo object id for block summary chunks */
+#define YAFFS_OBJECTID_SUMMARY		0x11
+#define YAFFS_SUMMARY_VERSION		1
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+
+#define YAFFS_MAX_SHORT_OP_CACHES	256
+
+/* Largest number of chunks read ahead into the short op cache */
+#define YAFFS_CACHE_READAHEAD_MAX	8
+
+/* Erased blocks above the reserve in which gc is aggressive but in steps */
+#define YAFFS_GC_STEP_BLOCKS		4
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -115,10 +125,13 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
+	int readAhead;		/* Loaded by read-ahead and not used yet */
+	struct ylist_head hashLink;	/* Entry in the (object, chunk) hash */
+	struct ylist_head lruLink;	/* Entry in the LRU list or the free list */
+	struct ylist_head dirtyLink;	/* Entry in the dirty list */
 	__u8 *data;
 } yaffs_ChunkCache;
 
@@ -294,6 +307,26 @@ typedef struct {
 
 } yaffs_BlockInfo;
 
+/* ------------------------- Block summary structure ------------------------*/
+
+/*
+ * A yaffs2 block can end with a summary chunk holding the tags of all the
+ * other chunks in the block, so that a scan reads one chunk per block
+ * instead of the tags of every chunk.
+ */
+typedef struct {
+	unsigned version;
+	unsigned block;
+	unsigned seq;
+	unsigned sum;
+} yaffs_SummaryHeader;
+
+typedef struct {
+	unsigned objectId;	/* 0 if the chunk was not written */
+	unsigned chunkId;
+	unsigned byteCount;
+} yaffs_SummaryTags;
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -366,12 +399,23 @@ typedef union yaffs_Tnode_union yaffs_Tnode;
  * - a hard link
  */
 
+/*
+ * Blocks holding data chunks of a file whose tnode tree has not been built
+ * yet (lazy file loading), newest block first.
+ */
+typedef struct {
+	int nBlocks;
+	int maxBlocks;
+	int *block;
+} yaffs_DeferredChunks;
+
 typedef struct {
 	__u32 fileSize;
 	__u32 scannedFileSize;
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	yaffs_DeferredChunks *deferred;	/* Data chunks not in the tree yet */
 } yaffs_FileStructure;
 
 typedef struct {
@@ -552,6 +596,9 @@ struct yaffs_DeviceParamStruct {
 
 	int enableXattr;	/* Enable xattribs */
 
+	int enableSummary;	/* yaffs2: write block summaries for fast scanning */
+	int lazyFileLoad;	/* yaffs2: build file tnode trees on first use, not at scan */
+
 	/* NAND access functions (Must be set before calling YAFFS)*/
 
 	int (*writeChunkToNAND) (struct yaffs_DeviceStruct *dev,
@@ -701,11 +748,17 @@ struct yaffs_DeviceStruct {
 	unsigned gcBlockFinder;
 	unsigned gcDirtiest;
 	unsigned gcPagesInUse;
+	unsigned gcScore;	/* cost-benefit score of gcDirtiest */
 	unsigned gcNotDone;
 	unsigned gcBlock;
 	unsigned gcChunk;
 	unsigned gcSkip;
 
+	/* Block summaries */
+	yaffs_SummaryTags *sumTags;	/* Tags of the block being filled or scanned */
+	int summaryBlock;		/* Block sumTags is collecting for, -1 if none */
+	int chunksPerSummary;		/* Chunks per block available for data */
+
 	/* Special directories */
 	yaffs_Object *rootDir;
 	yaffs_Object *lostNFoundDir;
@@ -719,7 +772,17 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srCacheHash;	/* Buckets hashed on object and chunk */
+	int srCacheBuckets;		/* Power of two */
+	struct ylist_head srCacheLru;	/* In use, most recently used first */
+	struct ylist_head srCacheFree;	/* Not in use */
+	struct ylist_head srCacheDirty;	/* Dirty, not yet written */
+	int srDirtyCaches;
+
+	/* Sequential read detection for cache read-ahead */
+	int srReadObjectId;
+	int srReadNextChunk;
+	int srReadAhead;		/* Current read-ahead window in chunks */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -758,6 +821,11 @@ struct yaffs_DeviceStruct {
 	__u32 passiveGCs;
 	__u32 oldestDirtyGCs;
 	__u32 nGCBlocks;
+	__u32 nGCSteps;
+	__u32 nSummaryScans;	/* Blocks scanned using their summary */
+	__u32 nFullScans;	/* Blocks scanned chunk by chunk */
+	__u32 nDeferredFiles;	/* Files whose tnode tree is not loaded yet */
+	__u32 nDeferredLoads;	/* Files loaded on demand since mount */
 	__u32 backgroundGCs;
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
@@ -769,6 +837,11 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 cacheMisses;
+	__u32 cacheReadAheads;		/* Chunks loaded by read-ahead */
+	__u32 cacheReadAheadHits;	/* ...that were then used */
+	__u32 cacheCoalescedWrites;	/* Partial writes into a dirty chunk */
+	__u32 cacheSkippedReads;	/* Partial writes needing no chunk read */
 
 };
 
@@ -925,6 +998,9 @@ void yaffs_GutsTest(yaffs_Device *dev);
 void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn);
 int yaffs_CheckFF(__u8 *buffer, int nBytes);
 void yaffs_HandleChunkError(yaffs_Device *dev, yaffs_BlockInfo *bi);
+void yaffs_HandleWriteChunkError(yaffs_Device *dev, int chunkInNAND,
+		int erasedOk);
+int yaffs_CheckFileChunksLoaded(yaffs_Object *in);
 
 __u8 *yaffs_GetTempBuffer(yaffs_Device *dev, int lineNo);
 void yaffs_ReleaseTempBuffer(yaffs_Device *dev, __u8 *buffer, int lineNo);
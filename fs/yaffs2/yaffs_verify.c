@@ -283,6 +283,10 @@ void yaffs_VerifyFile(yaffs_Object *obj)
 	if (yaffs_SkipVerification(obj->myDev))
 		return;
 
+	/* Lazily loaded file, no tree to check yet */
+	if (obj->variant.fileVariant.deferred)
+		return;
+
 	dev = obj->myDev;
 	objectId = obj->objectId;
 
@@ -96,6 +96,7 @@
 #endif
 
 #include <asm/div64.h>
+#include <linux/math64.h>
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 
@@ -2253,6 +2254,10 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 0;
 	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
 		return 0;
+	else if(dev->nErasedBlocks < dev->param.nReservedBlocks +
+			dev->nCheckpointBlocksRequired + 1 +
+			YAFFS_GC_STEP_BLOCKS)
+		return 2; /* writers are taking gc steps, take over from them */
 	else if(erasedChunks > dev->nFreeChunks/2)
 		return 0;
 	else if(erasedChunks > dev->nFreeChunks/4)
@@ -2261,6 +2266,20 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 2;
 }
 
+/*
+ * Number of bounded gc steps the background thread takes per wake up.
+ * The device lock is dropped between steps.
+ */
+static unsigned yaffs_bg_gc_steps(unsigned urgency)
+{
+	if(urgency > 1)
+		return 16;
+	else if(urgency > 0)
+		return 4;
+	else
+		return 1;
+}
+
 static int yaffs_do_sync_fs(struct super_block *sb,
 				int request_checkpoint)
 {
@@ -2321,6 +2340,7 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long next_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
+	unsigned int step;
 
 	int gcResult;
 	struct timer_list timer;
@@ -2355,7 +2375,17 @@ static int yaffs_BackgroundThread(void *data)
 		if(time_after(now,next_gc) && yaffs_bg_enable){
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
-				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
+				for(step = 0; step < yaffs_bg_gc_steps(urgency); step++){
+					gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
+					if(gcResult || kthread_should_stop())
+						break;
+					/* Let readers and writers in between steps */
+					yaffs_GrossUnlock(dev);
+					cond_resched();
+					yaffs_GrossLock(dev);
+					if(dev->isCheckpointed)
+						break;
+				}
 				if(urgency > 1)
 					next_gc = now + HZ/20+1;
 				else if(urgency > 0)
@@ -2606,12 +2636,17 @@ typedef struct {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int summary_enabled;
+	int summary_overridden;
+	int lazy_file_loading_enabled;
+	int lazy_file_loading_overridden;
 } yaffs_options;
 
 #define MAX_OPT_LEN 30
@@ -2658,8 +2693,31 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")){
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden=1;
+		} else if (!strcmp(cur_opt, "summary-off")){
+			options->summary_enabled = 0;
+			options->summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "summary-on")){
+			options->summary_enabled = 1;
+			options->summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "lazy-file-loading-off")){
+			options->lazy_file_loading_enabled = 0;
+			options->lazy_file_loading_overridden = 1;
+		} else if (!strcmp(cur_opt, "lazy-file-loading-on")){
+			options->lazy_file_loading_enabled = 1;
+			options->lazy_file_loading_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->cache_size =
+				simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->cache_size < 1 ||
+			    options->cache_size > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+					"yaffs: cache-size must be 1..%d\n",
+					YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
+		}
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -2916,7 +2974,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	param->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	param->nReservedBlocks = 5;
-	param->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->nShortOpCaches = 0;
+	else if (options.cache_size)
+		param->nShortOpCaches = options.cache_size;
+	else
+		param->nShortOpCaches = 10;
 	param->inbandTags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2957,6 +3020,18 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	if(options.empty_lost_and_found_overridden)
 		param->emptyLostAndFound = options.empty_lost_and_found;
 
+#ifdef CONFIG_YAFFS_BLOCK_SUMMARY
+	param->enableSummary = 1;
+#endif
+	if(options.summary_overridden)
+		param->enableSummary = options.summary_enabled;
+
+#ifdef CONFIG_YAFFS_LAZY_FILE_LOADING
+	param->lazyFileLoad = 1;
+#endif
+	if(options.lazy_file_loading_overridden)
+		param->lazyFileLoad = options.lazy_file_loading_enabled;
+
 	/* ... and the functions. */
 	if (yaffsVersion == 2) {
 		param->writeChunkWithTagsToNAND =
@@ -3214,6 +3289,12 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "chunkGroupSize..... %d\n", dev->chunkGroupSize);
 	buf += sprintf(buf, "nErasedBlocks...... %d\n", dev->nErasedBlocks);
 	buf += sprintf(buf, "blocksInCheckpoint. %d\n", dev->blocksInCheckpoint);
+	buf += sprintf(buf, "enableSummary...... %d\n", dev->sumTags ? 1 : 0);
+	buf += sprintf(buf, "nSummaryScans...... %u\n", dev->nSummaryScans);
+	buf += sprintf(buf, "nFullScans......... %u\n", dev->nFullScans);
+	buf += sprintf(buf, "lazyFileLoad....... %d\n", dev->param.lazyFileLoad);
+	buf += sprintf(buf, "nDeferredFiles..... %u\n", dev->nDeferredFiles);
+	buf += sprintf(buf, "nDeferredLoads..... %u\n", dev->nDeferredLoads);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nTnodes............ %d\n", dev->nTnodes);
 	buf += sprintf(buf, "nObjects........... %d\n", dev->nObjects);
@@ -3227,6 +3308,7 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "passiveGCs......... %u\n", dev->passiveGCs);
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "nGCBlocks.......... %u\n", dev->nGCBlocks);
+	buf += sprintf(buf, "nGCSteps........... %u\n", dev->nGCSteps);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
@@ -3235,6 +3317,16 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %u\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %u\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %u\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %u\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheHitPercent.... %u\n",
+		(dev->cacheHits + dev->cacheMisses) ?
+		(unsigned)div_u64((u64)dev->cacheHits * 100,
+			dev->cacheHits + dev->cacheMisses) : 0);
+	buf += sprintf(buf, "cacheReadAheads.... %u\n", dev->cacheReadAheads);
+	buf += sprintf(buf, "cacheReadAheadHits. %u\n", dev->cacheReadAheadHits);
+	buf += sprintf(buf, "cacheCoalesced..... %u\n", dev->cacheCoalescedWrites);
+	buf += sprintf(buf, "cacheSkippedReads.. %u\n", dev->cacheSkippedReads);
+	buf += sprintf(buf, "cacheDirty......... %d\n", dev->srDirtyCaches);
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
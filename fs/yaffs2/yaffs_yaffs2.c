@@ -19,6 +19,7 @@
 #include "yaffs_bitmap.h"
 #include "yaffs_qsort.h"
 #include "yaffs_nand.h"
+#include "yaffs_tagsvalidity.h"
 #include "yaffs_getblockinfo.h"
 #include "yaffs_verify.h"
 
@@ -673,6 +674,12 @@ static int yaffs2_WriteCheckpointData(yaffs_Device *dev)
 		ok = 0;
 	}
 
+	if (ok && !yaffs2_LoadAllDeferredChunks(dev)) {
+		T(YAFFS_TRACE_CHECKPOINT,
+		  (TSTR("could not load all files, skipping checkpoint write" TENDSTR)));
+		ok = 0;
+	}
+
 	if (ok)
 		ok = yaffs2_CheckpointOpen(dev, 1);
 
@@ -890,6 +897,353 @@ int yaffs2_HandleHole(yaffs_Object *obj, loff_t newSize)
 
 }
 
+/*--------------------- Block summaries --------------------*/
+
+/*
+ * The summary goes in the last chunk of each block. It is written as soon as
+ * the last data chunk has been, so every block that filled up normally has
+ * one. Blocks cut short by write errors, or being filled when the device was
+ * unmounted, are just scanned chunk by chunk.
+ */
+
+int yaffs2_SummaryInitialise(yaffs_Device *dev)
+{
+	int nBytes;
+
+	dev->sumTags = NULL;
+	dev->summaryBlock = -1;
+	dev->chunksPerSummary = dev->param.nChunksPerBlock;
+
+	if (!dev->param.isYaffs2 || !dev->param.enableSummary)
+		return YAFFS_OK;
+
+	nBytes = (dev->param.nChunksPerBlock - 1) * sizeof(yaffs_SummaryTags);
+	if (sizeof(yaffs_SummaryHeader) + nBytes > dev->nDataBytesPerChunk) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: block summary does not fit in a chunk, disabled" TENDSTR)));
+		return YAFFS_OK;
+	}
+
+	dev->sumTags = YMALLOC(nBytes);
+	if (!dev->sumTags)
+		return YAFFS_FAIL;
+
+	dev->chunksPerSummary = dev->param.nChunksPerBlock - 1;
+	return YAFFS_OK;
+}
+
+void yaffs2_SummaryDeinitialise(yaffs_Device *dev)
+{
+	if (dev->sumTags)
+		YFREE(dev->sumTags);
+	dev->sumTags = NULL;
+	dev->summaryBlock = -1;
+}
+
+/* Start collecting the summary of a newly allocated block */
+void yaffs2_SummaryClear(yaffs_Device *dev, int blk)
+{
+	if (!dev->sumTags)
+		return;
+
+	memset(dev->sumTags, 0, dev->chunksPerSummary * sizeof(yaffs_SummaryTags));
+	dev->summaryBlock = blk;
+}
+
+static unsigned yaffs2_SummarySum(yaffs_Device *dev, yaffs_SummaryTags *sumTags)
+{
+	__u8 *p = (__u8 *) sumTags;
+	int nBytes = dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+	unsigned sum = 0;
+
+	while (nBytes--)
+		sum += *p++;
+
+	return sum;
+}
+
+static void yaffs2_SummaryWrite(yaffs_Device *dev, int blk)
+{
+	yaffs_ExtendedTags tags;
+	yaffs_SummaryHeader hdr;
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	int nBytes = dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+	int chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+	__u8 *buffer = yaffs_GetTempBuffer(dev, __LINE__);
+
+	hdr.version = YAFFS_SUMMARY_VERSION;
+	hdr.block = blk;
+	hdr.seq = bi->sequenceNumber;
+	hdr.sum = yaffs2_SummarySum(dev, dev->sumTags);
+
+	memset(buffer, 0xff, dev->nDataBytesPerChunk);
+	memcpy(buffer, &hdr, sizeof(hdr));
+	memcpy(buffer + sizeof(hdr), dev->sumTags, nBytes);
+
+	yaffs_InitialiseTags(&tags);
+	tags.objectId = YAFFS_OBJECTID_SUMMARY;
+	tags.chunkId = 1;
+	tags.byteCount = sizeof(hdr) + nBytes;
+
+	/*
+	 * The summary chunk is never "in use": it is space that comes back
+	 * when the block is erased, like a deleted chunk. It is accounted as
+	 * in use only while being written, so that a failed write can be
+	 * cleaned up, and the block retired, like any other.
+	 */
+	yaffs_SetChunkBit(dev, blk, dev->chunksPerSummary);
+	bi->pagesInUse++;
+	dev->nFreeChunks--;
+
+	if (yaffs_WriteChunkWithTagsToNAND(dev, chunk, buffer, &tags) != YAFFS_OK) {
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: failed to write summary for block %d" TENDSTR), blk));
+		yaffs_HandleWriteChunkError(dev, chunk, 1);
+	} else {
+		yaffs_ClearChunkBit(dev, blk, dev->chunksPerSummary);
+		bi->pagesInUse--;
+		dev->nFreeChunks++;
+	}
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+}
+
+/*
+ * Record the tags of a chunk just written. Once the last data chunk of the
+ * block is in, write the summary out.
+ */
+void yaffs2_SummaryAdd(yaffs_Device *dev, yaffs_ExtendedTags *tags, int chunkInNAND)
+{
+	int blk = chunkInNAND / dev->param.nChunksPerBlock;
+	int c = chunkInNAND % dev->param.nChunksPerBlock;
+	yaffs_SummaryTags *st;
+
+	if (!dev->sumTags || blk != dev->summaryBlock)
+		return;
+
+	st = &dev->sumTags[c];
+	st->objectId = tags->objectId;
+	st->chunkId = tags->chunkId;
+	st->byteCount = tags->byteCount;
+
+	if (c == dev->chunksPerSummary - 1) {
+		yaffs2_SummaryWrite(dev, blk);
+		dev->summaryBlock = -1;
+	}
+}
+
+/*
+ * Load the summary of a block into sumTags.
+ * Returns non-zero if the block has a valid summary.
+ */
+static int yaffs2_SummaryRead(yaffs_Device *dev, yaffs_SummaryTags *sumTags,
+				int blk, yaffs_BlockInfo *bi)
+{
+	yaffs_ExtendedTags tags;
+	yaffs_SummaryHeader hdr;
+	int nBytes = dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+	int chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+	int ok = 0;
+	__u8 *buffer = yaffs_GetTempBuffer(dev, __LINE__);
+
+	yaffs_ReadChunkWithTagsFromNAND(dev, chunk, buffer, &tags);
+
+	if (tags.chunkUsed &&
+	    tags.eccResult != YAFFS_ECC_RESULT_UNFIXED &&
+	    tags.objectId == YAFFS_OBJECTID_SUMMARY &&
+	    tags.sequenceNumber == bi->sequenceNumber &&
+	    tags.byteCount == sizeof(hdr) + nBytes) {
+		memcpy(&hdr, buffer, sizeof(hdr));
+		memcpy(sumTags, buffer + sizeof(hdr), nBytes);
+
+		ok = (hdr.version == YAFFS_SUMMARY_VERSION &&
+		      hdr.block == blk &&
+		      hdr.seq == bi->sequenceNumber &&
+		      hdr.sum == yaffs2_SummarySum(dev, sumTags));
+	}
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+
+	return ok;
+}
+
+/*
+ * Get the tags of chunk c of a block being scanned from its summary.
+ * Only object headers are read from NAND, for the extra header info in
+ * their tags.
+ */
+static void yaffs2_SummaryGetTags(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int chunk, int c, yaffs_ExtendedTags *tags)
+{
+	yaffs_SummaryTags *st = &dev->sumTags[c];
+
+	if (st->objectId && st->chunkId == 0) {
+		yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, tags);
+		return;
+	}
+
+	yaffs_InitialiseTags(tags);
+	tags->chunkUsed = (st->objectId != 0);
+	tags->objectId = st->objectId;
+	tags->chunkId = st->chunkId;
+	tags->byteCount = st->byteCount;
+	tags->eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+	tags->sequenceNumber = bi->sequenceNumber;
+}
+
+/*
+ * Lazy file loading: the scan only accounts for the data chunks of a file
+ * and notes which blocks hold them. The tnode tree is built from those
+ * blocks when the file is first used, see yaffs_CheckFileChunksLoaded().
+ *
+ * Until then, stale copies of the file's chunks that a normal scan would
+ * have deleted stay in use, so free space is underestimated a little.
+ */
+static int yaffs2_DeferChunk(yaffs_Object *in, int blk)
+{
+	yaffs_DeferredChunks *dc = in->variant.fileVariant.deferred;
+	int *newBlock;
+	int newMax;
+
+	if (!dc) {
+		dc = YMALLOC(sizeof(yaffs_DeferredChunks));
+		if (!dc)
+			return YAFFS_FAIL;
+		memset(dc, 0, sizeof(yaffs_DeferredChunks));
+		in->variant.fileVariant.deferred = dc;
+		in->myDev->nDeferredFiles++;
+	}
+
+	/* Blocks are scanned one at a time, so only the last entry can match */
+	if (dc->nBlocks > 0 && dc->block[dc->nBlocks - 1] == blk)
+		return YAFFS_OK;
+
+	if (dc->nBlocks == dc->maxBlocks) {
+		newMax = dc->maxBlocks ? dc->maxBlocks * 2 : 4;
+		newBlock = YMALLOC(newMax * sizeof(int));
+		if (!newBlock)
+			return YAFFS_FAIL;
+		if (dc->block) {
+			memcpy(newBlock, dc->block, dc->nBlocks * sizeof(int));
+			YFREE(dc->block);
+		}
+		dc->block = newBlock;
+		dc->maxBlocks = newMax;
+	}
+
+	dc->block[dc->nBlocks++] = blk;
+
+	return YAFFS_OK;
+}
+
+void yaffs2_FreeDeferredChunks(yaffs_Object *in)
+{
+	yaffs_DeferredChunks *dc = in->variant.fileVariant.deferred;
+
+	if (!dc)
+		return;
+
+	if (dc->block)
+		YFREE(dc->block);
+	YFREE(dc);
+	in->variant.fileVariant.deferred = NULL;
+	in->myDev->nDeferredFiles--;
+}
+
+void yaffs2_FreeAllDeferredChunks(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int i;
+
+	for (i = 0; dev->nDeferredFiles && i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE)
+				yaffs2_FreeDeferredChunks(obj);
+		}
+	}
+}
+
+/*
+ * Build the tnode tree of a lazily loaded file by replaying its data chunks
+ * the way the scan would have: newest block first, and within a block
+ * newest chunk first, so older duplicates get deleted.
+ */
+int yaffs2_LoadDeferredChunks(yaffs_Object *in)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_DeferredChunks *dc = in->variant.fileVariant.deferred;
+	yaffs_SummaryTags *sumTags = NULL;
+	yaffs_ExtendedTags tags;
+	yaffs_BlockInfo *bi;
+	int haveSummary;
+	int objectId;
+	int chunkId;
+	int chunk;
+	int blk;
+	int i;
+	int c;
+	int result = YAFFS_OK;
+
+	/* dev->sumTags is in use collecting the current block's summary */
+	if (dev->sumTags)
+		sumTags = YMALLOC(dev->chunksPerSummary * sizeof(yaffs_SummaryTags));
+
+	for (i = 0; result == YAFFS_OK && i < dc->nBlocks; i++) {
+		blk = dc->block[i];
+		bi = yaffs_GetBlockInfo(dev, blk);
+
+		haveSummary = (sumTags && yaffs2_SummaryRead(dev, sumTags, blk, bi));
+
+		for (c = dev->param.nChunksPerBlock - 1;
+		     result == YAFFS_OK && c >= 0; c--) {
+			if (!yaffs_CheckChunkBit(dev, blk, c))
+				continue;
+
+			chunk = blk * dev->param.nChunksPerBlock + c;
+
+			if (haveSummary) {
+				if (c >= dev->chunksPerSummary)
+					continue;
+				objectId = sumTags[c].objectId;
+				chunkId = sumTags[c].chunkId;
+			} else {
+				yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, &tags);
+				objectId = tags.objectId;
+				chunkId = tags.chunkId;
+			}
+
+			if (objectId == in->objectId && chunkId > 0)
+				result = yaffs_PutChunkIntoFile(in, chunkId, chunk, -1);
+		}
+	}
+
+	if (sumTags)
+		YFREE(sumTags);
+
+	return result;
+}
+
+/* Checkpoints hold the tnode trees, so every file must be loaded first */
+int yaffs2_LoadAllDeferredChunks(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	struct ylist_head *lh;
+	int ok = 1;
+	int i;
+
+	for (i = 0; ok && dev->nDeferredFiles && i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (ok)
+				ok = yaffs_CheckFileChunksLoaded(obj);
+		}
+	}
+
+	return ok;
+}
+
 
 typedef struct {
 	int seq;
@@ -938,6 +1292,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	int foundChunksInBlock;
 	int equivalentObjectId;
 	int alloc_failed = 0;
+	int haveSummary;
 
 
 	yaffs_BlockIndex *blockIndex = NULL;
@@ -1063,6 +1418,14 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		haveSummary = (dev->sumTags &&
+			state == YAFFS_BLOCK_STATE_NEEDS_SCANNING &&
+			yaffs2_SummaryRead(dev, dev->sumTags, blk, bi));
+		if (haveSummary)
+			dev->nSummaryScans++;
+		else
+			dev->nFullScans++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -1075,8 +1438,17 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (haveSummary && c >= dev->chunksPerSummary) {
+				/* The summary itself, already read */
+				yaffs_InitialiseTags(&tags);
+				tags.chunkUsed = 1;
+				tags.eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+				tags.objectId = YAFFS_OBJECTID_SUMMARY;
+			} else if (haveSummary)
+				yaffs2_SummaryGetTags(dev, bi, chunk, c, &tags);
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
+								&tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1132,6 +1504,11 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 				  dev->nFreeChunks++;
 
+			} else if (tags.objectId == YAFFS_OBJECTID_SUMMARY) {
+				/* Summary chunk: not data, but it shows the block was filled */
+				foundChunksInBlock = 1;
+				dev->nFreeChunks++;
+
 			} else if (tags.objectId > YAFFS_MAX_OBJECT_ID ||
 				tags.chunkId > YAFFS_MAX_CHUNK_ID ||
 				(tags.chunkId > 0 && tags.byteCount > dev->nDataBytesPerChunk) ||
@@ -1167,7 +1544,10 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 				    in->variantType == YAFFS_OBJECT_TYPE_FILE
 				    && chunkBase < in->variant.fileVariant.shrinkSize) {
 					/* This has not been invalidated by a resize */
-					if (!yaffs_PutChunkIntoFile(in, tags.chunkId, chunk, -1)) {
+					if (dev->param.lazyFileLoad) {
+						if (!yaffs2_DeferChunk(in, blk))
+							alloc_failed = 1;
+					} else if (!yaffs_PutChunkIntoFile(in, tags.chunkId, chunk, -1)) {
 						alloc_failed = 1;
 					}
 
@@ -30,6 +30,16 @@ void yaffs2_InvalidateCheckpoint(yaffs_Device *dev);
 int yaffs2_CheckpointSave(yaffs_Device *dev);
 int yaffs2_CheckpointRestore(yaffs_Device *dev);
 
+int yaffs2_SummaryInitialise(yaffs_Device *dev);
+void yaffs2_SummaryDeinitialise(yaffs_Device *dev);
+void yaffs2_SummaryClear(yaffs_Device *dev, int blk);
+void yaffs2_SummaryAdd(yaffs_Device *dev, yaffs_ExtendedTags *tags, int chunkInNAND);
+
+int yaffs2_LoadDeferredChunks(yaffs_Object *in);
+int yaffs2_LoadAllDeferredChunks(yaffs_Device *dev);
+void yaffs2_FreeDeferredChunks(yaffs_Object *in);
+void yaffs2_FreeAllDeferredChunks(yaffs_Device *dev);
+
 int yaffs2_HandleHole(yaffs_Object *obj, loff_t newSize);
 int yaffs2_ScanBackwards(yaffs_Device *dev);
 
@@ -31,6 +31,7 @@ struct cleancache_ops {
 	void (*flush_page)(int, struct cleancache_filekey, pgoff_t);
 	void (*flush_inode)(int, struct cleancache_filekey);
 	void (*flush_fs)(int);
+	unsigned long (*total_pages)(void);	/* optional */
 };
 
 extern struct cleancache_ops
@@ -44,6 +45,15 @@ extern void __cleancache_flush_inode(struct address_space *);
 extern void __cleancache_flush_fs(struct super_block *);
 extern int cleancache_enabled;
 
+#ifdef CONFIG_CLEANCACHE
+extern unsigned long cleancache_total_pages(void);
+#else
+static inline unsigned long cleancache_total_pages(void)
+{
+	return 0;
+}
+#endif
+
 #ifdef CONFIG_CLEANCACHE
 static inline bool cleancache_fs_enabled(struct page *page)
 {
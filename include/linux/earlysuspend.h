@@ -29,6 +29,10 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ * Handlers that set async may run in parallel with the other handlers of the
+ * same level; all handlers of a level finish before the next level starts.
+ * An async handler must not depend on another handler of its own level, and
+ * must not call async_synchronize_full().
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
@@ -41,6 +45,10 @@ struct early_suspend {
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	unsigned int async:1;
+	/* duration of the last calls, for the debugfs statistics */
+	unsigned long suspend_us;
+	unsigned long resume_us;
 #endif
 };
 
@@ -308,6 +308,23 @@ extern void trap_init(void);
 extern void update_process_times(int user);
 extern void scheduler_tick(void);
 
+/*
+ * Scheduler events passed to a cpufreq governor, so it can pick frequencies
+ * at scheduler activity instead of running its own sampling timers.
+ */
+#define SCHED_FREQ_TICK		0x1	/* periodic tick on a busy cpu */
+#define SCHED_FREQ_IDLE_ENTER	0x2	/* the cpu switched to its idle task */
+#define SCHED_FREQ_IDLE_EXIT	0x4	/* the cpu switched away from idle */
+
+#ifdef CONFIG_CPU_FREQ
+struct sched_freq_hook {
+	void (*func)(struct sched_freq_hook *hook, int cpu, unsigned int event);
+};
+
+extern void sched_freq_hook_register(int cpu, struct sched_freq_hook *hook);
+extern void sched_freq_hook_unregister(int cpu);
+#endif
+
 extern void sched_show_task(struct task_struct *p);
 
 #ifdef CONFIG_DETECT_SOFTLOCKUP
@@ -17,6 +17,7 @@
 #define _LINUX_WAKELOCK_H
 
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/ktime.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
@@ -32,9 +33,12 @@ enum {
 	WAKE_LOCK_TYPE_COUNT
 };
 
+struct wake_lock_uid_stat;
+
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      node;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -47,6 +51,7 @@ struct wake_lock {
 		ktime_t         prevent_suspend_time;
 		ktime_t         max_time;
 		ktime_t         last_time;
+		struct wake_lock_uid_stat *uid_stat;
 	} stat;
 #endif
 #endif
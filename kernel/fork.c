@@ -48,6 +48,7 @@
 #include <linux/memcontrol.h>
 #include <linux/ftrace.h>
 #include <linux/profile.h>
+#include <linux/oom.h>
 #include <linux/rmap.h>
 #include <linux/ksm.h>
 #include <linux/acct.h>
@@ -1304,6 +1305,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	spin_unlock(&current->sighand->siglock);
 	write_unlock_irq(&tasklist_lock);
 	proc_fork_connector(p);
+	if (likely(p->pid) && thread_group_leader(p))
+		oom_adj_changed(p);
 	cgroup_post_fork(p);
 	perf_event_fork(p);
 	return p;
@@ -13,10 +13,14 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -35,6 +39,10 @@ static int debug_mask = DEBUG_USER_STATE;
 #endif
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* Run handlers that set async in parallel within their level */
+static int async_enabled = 1;
+module_param_named(async, async_enabled, int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
 static void early_suspend(struct work_struct *work);
@@ -49,6 +57,9 @@ enum {
 	SUSPEND_REQUESTED_AND_SUSPENDED = SUSPEND_REQUESTED | SUSPENDED,
 };
 static int state;
+static LIST_HEAD(early_suspend_async_domain);
+static unsigned long early_suspend_us;
+static unsigned long late_resume_us;
 #ifdef CONFIG_HTC_ONMODE_CHARGING
 static LIST_HEAD(onchg_suspend_handlers);
 static void onchg_suspend(struct work_struct *work);
@@ -90,11 +101,58 @@ EXPORT_SYMBOL(unregister_early_suspend);
 void sys_sync_debug(void);
 #endif
 
+static void early_suspend_call(struct early_suspend *h, int resume)
+{
+	ktime_t start = ktime_get();
+
+	if (resume) {
+		h->resume(h);
+		h->resume_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	} else {
+		h->suspend(h);
+		h->suspend_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	}
+}
+
+static void early_suspend_async(void *data, async_cookie_t cookie)
+{
+	early_suspend_call(data, 0);
+}
+
+static void late_resume_async(void *data, async_cookie_t cookie)
+{
+	early_suspend_call(data, 1);
+}
+
+/*
+ * Call one handler, in parallel with the rest of its level if it is async.
+ * Every handler of the previous level has finished before it starts.
+ */
+static void early_suspend_run(struct early_suspend *h, int resume, int *level)
+{
+	if (!(resume ? h->resume : h->suspend))
+		return;
+
+	if (h->level != *level) {
+		async_synchronize_full_domain(&early_suspend_async_domain);
+		*level = h->level;
+	}
+
+	if (h->async && async_enabled)
+		async_schedule_domain(resume ? late_resume_async :
+				      early_suspend_async, h,
+				      &early_suspend_async_domain);
+	else
+		early_suspend_call(h, resume);
+}
+
 static void early_suspend(struct work_struct *work)
 {
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = INT_MIN;
+	ktime_t start;
 
 	pr_info("[R] early_suspend start\n");
 	mutex_lock(&early_suspend_lock);
@@ -118,10 +176,11 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
-			pos->suspend(pos);
-	}
+	start = ktime_get();
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		early_suspend_run(pos, 0, &level);
+	async_synchronize_full_domain(&early_suspend_async_domain);
+	early_suspend_us = ktime_to_us(ktime_sub(ktime_get(), start));
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -153,6 +212,8 @@ static void late_resume(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	int level = INT_MIN;
+	ktime_t start;
 
 	pr_info("[R] late_resume start\n");
 	mutex_lock(&early_suspend_lock);
@@ -174,11 +235,13 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
+	start = ktime_get();
 	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+		early_suspend_run(pos, 1, &level);
+	async_synchronize_full_domain(&early_suspend_async_domain);
+	late_resume_us = ktime_to_us(ktime_sub(ktime_get(), start));
 	if (debug_mask & DEBUG_SUSPEND)
-		pr_info("late_resume: done\n");
+		pr_info("late_resume: done in %lu us\n", late_resume_us);
 
 	wake_unlock(&no_suspend_wake_lock);
 
@@ -358,3 +421,44 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_stats_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(m, "last early_suspend %lu us, last late_resume %lu us\n",
+		   early_suspend_us, late_resume_us);
+	seq_printf(m, "level async suspend_us  resume_us handler\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(m, "%5d %5d %10lu %10lu %pf\n",
+			   pos->level, pos->async, pos->suspend_us,
+			   pos->resume_us,
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+
+	return 0;
+}
+
+static int early_suspend_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_stats_show, NULL);
+}
+
+static const struct file_operations early_suspend_stats_fops = {
+	.open		= early_suspend_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init early_suspend_debugfs_init(void)
+{
+	debugfs_create_file("early_suspend_stats", S_IRUGO, NULL, NULL,
+			    &early_suspend_stats_fops);
+	return 0;
+}
+late_initcall(early_suspend_debugfs_init);
+#endif
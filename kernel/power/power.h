@@ -240,6 +240,11 @@ extern struct workqueue_struct *suspend_work_queue;
 extern struct wake_lock main_wake_lock;
 extern struct wake_lock no_suspend_wake_lock;
 extern suspend_state_t requested_suspend_state;
+#ifdef CONFIG_WAKELOCK_STAT
+void wake_lock_set_uid(struct wake_lock *lock, uid_t uid);
+#else
+static inline void wake_lock_set_uid(struct wake_lock *lock, uid_t uid) {}
+#endif
 #endif
 
 #ifdef CONFIG_USER_WAKELOCK
@@ -21,6 +21,7 @@
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
 #endif
 #include "power.h"
 
@@ -42,7 +43,14 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
+/*
+ * Active locks without a timeout sit on active_wake_locks, so checking for
+ * one is a list_empty(). Active locks with a timeout are kept in
+ * timed_wake_locks ordered by expiry, so the first and last entries give
+ * the next and final expiry without walking every lock.
+ */
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+static struct rb_root timed_wake_locks[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -55,6 +63,21 @@ static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * Wake lock time charged per uid. A lock is charged to the uid that most
+ * recently acquired it through userwakelock; kernel locks are charged to
+ * uid 0. Entries are never freed.
+ */
+struct wake_lock_uid_stat {
+	struct list_head	link;
+	uid_t			uid;
+	int			count;
+	int			expire_count;
+	ktime_t			total_time;
+	ktime_t			active_time; /* scratch for printing */
+};
+static LIST_HEAD(uid_stats);
+static struct wake_lock_uid_stat root_uid_stat;
 
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
@@ -124,6 +147,7 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
 	struct wake_lock *lock;
+	struct rb_node *n;
 	int ret;
 	int type;
 
@@ -136,6 +160,98 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
 		list_for_each_entry(lock, &active_wake_locks[type], link)
 			ret = print_lock_stat(m, lock);
+		for (n = rb_first(&timed_wake_locks[type]); n; n = rb_next(n)) {
+			lock = rb_entry(n, struct wake_lock, node);
+			ret = print_lock_stat(m, lock);
+		}
+	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
+	return 0;
+}
+
+static struct wake_lock_uid_stat *find_uid_stat_locked(uid_t uid)
+{
+	struct wake_lock_uid_stat *entry;
+
+	list_for_each_entry(entry, &uid_stats, link) {
+		if (entry->uid == uid)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Charge @lock to @uid from now until it is next given a different owner */
+void wake_lock_set_uid(struct wake_lock *lock, uid_t uid)
+{
+	struct wake_lock_uid_stat *entry;
+	struct wake_lock_uid_stat *new_entry = NULL;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	entry = find_uid_stat_locked(uid);
+	if (!entry) {
+		spin_unlock_irqrestore(&list_lock, irqflags);
+		new_entry = kzalloc(sizeof(*new_entry), GFP_KERNEL);
+		if (!new_entry) {
+			pr_err("wake_lock_set_uid: failed to allocate uid %u\n",
+				uid);
+			return;
+		}
+		new_entry->uid = uid;
+		spin_lock_irqsave(&list_lock, irqflags);
+		entry = find_uid_stat_locked(uid);
+		if (!entry) {
+			entry = new_entry;
+			new_entry = NULL;
+			list_add_tail(&entry->link, &uid_stats);
+		}
+	}
+	lock->stat.uid_stat = entry;
+	spin_unlock_irqrestore(&list_lock, irqflags);
+	kfree(new_entry);
+}
+
+static void add_active_uid_time(struct wake_lock *lock, ktime_t now)
+{
+	struct wake_lock_uid_stat *entry = lock->stat.uid_stat;
+	ktime_t etime;
+
+	if (get_expired_time(lock, &etime))
+		now = etime;
+	entry->active_time = ktime_add(entry->active_time,
+				       ktime_sub(now, lock->stat.last_time));
+}
+
+static int wakelock_uid_stats_show(struct seq_file *m, void *unused)
+{
+	unsigned long irqflags;
+	struct wake_lock_uid_stat *entry;
+	struct wake_lock *lock;
+	struct rb_node *n;
+	ktime_t now;
+	int type;
+
+	spin_lock_irqsave(&list_lock, irqflags);
+
+	list_for_each_entry(entry, &uid_stats, link)
+		entry->active_time = ktime_set(0, 0);
+	now = ktime_get();
+	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
+		list_for_each_entry(lock, &active_wake_locks[type], link)
+			add_active_uid_time(lock, now);
+		for (n = rb_first(&timed_wake_locks[type]); n; n = rb_next(n)) {
+			lock = rb_entry(n, struct wake_lock, node);
+			add_active_uid_time(lock, now);
+		}
+	}
+
+	seq_puts(m, "uid\tcount\texpire_count\tactive_time\ttotal_time\n");
+	list_for_each_entry(entry, &uid_stats, link) {
+		seq_printf(m, "%u\t%d\t%d\t%lld\t%lld\n", entry->uid,
+			   entry->count, entry->expire_count,
+			   ktime_to_ns(entry->active_time),
+			   ktime_to_ns(ktime_add(entry->total_time,
+						 entry->active_time)));
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
@@ -152,10 +268,15 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	else
 		now = ktime_get();
 	lock->stat.count++;
-	if (expired)
+	lock->stat.uid_stat->count++;
+	if (expired) {
 		lock->stat.expire_count++;
+		lock->stat.uid_stat->expire_count++;
+	}
 	duration = ktime_sub(now, lock->stat.last_time);
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
+	lock->stat.uid_stat->total_time =
+		ktime_add(lock->stat.uid_stat->total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
@@ -167,41 +288,82 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	}
 }
 
+static void update_lock_sleep_wait_stats_locked(struct wake_lock *lock,
+						ktime_t elapsed, int done)
+{
+	ktime_t etime, add;
+	int expired;
+
+	expired = get_expired_time(lock, &etime);
+	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
+		if (expired)
+			add = ktime_sub(etime, last_sleep_time_update);
+		else
+			add = elapsed;
+		lock->stat.prevent_suspend_time = ktime_add(
+			lock->stat.prevent_suspend_time, add);
+	}
+	if (done || expired)
+		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
+	else
+		lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+}
+
 static void update_sleep_wait_stats_locked(int done)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
+	struct rb_node *n;
+	ktime_t now, elapsed;
 
 	now = ktime_get();
 	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
-		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link)
+		update_lock_sleep_wait_stats_locked(lock, elapsed, done);
+	for (n = rb_first(&timed_wake_locks[WAKE_LOCK_SUSPEND]); n;
+	     n = rb_next(n)) {
+		lock = rb_entry(n, struct wake_lock, node);
+		update_lock_sleep_wait_stats_locked(lock, elapsed, done);
 	}
 	last_sleep_time_update = now;
 }
 #endif
 
 
+static void add_timed_wake_lock(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &timed_wake_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *l;
+
+	while (*p) {
+		parent = *p;
+		l = rb_entry(parent, struct wake_lock, node);
+		if ((long)(lock->expires - l->expires) < 0)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&lock->node, parent, p);
+	rb_insert_color(&lock->node, &timed_wake_locks[type]);
+}
+
+/* Remove a lock from whichever list or tree its flags say it is on */
+static void unlink_wake_lock(struct wake_lock *lock)
+{
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->node,
+			 &timed_wake_locks[lock->flags & WAKE_LOCK_TYPE_MASK]);
+	else
+		list_del(&lock->link);
+}
+
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	unlink_wake_lock(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
@@ -211,42 +373,47 @@ static void expire_wake_lock(struct wake_lock *lock)
 static void print_active_locks(int type)
 {
 	struct wake_lock *lock;
+	struct rb_node *n;
 	bool print_expired = true;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	list_for_each_entry(lock, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout > 0)
-				pr_info("active wake lock %s, time left %ld\n",
-					lock->name, timeout);
-			else if (print_expired)
-				pr_info("wake lock %s, expired\n", lock->name);
-		} else {
-			pr_info("active wake lock %s\n", lock->name);
-			if (!(debug_mask & DEBUG_EXPIRE))
-				print_expired = false;
-		}
+		pr_info("active wake lock %s\n", lock->name);
+		if (!(debug_mask & DEBUG_EXPIRE))
+			print_expired = false;
+	}
+	for (n = rb_first(&timed_wake_locks[type]); n; n = rb_next(n)) {
+		long timeout;
+
+		lock = rb_entry(n, struct wake_lock, node);
+		timeout = lock->expires - jiffies;
+		if (timeout > 0)
+			pr_info("active wake lock %s, time left %ld\n",
+				lock->name, timeout);
+		else if (print_expired)
+			pr_info("wake lock %s, expired\n", lock->name);
 	}
 }
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	struct rb_node *n;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (!list_empty(&active_wake_locks[type]))
+		return -1;
+	while ((n = rb_first(&timed_wake_locks[type]))) {
+		lock = rb_entry(n, struct wake_lock, node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	n = rb_last(&timed_wake_locks[type]);
+	if (!n)
+		return 0;
+	lock = rb_entry(n, struct wake_lock, node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
@@ -366,6 +533,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
+	lock->stat.uid_stat = &root_uid_stat;
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
@@ -398,7 +566,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
-	list_del(&lock->link);
+	unlink_wake_lock(lock);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_destroy);
@@ -433,7 +601,7 @@ static void wake_lock_internal(
 		lock->stat.last_time = ktime_get();
 #endif
 	}
-	list_del(&lock->link);
+	unlink_wake_lock(lock);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -441,7 +609,7 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		add_timed_wake_lock(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
@@ -501,8 +669,8 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	unlink_wake_lock(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
 	if (type == WAKE_LOCK_SUSPEND) {
 		long has_lock = has_wake_lock_locked(type);
@@ -550,15 +718,31 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+static int wakelock_uid_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelock_uid_stats_show, NULL);
+}
+
+static const struct file_operations wakelock_uid_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_uid_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int __init wakelocks_init(void)
 {
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		timed_wake_locks[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
+	list_add(&root_uid_stat.link, &uid_stats);
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
 			"deleted_wake_locks");
 #endif
@@ -587,6 +771,7 @@ static int __init wakelocks_init(void)
 
 #ifdef CONFIG_WAKELOCK_STAT
 	proc_create("wakelocks", S_IRUGO, NULL, &wakelock_stats_fops);
+	proc_create("wakelock_uids", S_IRUGO, NULL, &wakelock_uid_stats_fops);
 #endif
 
 	return 0;
@@ -608,6 +793,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	remove_proc_entry("wakelock_uids", NULL);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -2612,6 +2612,57 @@ fire_sched_out_preempt_notifiers(struct task_struct *curr,
 
 #endif /* CONFIG_PREEMPT_NOTIFIERS */
 
+#ifdef CONFIG_CPU_FREQ
+
+static DEFINE_PER_CPU(struct sched_freq_hook *, sched_freq_hooks);
+
+/**
+ * sched_freq_hook_register - tell me about scheduler activity on a cpu
+ * @cpu: the cpu to watch
+ * @hook: hook struct to register
+ *
+ * The hook is called on @cpu itself, either from the scheduler tick or
+ * right after a context switch once the runqueue is unlocked. It always
+ * runs with interrupts disabled, so calls on one cpu never nest, and must
+ * not sleep. Only one hook per cpu is allowed.
+ */
+void sched_freq_hook_register(int cpu, struct sched_freq_hook *hook)
+{
+	WARN_ON(per_cpu(sched_freq_hooks, cpu));
+	rcu_assign_pointer(per_cpu(sched_freq_hooks, cpu), hook);
+}
+EXPORT_SYMBOL_GPL(sched_freq_hook_register);
+
+/**
+ * sched_freq_hook_unregister - no longer interested in scheduler activity
+ * @cpu: the cpu passed to sched_freq_hook_register()
+ *
+ * On return the old hook is no longer running on any cpu.
+ */
+void sched_freq_hook_unregister(int cpu)
+{
+	rcu_assign_pointer(per_cpu(sched_freq_hooks, cpu), NULL);
+	synchronize_sched();
+}
+EXPORT_SYMBOL_GPL(sched_freq_hook_unregister);
+
+static inline void fire_sched_freq_hook(int cpu, unsigned int event)
+{
+	struct sched_freq_hook *hook;
+
+	hook = rcu_dereference_sched(per_cpu(sched_freq_hooks, cpu));
+	if (hook)
+		hook->func(hook, cpu, event);
+}
+
+#else /* !CONFIG_CPU_FREQ */
+
+static inline void fire_sched_freq_hook(int cpu, unsigned int event)
+{
+}
+
+#endif /* CONFIG_CPU_FREQ */
+
 /**
  * prepare_task_switch - prepare to switch tasks
  * @rq: the runqueue preparing to switch
@@ -2654,6 +2705,7 @@ static void finish_task_switch(struct rq *rq, struct task_struct *prev)
 {
 	struct mm_struct *mm = rq->prev_mm;
 	long prev_state;
+	unsigned int freq_event = 0;
 
 	rq->prev_mm = NULL;
 
@@ -2669,6 +2721,10 @@ static void finish_task_switch(struct rq *rq, struct task_struct *prev)
 	 *		Manfred Spraul <manfred@colorfullife.com>
 	 */
 	prev_state = prev->state;
+	if (prev == rq->idle)
+		freq_event = SCHED_FREQ_IDLE_EXIT;
+	else if (current == rq->idle)
+		freq_event = SCHED_FREQ_IDLE_ENTER;
 	finish_arch_switch(prev);
 #ifdef __ARCH_WANT_INTERRUPTS_ON_CTXSW
 	local_irq_disable();
@@ -2680,6 +2736,14 @@ static void finish_task_switch(struct rq *rq, struct task_struct *prev)
 	finish_lock_switch(rq, prev);
 
 	fire_sched_in_preempt_notifiers(current);
+	if (freq_event) {
+		unsigned long flags;
+
+		/* The tick must not run the hook in the middle of this call */
+		local_irq_save(flags);
+		fire_sched_freq_hook(cpu_of(rq), freq_event);
+		local_irq_restore(flags);
+	}
 	if (mm)
 		mmdrop(mm);
 	if (unlikely(prev_state == TASK_DEAD)) {
@@ -3421,6 +3485,9 @@ void scheduler_tick(void)
 
 	perf_event_task_tick(curr);
 
+	if (curr != rq->idle)
+		fire_sched_freq_hook(cpu, SCHED_FREQ_TICK);
+
 #ifdef CONFIG_SMP
 	rq->idle_at_tick = idle_cpu(cpu);
 	trigger_load_balance(rq, cpu);
@@ -53,6 +53,19 @@ struct cleancache_ops cleancache_register_ops(struct cleancache_ops *ops)
 }
 EXPORT_SYMBOL(cleancache_register_ops);
 
+/*
+ * Memory held by the backend, in pages. A backend that keeps pages in
+ * RAM gives them back through its shrinker, so low memory heuristics
+ * can count them with the page cache.
+ */
+unsigned long cleancache_total_pages(void)
+{
+	if (!cleancache_enabled || !cleancache_ops.total_pages)
+		return 0;
+	return (*cleancache_ops.total_pages)();
+}
+EXPORT_SYMBOL(cleancache_total_pages);
+
 /* Called by a cleancache-enabled filesystem at time of mount */
 void __cleancache_init_fs(struct super_block *sb)
 {
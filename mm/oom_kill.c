@@ -504,6 +504,31 @@ int unregister_oom_notifier(struct notifier_block *nb)
 }
 EXPORT_SYMBOL_GPL(unregister_oom_notifier);
 
+static ATOMIC_NOTIFIER_HEAD(oom_adj_notify_list);
+
+int oom_adj_register(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(oom_adj_register);
+
+int oom_adj_unregister(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&oom_adj_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(oom_adj_unregister);
+
+/*
+ * oom_adj_changed - tell the oom_adj notifiers that process 'p', a thread
+ * group leader, was created or became leader, or that its oom_adj changed.
+ * Called in process context without locks held.
+ */
+void oom_adj_changed(struct task_struct *p)
+{
+	atomic_notifier_call_chain(&oom_adj_notify_list,
+				   p->signal->oom_adj, p);
+}
+
 /*
  * Try to acquire the OOM killer lock for the zones in zonelist.  Returns zero
  * if a parallel OOM killing is already taking place that includes a zone in